@@ -0,0 +1,77 @@
+#ifndef AF_XDP_COMMON_H
+#define AF_XDP_COMMON_H
+
+#include <linux/types.h>
+
+// Общие определения для XDP программ и пользовательской части.
+
+// Признак зонда измерения задержки.
+#define LATENCY_PROBE_MAGIC 0x50524f42 // "PROB"
+
+// Данные зонда измерения задержки. Зонд размещается в данных TCP сразу после
+// заголовков IPv4 и TCP, смещение вычисляется по полям ihl и doff.
+struct latency_probe {
+	__u32 magic; // Признак зонда.
+	__u32 seq;   // Порядковый номер.
+	__u64 ts;    // Время отправки в наносекундах (CLOCK_MONOTONIC отправителя).
+};
+
+// Режимы работы XDP программы xdp_kern.o.
+enum xdp_prog_mode {
+	XDP_PROG_REDIRECT = 0,  // Передача пакетов в сокеты через "xsks_map".
+	XDP_PROG_AGGREGATE = 1, // Подсчёт пакетов по потокам без передачи в пространство пользователя.
+	XDP_PROG_CAPTURE = 2,   // Копирование заголовков пакетов в кольцевой буфер "capture_ring".
+};
+
+// Настройки XDP программы, записываемые пространством пользователя в "config_map".
+struct xdp_config {
+	__u32 num_socks; // Количество доступных сокетов.
+	__u32 mode;      // Режим работы (enum xdp_prog_mode).
+	__u32 action;    // Действие над пакетами в режимах агрегации и захвата (XDP_PASS или XDP_DROP).
+	__u32 wakeup_bytes; // Объём данных в "capture_ring", после которого будится читатель.
+	// Выборка в режиме передачи в сокеты (0 или 1 - без выборки).
+	__u32 flow_sample_rate; // В сокеты передаётся 1 из N потоков целиком (по хэшу 5-tuple).
+	__u32 pkt_sample_rate;  // Из выбранных потоков передаётся 1 из M пакетов (случайно).
+	__u32 sample_seed;      // Начальное значение хэша, смена которого выбирает другие потоки.
+};
+
+// Максимальное количество потоков в таблице агрегации.
+// При переполнении вытесняются давно не обновлявшиеся потоки (LRU).
+#define MAX_FLOWS 65536
+
+// Ключ потока. IPv4 адреса хранятся в первом элементе массивов.
+// Все поля явные, чтобы ключ не содержал неинициализированных байт выравнивания.
+struct flow_key {
+	__u32 saddr[4];
+	__u32 daddr[4];
+	__u16 sport;   // Порт источника (сетевой порядок байт).
+	__u16 dport;   // Порт назначения (сетевой порядок байт).
+	__u8 proto;    // Протокол транспортного уровня.
+	__u8 version;  // Версия IP (4 или 6).
+	__u8 pad[2];
+};
+
+// Счётчики потока. В "per-CPU" таблице у каждого логического процессора свои значения.
+struct flow_stats {
+	__u64 packets;
+	__u64 bytes;
+	__u64 first_seen; // Время первого пакета (bpf_ktime_get_ns).
+	__u64 last_seen;  // Время последнего пакета (bpf_ktime_get_ns).
+};
+
+// Количество копируемых байт начала пакета в режиме захвата.
+#define CAPTURE_HDR_LEN 128
+// Размер кольцевого буфера захвата (степень двойки, кратная размеру страницы).
+#define CAPTURE_RING_SIZE (1 << 24)
+
+// Запись о пакете в кольцевом буфере захвата.
+struct capture_record {
+	__u64 ts;       // Время приёма (bpf_ktime_get_ns).
+	__u32 ifindex;  // Индекс сетевого интерфейса.
+	__u32 rx_queue; // Номер очереди приёма.
+	__u32 len;      // Полная длина пакета.
+	__u32 caplen;   // Количество скопированных байт в `hdr`.
+	__u8 hdr[CAPTURE_HDR_LEN];
+};
+
+#endif // AF_XDP_COMMON_H
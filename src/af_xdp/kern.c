@@ -1,6 +1,15 @@
 
 #include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/in.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
 #include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+
+#include "common.h"
 
 // Основан на примере из:
 //    https://github.com/xdp-project/bpf-examples/blob/main/AF_XDP-example/xdpsock_kern.c
@@ -15,24 +24,252 @@ struct {
 	__uint(value_size, sizeof(int));   // Размер значения, соответствующий некоторому ключу.
 } xsks_map SEC(".maps");             // Расположение структуры в секции ".maps" ELF файла.
 
-int num_socks = 0;          // Количество доступных сокетов.
-static unsigned int num_pkts = 0; // Количество захваченных пакетов.
+// Счётчики результатов работы программы по кодам XDP_*.
+// Отдельный счётчик на каждый логический процессор исключает атомарные операции.
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, XDP_REDIRECT + 1);
+	__type(key, __u32);
+	__type(value, __u64);
+} xdp_stats_map SEC(".maps");
+
+// Настройки программы (struct xdp_config), записываемые пространством пользователя.
+// В отличие от .bss, "map" сохраняется при замене программы (--hot-swap).
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, __u32);
+	__type(value, struct xdp_config);
+} config_map SEC(".maps");
+
+// Счётчики потоков для режима агрегации.
+// "Per-CPU" значения обновляются без атомарных операций, а LRU вытесняет
+// старые потоки вместо отказа в добавлении при заполнении таблицы.
+// Подробнее: https://docs.kernel.org/bpf/map_hash.html
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_PERCPU_HASH);
+	__uint(max_entries, MAX_FLOWS);
+	__type(key, struct flow_key);
+	__type(value, struct flow_stats);
+} flows_map SEC(".maps");
+
+// Кольцевой буфер для записей о пакетах в режиме захвата.
+// Общий для всех логических процессоров, сохраняет порядок записей и не требует UMEM.
+// Подробнее: https://docs.kernel.org/bpf/ringbuf.html
+struct {
+	__uint(type, BPF_MAP_TYPE_RINGBUF);
+	__uint(max_entries, CAPTURE_RING_SIZE);
+} capture_ring SEC(".maps");
+
+// Учёт результата работы программы.
+static __always_inline int
+count_action(int action) {
+	__u32 key = action;
+	__u64* value = bpf_map_lookup_elem(&xdp_stats_map, &key);
+
+	if (value)
+		*value += 1;
+	return action;
+}
+
+// Разбор заголовков пакета и заполнение ключа потока.
+// Возвращает 0 для пакетов IPv4/IPv6, иначе -1.
+static __always_inline int
+parse_flow(struct xdp_md* ctx, struct flow_key* key) {
+	void* data = (void*)(long)ctx->data;
+	void* data_end = (void*)(long)ctx->data_end;
+	struct ethhdr* eth = data;
+	void* l4;
+
+	// Проверка границ обязательна для верификатора.
+	if ((void*)(eth + 1) > data_end)
+		return -1;
+
+	if (eth->h_proto == bpf_htons(ETH_P_IP)) {
+		struct iphdr* ip = (void*)(eth + 1);
+
+		if ((void*)(ip + 1) > data_end)
+			return -1;
+		key->saddr[0] = ip->saddr;
+		key->daddr[0] = ip->daddr;
+		key->proto = ip->protocol;
+		key->version = 4;
+		l4 = (void*)ip + ip->ihl * 4;
+	} else if (eth->h_proto == bpf_htons(ETH_P_IPV6)) {
+		struct ipv6hdr* ip6 = (void*)(eth + 1);
+
+		if ((void*)(ip6 + 1) > data_end)
+			return -1;
+		__builtin_memcpy(key->saddr, &ip6->saddr, sizeof(key->saddr));
+		__builtin_memcpy(key->daddr, &ip6->daddr, sizeof(key->daddr));
+		// Заголовки расширений не разбираются, такие пакеты учитываются без портов.
+		key->proto = ip6->nexthdr;
+		key->version = 6;
+		l4 = ip6 + 1;
+	} else {
+		return -1;
+	}
+
+	// Порты TCP и UDP расположены в начале заголовка одинаково.
+	if (key->proto == IPPROTO_TCP || key->proto == IPPROTO_UDP) {
+		struct udphdr* udp = l4;
+
+		if ((void*)(udp + 1) > data_end)
+			return 0;
+		key->sport = udp->source;
+		key->dport = udp->dest;
+	}
+	return 0;
+}
+
+// Перемешивание битов 32-битного значения (финализатор MurmurHash3).
+static __always_inline __u32
+mix32(__u32 h) {
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+// Хэш одной стороны соединения (адрес и порт).
+static __always_inline __u32
+endpoint_hash(const __u32* addr, __u16 port, __u32 seed) {
+	__u32 h = seed ^ port;
+
+#pragma unroll
+	for (int i = 0; i < 4; i++)
+		h = mix32(h ^ addr[i]);
+	return h;
+}
+
+// Хэш потока, одинаковый для обоих направлений соединения,
+// чтобы выборка сохраняла или отбрасывала разговор целиком.
+static __always_inline __u32
+flow_hash(const struct flow_key* key, __u32 seed) {
+	__u32 src = endpoint_hash(key->saddr, key->sport, seed);
+	__u32 dst = endpoint_hash(key->daddr, key->dport, seed);
+
+	return mix32(src ^ dst ^ key->proto);
+}
+
+// Проверка попадания пакета в выборку.
+// Пакеты без IP заголовка проходят только выборку по пакетам.
+static __always_inline int
+sampled(struct xdp_md* ctx, const struct xdp_config* cfg) {
+	__u32 flow_rate = cfg->flow_sample_rate;
+	__u32 pkt_rate = cfg->pkt_sample_rate;
+
+	if (flow_rate > 1) {
+		struct flow_key flow = {};
+
+		if (!parse_flow(ctx, &flow) && flow_hash(&flow, cfg->sample_seed) % flow_rate)
+			return 0;
+	}
+
+	// Подробнее: https://docs.ebpf.io/linux/helper-function/bpf_get_prandom_u32/
+	if (pkt_rate > 1 && bpf_get_prandom_u32() % pkt_rate)
+		return 0;
+	return 1;
+}
+
+// Учёт пакета длиной `len` в счётчиках потока.
+static __always_inline void
+update_flow(const struct flow_key* key, __u64 len) {
+	__u64 now = bpf_ktime_get_ns();
+	struct flow_stats* stats;
+
+	stats = bpf_map_lookup_elem(&flows_map, key);
+	if (stats) {
+		// Значение принадлежит текущему логическому процессору, поэтому атомарность не нужна.
+		stats->packets++;
+		stats->bytes += len;
+		stats->last_seen = now;
+		return;
+	}
+
+	struct flow_stats init = {
+		.packets = 1,
+		.bytes = len,
+		.first_seen = now,
+		.last_seen = now,
+	};
+	// При добавлении из XDP программы значения остальных процессоров обнуляются.
+	// Подробнее: https://docs.ebpf.io/linux/map-type/BPF_MAP_TYPE_LRU_PERCPU_HASH/
+	bpf_map_update_elem(&flows_map, key, &init, BPF_NOEXIST);
+}
+
+// Запись начала пакета в кольцевой буфер захвата.
+// Читатель будится только после накопления `wakeup_bytes` данных,
+// поэтому один вызов epoll_wait обрабатывает сразу много записей.
+static __always_inline void
+capture_packet(struct xdp_md* ctx, const struct xdp_config* cfg) {
+	struct capture_record* rec;
+	__u32 len = bpf_xdp_get_buff_len(ctx);
+	__u32 caplen = len < CAPTURE_HDR_LEN ? len : CAPTURE_HDR_LEN;
+	__u64 flags = BPF_RB_NO_WAKEUP;
+
+	// Место резервируется сразу в буфере, что исключает промежуточное копирование.
+	// Подробнее: https://docs.ebpf.io/linux/helper-function/bpf_ringbuf_reserve/
+	rec = bpf_ringbuf_reserve(&capture_ring, sizeof(*rec), 0);
+	if (!rec)
+		return;
+
+	rec->ts = bpf_ktime_get_ns();
+	rec->ifindex = ctx->ingress_ifindex;
+	rec->rx_queue = ctx->rx_queue_index;
+	rec->len = len;
+	rec->caplen = caplen;
+	// Копирование работает и для пакетов из нескольких фрагментов.
+	// Подробнее: https://docs.ebpf.io/linux/helper-function/bpf_xdp_load_bytes/
+	if (!caplen || bpf_xdp_load_bytes(ctx, 0, rec->hdr, caplen)) {
+		bpf_ringbuf_discard(rec, BPF_RB_NO_WAKEUP);
+		return;
+	}
+
+	// Подробнее: https://docs.ebpf.io/linux/helper-function/bpf_ringbuf_query/
+	if (bpf_ringbuf_query(&capture_ring, BPF_RB_AVAIL_DATA) >= cfg->wakeup_bytes)
+		flags = BPF_RB_FORCE_WAKEUP;
+	bpf_ringbuf_submit(rec, flags);
+}
 
 SEC("xdp") // Расположение функции в секции "xdp_sock" ELF файла.
 int xdp_sock_prog(struct xdp_md *ctx) { // Структура xdp_md хранит данные пакета.
-	const char fmt[] = "NUM %d for %d\n";
-  // Отправка каждого 10-го пакета вверх по сетевому стеку
-  // и вывод информации о количестве захваченных пакетов.
-  if ((++num_pkts % 10) == 0) {
-    bpf_trace_printk(fmt, sizeof(fmt), num_pkts, num_socks);
-    return XDP_PASS;
-  }
+	struct xdp_config* cfg;
+	__u32 key = 0;
+
+	cfg = bpf_map_lookup_elem(&config_map, &key);
+	if (!cfg)
+		return count_action(XDP_ABORTED);
+
+	// В режиме агрегации пакеты только учитываются и не передаются в сокеты.
+	if (cfg->mode == XDP_PROG_AGGREGATE) {
+		struct flow_key flow = {};
+
+		// Длина всех фрагментов пакета.
+		// Подробнее: https://docs.ebpf.io/linux/helper-function/bpf_xdp_get_buff_len/
+		if (!parse_flow(ctx, &flow))
+			update_flow(&flow, bpf_xdp_get_buff_len(ctx));
+		return count_action(cfg->action);
+	}
+
+	// В режиме захвата в пространство пользователя передаются только заголовки.
+	if (cfg->mode == XDP_PROG_CAPTURE) {
+		capture_packet(ctx, cfg);
+		return count_action(cfg->action);
+	}
+
+  // Пакеты вне выборки отправляются вверх по сетевому стеку.
+  // Ограничение выборки снижает нагрузку на сокеты при всплесках трафика.
+  if (!sampled(ctx, cfg))
+    return count_action(XDP_PASS);
   // Функция bpf_redirect_map заполняет ряд структур в ядре,
   // что в случае успеха возвращает значение XDP_REDIRECT.
   // Вызывающая сторона в случае значения XDP_REDIRECT вызывает
   // функцию передачи пакета в нужный сокет на основе заполненных структур.
   // Распределение происходит на основе номер логического процессора.
-	return bpf_redirect_map(&xsks_map, bpf_get_smp_processor_id(), XDP_DROP);
+	return count_action(bpf_redirect_map(&xsks_map, bpf_get_smp_processor_id(), XDP_DROP));
 }
 
 char _license[] SEC("license") = "GPL";
\ No newline at end of file
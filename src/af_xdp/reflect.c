@@ -0,0 +1,49 @@
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/in.h>
+#include <linux/ip.h>
+#include <linux/tcp.h>
+#include <bpf/bpf_endian.h>
+#include <bpf/bpf_helpers.h>
+
+#include "common.h"
+
+// Программа-отражатель для измерения задержки (режим --ping на другой стороне).
+// Зонды возвращаются отправителю из драйвера через XDP_TX без участия
+// пользовательского пространства, остальные пакеты передаются в сетевой стек.
+
+SEC("xdp")
+int xdp_reflect_prog(struct xdp_md *ctx) {
+	void* data = (void*)(long)ctx->data;
+	void* data_end = (void*)(long)ctx->data_end;
+	struct ethhdr* eth = data;
+	struct iphdr* ip = (void*)(eth + 1);
+	struct tcphdr* tcp;
+	struct latency_probe* probe;
+	unsigned char tmp[ETH_ALEN];
+
+	// Проверка границ обязательна для верификатора.
+	if ((void*)(ip + 1) > data_end)
+		return XDP_PASS;
+	if (eth->h_proto != bpf_htons(ETH_P_IP) || ip->protocol != IPPROTO_TCP || ip->ihl < 5)
+		return XDP_PASS;
+	tcp = (void*)ip + ip->ihl * 4;
+	if ((void*)(tcp + 1) > data_end || tcp->doff < 5)
+		return XDP_PASS;
+	// Зонд находится в данных TCP сразу после заголовка.
+	probe = (void*)tcp + tcp->doff * 4;
+	if ((void*)(probe + 1) > data_end)
+		return XDP_PASS;
+	if (probe->magic != LATENCY_PROBE_MAGIC)
+		return XDP_PASS;
+
+	// Обмен MAC адресов отправителя и получателя.
+	__builtin_memcpy(tmp, eth->h_dest, ETH_ALEN);
+	__builtin_memcpy(eth->h_dest, eth->h_source, ETH_ALEN);
+	__builtin_memcpy(eth->h_source, tmp, ETH_ALEN);
+
+	// Отправка пакета обратно через ту же очередь сетевого интерфейса.
+	return XDP_TX;
+}
+
+char _license[] SEC("license") = "GPL";
@@ -11,6 +11,7 @@
 #include <linux/if_xdp.h>
 #include <linux/if_ether.h>
 #include <linux/ip.h>
+#include <linux/tcp.h>
 #include <linux/limits.h>
 #include <linux/udp.h>
 #include <arpa/inet.h>
@@ -30,6 +31,7 @@
 #include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <time.h>
 #include <unistd.h>
@@ -42,6 +44,8 @@
 #include <bpf/libbpf.h>
 #include <bpf/bpf.h>
 
+#include "common.h"
+
 // Основан на примере:
 //   https://github.com/xdp-project/bpf-examples/blob/main/AF_XDP-example/xdpsock.c
 
@@ -51,12 +55,21 @@
 #endif
 // Определение флага последнего фрагмента пакета.
 #define IS_EOP_DESC(options) (!((options) & XDP_PKT_CONTD))
+// Определение флага поддержки пакетов из нескольких фрагментов (multi-buffer).
+#ifndef XDP_USE_SG
+#define XDP_USE_SG (1 << 4)
+#endif
+// Максимальное количество фрагментов в пакете.
+// Соответствует ограничению ядра: MAX_SKB_FRAGS фрагментов и линейная часть.
+#define XSK_MAX_FRAGS 18
 
 // Максимальное количество сокетов для захвата пакетов.
 // Взято на основе максимального количества логических процессоров.
 #define MAX_SOCKS 32
-// Количество повторов для отправки пакетов.
-#define TX_RETRIES_COUNT 3
+// Время ожидания (в секундах) подтверждения отправки пакетов при завершении работы.
+#define TX_COMPLETE_TIMEOUT 3
+// Накладные расходы Ethernet на линии: преамбула (8), FCS (4) и межкадровый интервал (12).
+#define ETH_WIRE_OVERHEAD 24
 
 
 // Настройки очереди.
@@ -67,10 +80,43 @@
 // Флаг вывода данных о полученных пакетах.
 #define DEBUG_HEXDUMP 1
 
+// Максимальное количество потоков обработки на один сокет.
+#define MAX_WORKERS 16
+// Минимальный размер блока при адаптивном выборе размера.
+#define BATCH_MIN 4
+// Количество опросов колец, по которым принимается решение об изменении размера блока.
+#define BATCH_CTL_WINDOW 256
+
+// Количество ячеек UMEM для приёма ответов в режиме измерения задержки.
+#define PING_RX_FRAMES (NUM_FRAMES / 2)
+
+// Размер колец передачи адресов между потоком приёма и потоками обработки.
+// Равен количеству ячеек UMEM, поэтому кольцо никогда не переполняется.
+#define PIPE_RING_SIZE NUM_FRAMES
+
 // Режимы работы программы.
 enum mode_type {
 	MODE_RXONLY = 0,
 	MODE_TXONLY = 1,
+	MODE_PING = 2,    // Отправка зондов и измерение времени до ответа.
+	MODE_REFLECT = 3, // Отражение полученных пакетов отправителю.
+	MODE_AGGREGATE = 4, // Подсчёт пакетов по потокам в XDP программе без сокетов.
+	MODE_CAPTURE = 5, // Захват заголовков через кольцевой буфер BPF без сокетов.
+};
+
+// Гистограмма задержек с логарифмически-линейными интервалами (как в HdrHistogram):
+// каждый интервал [2^k, 2^(k+1)) разбит на 2^HIST_SUB_BITS равных частей,
+// поэтому относительная погрешность не превышает 1/2^HIST_SUB_BITS.
+#define HIST_SUB_BITS 5
+#define HIST_SIZE ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct latency_hist {
+	uint64_t counts[HIST_SIZE];
+	uint64_t total;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t lost; // Зонды, ответ на которые не получен за время ожидания.
 };
 
 // Структура с данными о кольце UMEM.
@@ -81,6 +127,72 @@ struct umem_info {
 	void* buffer;
 };
 
+// Структура с состоянием ограничителя скорости отправки (token bucket).
+struct tx_pacing {
+	uint64_t start_ns;   // Время начала отправки.
+	uint64_t last_ns;    // Время последнего пополнения "ведра".
+	uint64_t prev_ns;    // Время отправки предыдущего блока.
+	uint32_t prev_pkts;  // Количество пакетов в предыдущем блоке.
+	double tokens;       // Количество пакетов, которые можно отправить.
+	uint64_t batches;    // Количество отправленных блоков.
+	uint64_t jitter_sum; // Сумма отклонений интервалов между блоками от целевых (нс).
+	uint64_t jitter_max; // Максимальное отклонение (нс).
+};
+
+// Пакет, собранный из одного или нескольких фрагментов (multi-buffer).
+// Данные не копируются: фрагменты представлены списком указателей на ячейки UMEM.
+struct xsk_frame {
+	struct iovec iov[XSK_MAX_FRAGS]; // Данные фрагментов в UMEM.
+	uint64_t addrs[XSK_MAX_FRAGS];   // Адреса фрагментов из дескрипторов.
+	uint32_t nr_frags;
+	uint32_t len;                    // Суммарная длина пакета.
+};
+
+// Кольцо "один производитель - один потребитель" для передачи дескрипторов UMEM
+// между потоками без копирования самих пакетов.
+struct pipe_ring {
+	uint32_t prod __attribute__((aligned(64))); // Изменяется только производителем.
+	uint32_t cons __attribute__((aligned(64))); // Изменяется только потребителем.
+	struct xdp_desc descs[PIPE_RING_SIZE] __attribute__((aligned(64)));
+};
+
+// Структура с данными о потоке обработки пакетов.
+struct worker_info {
+	struct pipe_ring* in;  // Дескрипторы полученных пакетов от потока приёма.
+	struct pipe_ring* ret; // Адреса обработанных ячеек для возврата в очередь fill.
+	struct socket_info* xsk;
+	struct xsk_frame frame; // Собираемый пакет.
+	uint64_t pkt_count;
+};
+
+// Состояние регулятора размера блока.
+// Размер увеличивается вдвое при накоплении пакетов в кольце (пропускная способность)
+// и уменьшается вдвое при частых пустых опросах (задержка).
+struct batch_ctl {
+	uint32_t size;      // Текущий размер блока.
+	uint32_t polls;     // Опросов в текущем окне.
+	uint32_t empty;     // Пустых опросов в текущем окне.
+	uint64_t occupancy; // Сумма заполненности кольца в текущем окне.
+	uint64_t changes;   // Количество изменений размера.
+	uint64_t size_sum;  // Сумма размеров по всем опросам (для среднего значения).
+	uint64_t polls_total;
+};
+
+// Этапы настройки сокета.
+enum setup_phase {
+	PHASE_MMAP,     // Выделение памяти под UMEM.
+	PHASE_PREFAULT, // Выделение страниц памяти UMEM.
+	PHASE_UMEM,     // Регистрация UMEM в ядре.
+	PHASE_SOCKET,   // Создание и настройка сокета.
+	PHASE_RINGS,    // Заполнение очереди fill и шаблонов пакетов.
+	PHASE_MAX,
+};
+
+// Длительность этапов настройки сокета в наносекундах.
+struct setup_times {
+	uint64_t ns[PHASE_MAX];
+};
+
 // Структура c данными о сокете.
 struct socket_info {
 	struct xsk_ring_cons rx;
@@ -89,6 +201,28 @@ struct socket_info {
 	struct umem_info* umem;
 	uint64_t tx_count;
 	uint64_t rx_count;
+	// Количество фрагментов, переданных ядру и ещё не вернувшихся в очередь completion.
+	uint64_t outstanding_tx;
+	struct tx_pacing pacing;
+	// Потоки обработки пакетов (режим конвейера).
+	struct worker_info* workers;
+	uint32_t next_worker;
+	// Количество ячеек UMEM, находящихся у потоков обработки.
+	// Ячейка принадлежит либо ядру (очереди fill и rx), либо потокам обработки.
+	uint64_t frames_in_workers;
+	// Флаг завершения работы потока приёма.
+	bool rx_stopped;
+	// Собираемый пакет, фрагменты которого ещё не все прочитаны.
+	struct xsk_frame frame;
+	// Количество прочитанных дескрипторов (фрагментов).
+	uint64_t rx_frags;
+	// Гистограмма задержек (режим --ping).
+	struct latency_hist* hist;
+	// Регулятор размера блока.
+	struct batch_ctl batch;
+	// Значения счётчиков на момент предыдущего вывода статистики.
+	uint64_t prev_rx_count;
+	uint64_t prev_tx_count;
 };
 
 // Режим работы XDP.
@@ -102,7 +236,12 @@ static int opt_ifindex;
 // Флаг окончания работы.
 static bool work_done;
 // Размер блока пакетов для принятия/отправки.
+// При адаптивном выборе размера - максимальный размер блока.
 static uint32_t opt_batch_size = 64;
+// Флаг адаптивного выбора размера блока.
+static bool opt_adaptive_batch = false;
+// Интервал вывода статистики в секундах (0 - только при завершении).
+static int opt_interval = 0;
 // Количество пакетов для отправки.
 static int opt_pkt_count;
 // Размер пакета/фрагмента в очереди.
@@ -115,6 +254,8 @@ static uint32_t opt_xdp_bind_flags = XDP_USE_NEED_WAKEUP;
 static uint32_t opt_umem_flags = 0;
 // Флаг использования невыровненных пакетов.
 static int opt_unaligned_chunks = 0;
+// Флаг поддержки пакетов из нескольких фрагментов (multi-buffer).
+static bool opt_frags = false;
 // Флаги настройки системного вызова mmap.
 static int opt_mmap_flags = 0;
 // Длина пакета/фрагмента в кольце UMEM.
@@ -127,6 +268,10 @@ static int opt_timeout = 1000;
 static bool opt_need_wakeup = true;
 // Количество очередей приёма пакетов.
 static uint32_t opt_num_xsks = 1;
+// Количество потоков обработки на один сокет (0 - обработка в потоке приёма).
+static uint32_t opt_workers = 0;
+// Количество сокетов, обслуживаемых одним потоком приёма/отправки.
+static uint32_t opt_xsks_per_thread = 1;
 // Флаг режима "busy_poll".
 static bool opt_busy_poll = false;
 // Флаг необходимости установки XDP в ядро.
@@ -135,9 +280,41 @@ static bool opt_load_xdp = false;
 static const char* opt_xdp_path = "";
 // Указатель на загруженную в ядро XDP.
 static struct xdp_program* xdp_prog = NULL;
+// Флаг поддержки замены XDP программы без пересоздания сокетов.
+static bool opt_hot_swap = false;
+// Объектный файл загруженной XDP программы и файловый дескриптор "bpf_link"
+// для режима замены программы.
+static struct bpf_object* xdp_obj = NULL;
+static int xdp_link_fd = -1;
+// Флаг параллельной настройки сокетов с заблаговременным выделением страниц UMEM.
+static bool opt_parallel_setup = false;
+// Мьютекс для последовательного создания сокетов при параллельной настройке.
+static pthread_mutex_t setup_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Флаг запроса замены XDP программы (устанавливается сигналом SIGHUP).
+static volatile sig_atomic_t reload_xdp = 0;
+// Действие XDP программы над пакетами в режиме агрегации.
+static uint32_t opt_agg_action = XDP_PASS;
+// Доля потоков (1 из N) и пакетов (1 из M), передаваемых в сокеты.
+static uint32_t opt_flow_sample = 1;
+static uint32_t opt_pkt_sample = 1;
+// Начальное значение хэша выборки потоков: другое значение выбирает другие потоки.
+static uint32_t opt_sample_seed = 0;
+// Количество записей захвата, после накопления которых будится поток чтения.
+static uint32_t opt_wakeup_batch = 64;
+
+// Счётчики режима захвата.
+struct capture_stats {
+	uint64_t records;
+	uint64_t bytes;      // Суммарная длина захваченных пакетов.
+	uint64_t wakeups;    // Количество пробуждений с непустым буфером.
+	uint64_t prev_records;
+	uint64_t prev_wakeups;
+};
 
-// Количество попыток отправки пакетов перед ошибкой.
-static int retries_count = TX_RETRIES_COUNT;
+// Целевая скорость отправки в пакетах в секунду (0 - без ограничения).
+static uint64_t opt_tx_rate_pps = 0;
+// Целевая скорость отправки в битах в секунду (0 - без ограничения).
+static uint64_t opt_tx_rate_bps = 0;
 
 // Данные для отправки пакета.
 char syn_pkt[] = {
@@ -153,8 +330,13 @@ char syn_pkt[] = {
 	0x03, 0x07
 }; // 192.168.1.2	192.168.0.10	TCP	74	35980 → 80 [SYN] Seq=0 Win=64240
 
+// Смещение зонда измерения задержки от начала кадра (после заголовков `syn_pkt`).
+static uint32_t probe_offset;
+
 // Количество открытых сокетов.
 static int num_socks = 0;
+// Количество работающих потоков приёма/отправки.
+static int io_threads_running = 0;
 // Массив с данными о сокетах.
 static struct socket_info* xsks[MAX_SOCKS];
 
@@ -163,6 +345,11 @@ static void int_exit(int sig) {
 	work_done = true;
 }
 
+// Функция обработки сигнала замены XDP программы.
+static void hup_reload(int sig) {
+	reload_xdp = 1;
+}
+
 // Функция вывода пакета в hex виде.
 static void
 hex_dump(void* pkt, size_t length, uint64_t addr) {
@@ -208,9 +395,53 @@ get_nsecs(void) {
 	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
 }
 
+// Функция вычисления контрольной суммы заголовка IPv4.
+// Подробнее: https://www.rfc-editor.org/rfc/rfc1071
+static uint16_t
+ip_checksum(const void* hdr, size_t len) {
+	const uint16_t* p = hdr;
+	uint32_t sum = 0;
+
+	for (; len > 1; len -= 2)
+		sum += *p++;
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum;
+}
+
+// Функция вычисления смещения зонда: зонд размещается в данных TCP сразу после
+// заголовков IPv4 и TCP (с опциями) шаблонного пакета.
+static uint32_t
+probe_frame_offset(const char* frame) {
+	const struct iphdr* ip = (const struct iphdr*)(frame + ETH_HLEN);
+	const struct tcphdr* tcp = (const struct tcphdr*)((const char*)ip + ip->ihl * 4);
+
+	return ETH_HLEN + ip->ihl * 4 + tcp->doff * 4;
+}
+
+// Функция заполнения кадра зонда шаблонным пакетом. Длина IPv4 увеличивается на размер
+// зонда, иначе зонд попадает в концевик кадра Ethernet и может быть отброшен.
+static void
+probe_frame_init(char* frame) {
+	struct iphdr* ip = (struct iphdr*)(frame + ETH_HLEN);
+
+	memcpy(frame, syn_pkt, sizeof(syn_pkt));
+	ip->tot_len = htons(probe_offset - ETH_HLEN + sizeof(struct latency_probe));
+	ip->check = 0;
+	ip->check = ip_checksum(ip, ip->ihl * 4);
+}
+
 // Функция удаления XDP из ядра.
 static void
 remove_xdp_program(void) {
+	if (opt_hot_swap) {
+		// Закрытие последнего дескриптора "bpf_link" отключает программу от интерфейса.
+		if (xdp_link_fd >= 0)
+			close(xdp_link_fd);
+		bpf_object__close(xdp_obj);
+		return;
+	}
+
 	// Удаление XDP программы из сетевого интерфейса.
 	// Подробнее: https://docs.ebpf.io/ebpf-library/libbpf/userspace/bpf_xdp_detach
 	int err = xdp_program__detach(xdp_prog, opt_ifindex, opt_attach_mode, 0);
@@ -231,6 +462,88 @@ __exit_with_error(int error, const char* file, const char* func,
 }
 #define exit_with_error(error) __exit_with_error(error, __FILE__, __func__, __LINE__)
 
+// Функция открытия и загрузки в ядро объектного файла XDP программы.
+// Если передан объект текущей программы, новая программа использует те же "maps"
+// (кроме внутренних, вроде .bss), поэтому сокеты и счётчики сохраняются.
+static struct bpf_object*
+open_xdp_object(struct bpf_object* old) {
+	struct bpf_object* obj;
+	struct bpf_program* prog;
+	struct bpf_map* map;
+	int err;
+
+	// Подробнее: https://docs.ebpf.io/ebpf-library/libbpf/userspace/bpf_object__open_file/
+	obj = bpf_object__open_file(opt_xdp_path, NULL);
+	err = libbpf_get_error(obj);
+	if (err) {
+		fprintf(stderr, "ERROR: opening %s failed: %s\n", opt_xdp_path, strerror(-err));
+		return NULL;
+	}
+
+	if (old) {
+		bpf_object__for_each_map(map, obj) {
+			struct bpf_map* old_map;
+
+			if (bpf_map__is_internal(map))
+				continue;
+			old_map = bpf_object__find_map_by_name(old, bpf_map__name(map));
+			if (!old_map)
+				continue;
+			// Подробнее: https://docs.ebpf.io/ebpf-library/libbpf/userspace/bpf_map__reuse_fd/
+			err = bpf_map__reuse_fd(map, bpf_map__fd(old_map));
+			if (err) {
+				fprintf(stderr, "ERROR: reusing map %s failed: %s\n",
+					bpf_map__name(map), strerror(-err));
+				bpf_object__close(obj);
+				return NULL;
+			}
+		}
+	}
+
+	// Пакеты из нескольких фрагментов передаются только программам с их поддержкой.
+	if (opt_frags) {
+		bpf_object__for_each_program(prog, obj)
+			bpf_program__set_flags(prog, bpf_program__flags(prog) | BPF_F_XDP_HAS_FRAGS);
+	}
+
+	// Загрузка программы в ядро. Несовместимые "maps" приводят к ошибке.
+	// Подробнее: https://docs.ebpf.io/ebpf-library/libbpf/userspace/bpf_object__load/
+	err = bpf_object__load(obj);
+	if (err) {
+		fprintf(stderr, "ERROR: loading %s failed: %s\n", opt_xdp_path, strerror(-err));
+		bpf_object__close(obj);
+		return NULL;
+	}
+
+	return obj;
+}
+
+// Функция получения файлового дескриптора первой программы объектного файла.
+static int
+xdp_object_prog_fd(struct bpf_object* obj) {
+	return bpf_program__fd(bpf_object__next_program(obj, NULL));
+}
+
+// Функция загрузки XDP в ядро с закреплением через "bpf_link".
+// В отличие от xdp_program__attach, такую программу можно атомарно заменить.
+static void
+load_xdp_link(void) {
+	LIBBPF_OPTS(bpf_link_create_opts, opts,
+		.flags = opt_attach_mode == XDP_MODE_SKB ? XDP_FLAGS_SKB_MODE : XDP_FLAGS_DRV_MODE);
+
+	xdp_obj = open_xdp_object(NULL);
+	if (!xdp_obj)
+		exit(EXIT_FAILURE);
+
+	// Подробнее: https://docs.ebpf.io/ebpf-library/libbpf/userspace/bpf_link_create/
+	xdp_link_fd = bpf_link_create(xdp_object_prog_fd(xdp_obj), opt_ifindex, BPF_XDP, &opts);
+	if (xdp_link_fd < 0) {
+		fprintf(stderr, "ERROR: attaching program failed: %s\n", strerror(errno));
+		bpf_object__close(xdp_obj);
+		exit(EXIT_FAILURE);
+	}
+}
+
 // Функция загрузки XDP в ядро.
 static void
 load_xdp_program(void) {
@@ -240,6 +553,11 @@ load_xdp_program(void) {
 	if (!opt_load_xdp)
 		return;
 
+	if (opt_hot_swap) {
+		load_xdp_link();
+		return;
+	}
+
 	// Чтение объектного файла с байткодом eBPT.
 	// Подробнее: https://docs.ebpf.io/ebpf-library/libxdp/functions/xdp_program__open_file
 	xdp_prog = xdp_program__open_file(opt_xdp_path, NULL, NULL);
@@ -250,6 +568,17 @@ load_xdp_program(void) {
 		exit(EXIT_FAILURE);
 	}
 
+	// Пакеты из нескольких фрагментов передаются только программам с их поддержкой.
+	// Подробнее: https://docs.ebpf.io/ebpf-library/libxdp/functions/xdp_program__set_xdp_frags_support/
+	if (opt_frags) {
+		err = xdp_program__set_xdp_frags_support(xdp_prog, true);
+		if (err) {
+			libxdp_strerror(err, errmsg, sizeof(errmsg));
+			fprintf(stderr, "ERROR: enabling frags support failed: %s\n", errmsg);
+			exit(EXIT_FAILURE);
+		}
+	}
+
 	// Установка XDP программы в ядро и закрепление её за очередью сетевого интерфейса.
 	err = xdp_program__attach(xdp_prog, opt_ifindex, opt_attach_mode, 0);
 	if (err) {
@@ -321,34 +650,56 @@ lookup_bpf_map(int prog_fd) {
 	return xsks_map_fd;
 }
 
-// Функция добавления в "map" с названием "xsks_map" файловых дескрипторов сокетов.
-static void
-enter_xsks_into_map(void) {
-	struct bpf_map* data_map;
-	int xsks_map;
-	int key = 0;
+// Функция записи настроек в "map" с названием "config_map".
+// Настройки записываются один раз при запуске. "Map" сохраняется при замене программы,
+// поэтому значения, изменённые во время работы (например, через bpftool), не сбрасываются.
+// Возвращает 0 при успехе и -1 при ошибке.
+static int
+write_xdp_config(struct bpf_object* obj) {
+	struct xdp_config cfg = {
+		.num_socks = num_socks,
+		.mode = opt_mode == MODE_AGGREGATE ? XDP_PROG_AGGREGATE :
+			opt_mode == MODE_CAPTURE ? XDP_PROG_CAPTURE : XDP_PROG_REDIRECT,
+		.action = opt_agg_action,
+		// Каждая запись в кольцевом буфере предваряется 8-байтовым заголовком.
+		.wakeup_bytes = opt_wakeup_batch * (sizeof(struct capture_record) + 8),
+		.flow_sample_rate = opt_flow_sample,
+		.pkt_sample_rate = opt_pkt_sample,
+		.sample_seed = opt_sample_seed,
+	};
+	struct bpf_map* map;
+	__u32 key = 0;
 
-	// Получение "map", представляющую .bss раздел объектного файла.
 	// Подробнее: https://docs.ebpf.io/ebpf-library/libbpf/userspace/bpf_object__find_map_by_name/
-	data_map = bpf_object__find_map_by_name(xdp_program__bpf_obj(xdp_prog), ".bss");
-	if (!data_map || !bpf_map__is_internal(data_map)) {
-		fprintf(stderr, "ERROR: bss map found!\n");
-		exit(EXIT_FAILURE);
+	map = bpf_object__find_map_by_name(obj, "config_map");
+	if (!map) {
+		fprintf(stderr, "ERROR: no config map found!\n");
+		return -1;
 	}
 
-	// Обновление количества сокетов (переменной `num_socks`) в XDP программе.
+	// Значение записывается целиком, поэтому размер структуры совпадает с размером значения "map"
+	// (ранее запись `num_socks` в .bss читала лишние байты за пределами переменной).
 	// Подробнее: https://docs.ebpf.io/ebpf-library/libbpf/userspace/bpf_map_update_elem/
-	if (bpf_map_update_elem(bpf_map__fd(data_map), &key, &num_socks, BPF_ANY)) {
-		fprintf(stderr, "ERROR: bpf_map_update_elem num_socks %d!\n", num_socks);
-		exit(EXIT_FAILURE);
+	if (bpf_map_update_elem(bpf_map__fd(map), &key, &cfg, BPF_ANY)) {
+		fprintf(stderr, "ERROR: bpf_map_update_elem config: %s\n", strerror(errno));
+		return -1;
 	}
+	return 0;
+}
+
+// Функция добавления в "map" с названием "xsks_map" файловых дескрипторов сокетов.
+// Возвращает 0 при успехе и -1 при ошибке.
+static int
+enter_xsks_into_map(struct bpf_object* obj, int prog_fd) {
+	int xsks_map;
+	int key = 0;
 
 	// Получение файлового дескриптора "map" с названием "xsks_map".
-	xsks_map = lookup_bpf_map(xdp_program__fd(xdp_prog));
+	xsks_map = lookup_bpf_map(prog_fd);
 	if (xsks_map < 0) {
 		fprintf(stderr, "ERROR: no xsks map found: %s\n",
-			strerror(xsks_map));
-			exit(EXIT_FAILURE);
+			strerror(-xsks_map));
+		return -1;
 	}
 
 	// Обновление значений файловых дескрипторов сокетов в "xsks_map".
@@ -360,9 +711,285 @@ enter_xsks_into_map(void) {
 		ret = bpf_map_update_elem(xsks_map, &key, &fd, 0);
 		if (ret) {
 			fprintf(stderr, "ERROR: bpf_map_update_elem %d\n", i);
-			exit(EXIT_FAILURE);
+			close(xsks_map);
+			return -1;
+		}
+	}
+
+	close(xsks_map);
+	return 0;
+}
+
+// Функция получения объектного файла загруженной XDP программы.
+static struct bpf_object*
+xdp_bpf_obj(void) {
+	return opt_hot_swap ? xdp_obj : xdp_program__bpf_obj(xdp_prog);
+}
+
+// Функция замены XDP программы без пересоздания сокетов.
+// Новая программа читается из того же файла, использует те же "xsks_map" и счётчики
+// и атомарно подменяет текущую через "bpf_link". При ошибке остаётся текущая программа.
+static void
+hot_swap_xdp_program(void) {
+	struct bpf_object* obj;
+	uint64_t start = get_nsecs();
+	int err;
+
+	obj = open_xdp_object(xdp_obj);
+	if (!obj) {
+		fprintf(stderr, "ERROR: keeping current XDP program\n");
+		return;
+	}
+
+	// Заполнение записей сокетов до подключения новой программы, чтобы первый же пакет
+	// обрабатывался с корректным состоянием. Настройки в общей "config_map" уже заданы.
+	if (opt_mode != MODE_TXONLY &&
+			enter_xsks_into_map(obj, xdp_object_prog_fd(obj))) {
+		bpf_object__close(obj);
+		return;
+	}
+
+	// Атомарная замена программы, если текущая программа не была изменена извне.
+	// Подробнее: https://docs.ebpf.io/ebpf-library/libbpf/userspace/bpf_link_update/
+	LIBBPF_OPTS(bpf_link_update_opts, opts,
+		.flags = BPF_F_REPLACE,
+		.old_prog_fd = xdp_object_prog_fd(xdp_obj));
+	err = bpf_link_update(xdp_link_fd, xdp_object_prog_fd(obj), &opts);
+	if (err) {
+		fprintf(stderr, "ERROR: replacing XDP program failed: %s\n", strerror(errno));
+		bpf_object__close(obj);
+		return;
+	}
+
+	// Общие "maps" продолжают существовать, так как на них ссылается новый объект.
+	bpf_object__close(xdp_obj);
+	xdp_obj = obj;
+	printf("XDP program replaced in %llu us\n", (get_nsecs() - start) / 1000);
+}
+
+// Функция вывода счётчиков результатов работы XDP программы.
+static void
+print_xdp_stats(void) {
+	static const char* actions[] = { "aborted", "drop", "pass", "tx", "redirect" };
+	int nr_cpus = libbpf_num_possible_cpus();
+	struct bpf_map* map;
+	__u64 values[nr_cpus];
+
+	map = bpf_object__find_map_by_name(xdp_bpf_obj(), "xdp_stats_map");
+	if (!map)
+		return;
+
+	printf("XDP:");
+	for (__u32 key = 0; key <= XDP_REDIRECT; key++) {
+		__u64 sum = 0;
+
+		// Для "per-CPU" массива возвращаются значения всех логических процессоров.
+		if (bpf_map_lookup_elem(bpf_map__fd(map), &key, values))
+			continue;
+		for (int cpu = 0; cpu < nr_cpus; cpu++)
+			sum += values[cpu];
+		printf("\t %llu %s", sum, actions[key]);
+	}
+	printf("\n");
+}
+
+// Количество потоков, извлекаемых из таблицы агрегации за один системный вызов.
+#define FLOW_BATCH 256
+
+// Функция вывода счётчиков потока, просуммированных по логическим процессорам.
+static void
+print_flow(const struct flow_key* key, const struct flow_stats* stats) {
+	int family = key->version == 6 ? AF_INET6 : AF_INET;
+	char src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN];
+
+	inet_ntop(family, key->saddr, src, sizeof(src));
+	inet_ntop(family, key->daddr, dst, sizeof(dst));
+	printf("flow %u %s:%u -> %s:%u\t %llu pkts\t %llu bytes\t %.3f s\n",
+		key->proto, src, ntohs(key->sport), dst, ntohs(key->dport),
+		stats->packets, stats->bytes,
+		(stats->last_seen - stats->first_seen) / 1e9);
+}
+
+// Функция выгрузки и очистки таблицы потоков XDP программы.
+// Записи извлекаются блоками: один системный вызов на FLOW_BATCH потоков
+// вместо пары lookup/delete на каждый поток.
+// Пакеты потока, пришедшие после его извлечения, учитываются в новой записи.
+static void
+drain_flows(void) {
+	int nr_cpus = libbpf_num_possible_cpus();
+	struct flow_key keys[FLOW_BATCH];
+	struct flow_stats* values;
+	struct bpf_map* map;
+	__u32 in_batch, out_batch, count;
+	uint64_t flows = 0, start = get_nsecs();
+	bool first = true;
+	int err;
+
+	map = bpf_object__find_map_by_name(xdp_bpf_obj(), "flows_map");
+	if (!map)
+		return;
+
+	// Для "per-CPU" таблицы возвращаются значения всех логических процессоров.
+	values = calloc(FLOW_BATCH * nr_cpus, sizeof(*values));
+	if (!values)
+		exit_with_error(ENOMEM);
+
+	do {
+		LIBBPF_OPTS(bpf_map_batch_opts, opts);
+
+		count = FLOW_BATCH;
+		// Позиция продолжения для хэш-таблиц - номер корзины (__u32).
+		// Подробнее: https://docs.ebpf.io/ebpf-library/libbpf/userspace/bpf_map_lookup_and_delete_batch/
+		err = bpf_map_lookup_and_delete_batch(bpf_map__fd(map), first ? NULL : &in_batch,
+			&out_batch, keys, values, &count, &opts);
+		if (err && errno != ENOENT) {
+			fprintf(stderr, "ERROR: draining flows failed: %s\n", strerror(errno));
+			break;
+		}
+
+		// При ENOENT возвращается последний, возможно неполный, блок.
+		for (__u32 i = 0; i < count; i++) {
+			struct flow_stats sum = {};
+
+			for (int cpu = 0; cpu < nr_cpus; cpu++) {
+				const struct flow_stats* v = &values[i * nr_cpus + cpu];
+
+				if (!v->packets)
+					continue;
+				if (!sum.packets || v->first_seen < sum.first_seen)
+					sum.first_seen = v->first_seen;
+				if (v->last_seen > sum.last_seen)
+					sum.last_seen = v->last_seen;
+				sum.packets += v->packets;
+				sum.bytes += v->bytes;
+			}
+			print_flow(&keys[i], &sum);
+		}
+		flows += count;
+		in_batch = out_batch;
+		first = false;
+	} while (!err);
+
+	printf("Flows: %llu drained in %llu us\n", flows, (get_nsecs() - start) / 1000);
+	free(values);
+}
+
+// Функция работы в режиме агрегации: пакеты обрабатываются XDP программой,
+// а таблица потоков периодически выгружается.
+static void
+run_aggregate(void) {
+	uint64_t interval = (opt_interval ? opt_interval : 1) * 1000000000UL;
+	uint64_t last = get_nsecs();
+
+	if (write_xdp_config(xdp_bpf_obj()))
+		exit_with_error(EINVAL);
+
+	while (!work_done) {
+		usleep(100000);
+		if (reload_xdp) {
+			reload_xdp = 0;
+			if (opt_hot_swap)
+				hot_swap_xdp_program();
+		}
+		if (get_nsecs() - last >= interval) {
+			drain_flows();
+			last = get_nsecs();
+		}
+	}
+
+	drain_flows();
+	print_xdp_stats();
+	remove_xdp_program();
+}
+
+// Функция обработки записи из кольцевого буфера захвата.
+static int
+handle_capture(void* ctx, void* data, size_t size) {
+	struct capture_stats* stats = ctx;
+	const struct capture_record* rec = data;
+
+	stats->records++;
+	stats->bytes += rec->len;
+	// Записи кольца не имеют адреса в UMEM: вместо него выводятся время и очередь приёма.
+	if (DEBUG_HEXDUMP)
+		printf("ts = %llu ns\t ifindex = %u\t queue = %u\n", rec->ts, rec->ifindex, rec->rx_queue);
+	hex_dump((void*)rec->hdr, rec->caplen, 0);
+	return 0;
+}
+
+// Функция вывода счётчиков режима захвата в формате, сравнимом с print_stats.
+static void
+print_capture_stats(struct capture_stats* stats, uint64_t elapsed_ns) {
+	uint64_t records = stats->records - stats->prev_records;
+	uint64_t wakeups = stats->wakeups - stats->prev_wakeups;
+
+	printf("Capture:\t %.0f Rx pps,\t %.0f wakeups/s,\t %.1f records/wakeup\n",
+		records / (elapsed_ns / 1e9), wakeups / (elapsed_ns / 1e9),
+		wakeups ? (double)records / wakeups : 0.0);
+	stats->prev_records = stats->records;
+	stats->prev_wakeups = stats->wakeups;
+}
+
+// Функция работы в режиме захвата заголовков.
+// Записи читаются из общего кольцевого буфера через epoll без UMEM, очередей fill/completion
+// и сокетов на каждую очередь, что позволяет сравнить стоимость передачи заголовков с путём AF_XDP.
+static void
+run_capture(void) {
+	struct capture_stats stats = {};
+	struct ring_buffer* rb;
+	struct bpf_map* map;
+	uint64_t start, last;
+	int n;
+
+	if (write_xdp_config(xdp_bpf_obj()))
+		exit_with_error(EINVAL);
+
+	map = bpf_object__find_map_by_name(xdp_bpf_obj(), "capture_ring");
+	if (!map) {
+		fprintf(stderr, "ERROR: no capture ring found!\n");
+		exit_with_error(EINVAL);
+	}
+
+	// Подробнее: https://docs.ebpf.io/ebpf-library/libbpf/userspace/ring_buffer__new/
+	rb = ring_buffer__new(bpf_map__fd(map), handle_capture, &stats, NULL);
+	if (!rb)
+		exit_with_error(errno);
+
+	start = last = get_nsecs();
+	while (!work_done) {
+		// Подробнее: https://docs.ebpf.io/ebpf-library/libbpf/userspace/ring_buffer__poll/
+		n = ring_buffer__poll(rb, 100);
+		if (n < 0 && n != -EINTR) {
+			fprintf(stderr, "ERROR: polling capture ring failed: %s\n", strerror(-n));
+			break;
+		}
+		if (n > 0)
+			stats.wakeups++;
+		// Записи ниже порога пробуждения (BPF_RB_NO_WAKEUP) не вызывают событие epoll
+		// и забираются по истечении времени ожидания.
+		else if (n == 0)
+			ring_buffer__consume(rb);
+
+		if (reload_xdp) {
+			reload_xdp = 0;
+			if (opt_hot_swap)
+				hot_swap_xdp_program();
+		}
+
+		if (opt_interval && get_nsecs() - last >= opt_interval * 1000000000UL) {
+			// Записи ниже порога пробуждения забираются без ожидания.
+			ring_buffer__consume(rb);
+			print_capture_stats(&stats, get_nsecs() - last);
+			last = get_nsecs();
 		}
 	}
+
+	ring_buffer__consume(rb);
+	printf("Capture:\t %llu records,\t %llu bytes,\t %llu wakeups in %.3f s\n",
+		stats.records, stats.bytes, stats.wakeups, (get_nsecs() - start) / 1e9);
+	ring_buffer__free(rb);
+	print_xdp_stats();
+	remove_xdp_program();
 }
 
 // Функция настройки сокетов.
@@ -384,6 +1011,7 @@ apply_setsockopt(struct socket_info* xsk) {
 			(void*)&sock_opt, sizeof(sock_opt)) < 0)
 		exit_with_error(errno);
 
+	// При адаптивном выборе размера блока бюджет соответствует максимальному размеру.
 	sock_opt = opt_batch_size;
 	if (setsockopt(xsk_socket__fd(xsk->xsk), SOL_SOCKET, SO_BUSY_POLL_BUDGET,
 			(void*)&sock_opt, sizeof(sock_opt)) < 0)
@@ -391,6 +1019,114 @@ apply_setsockopt(struct socket_info* xsk) {
 }
 
 
+// Функция получения индекса интервала гистограммы для значения.
+static inline uint32_t
+hist_index(uint64_t value) {
+	uint32_t shift;
+
+	if (value < (1ULL << HIST_SUB_BITS))
+		return value;
+	// Номер старшего бита определяет интервал, следующие биты - часть интервала.
+	shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+	return ((shift + 1) << HIST_SUB_BITS) + (value >> shift) - (1U << HIST_SUB_BITS);
+}
+
+// Функция получения верхней границы интервала гистограммы.
+static inline uint64_t
+hist_value(uint32_t idx) {
+	uint64_t mant;
+	uint32_t shift;
+
+	if (idx < (1U << HIST_SUB_BITS))
+		return idx;
+	shift = (idx >> HIST_SUB_BITS) - 1;
+	mant = (idx & ((1U << HIST_SUB_BITS) - 1)) + (1U << HIST_SUB_BITS);
+	return ((mant + 1) << shift) - 1;
+}
+
+// Функция учёта значения в гистограмме.
+static inline void
+hist_record(struct latency_hist* h, uint64_t value) {
+	h->counts[hist_index(value)]++;
+	if (!h->total || value < h->min)
+		h->min = value;
+	if (value > h->max)
+		h->max = value;
+	h->total++;
+	h->sum += value;
+}
+
+// Функция получения значения перцентиля `p` (от 0 до 100).
+static uint64_t
+hist_percentile(const struct latency_hist* h, double p) {
+	uint64_t rank = (uint64_t)(p / 100.0 * h->total + 0.5), seen = 0;
+
+	if (!rank)
+		rank = 1;
+	for (uint32_t i = 0; i < HIST_SIZE; i++) {
+		seen += h->counts[i];
+		if (seen >= rank)
+			return hist_value(i) < h->max ? hist_value(i) : h->max;
+	}
+	return h->max;
+}
+
+// Функция вывода гистограммы задержек.
+static void
+print_latency_hist(const struct latency_hist* h) {
+	if (!h->total) {
+		printf("\t no replies, %llu lost\n", h->lost);
+		return;
+	}
+
+	printf("\t RTT (ns): min %llu, avg %llu, p50 %llu, p90 %llu, p99 %llu, "
+		"p99.9 %llu, p99.99 %llu, max %llu; %llu lost\n",
+		h->min, h->sum / h->total,
+		hist_percentile(h, 50), hist_percentile(h, 90), hist_percentile(h, 99),
+		hist_percentile(h, 99.9), hist_percentile(h, 99.99), h->max, h->lost);
+}
+
+// Функция учёта окончания этапа настройки сокета.
+static inline void
+setup_phase_end(struct setup_times* t, enum setup_phase phase, uint64_t* ts) {
+	uint64_t now = get_nsecs();
+
+	t->ns[phase] = now - *ts;
+	*ts = now;
+}
+
+// Функция вывода статистики ограничителя скорости отправки.
+static void
+print_pacing_stats(struct socket_info* xsk) {
+	struct tx_pacing* p = &xsk->pacing;
+	double elapsed;
+
+	if (!opt_tx_rate_pps || p->batches < 2)
+		return;
+
+	elapsed = (double)(p->prev_ns - p->start_ns) / 1e9;
+	printf("\t target %llu pps, achieved %.0f pps, jitter avg %llu ns, max %llu ns\n",
+		opt_tx_rate_pps, (xsk->tx_count - p->prev_pkts) / elapsed,
+		p->jitter_sum / (p->batches - 1), p->jitter_max);
+}
+
+// Функция периодического вывода статистики сокетов.
+static void
+print_stats(uint64_t elapsed_ns) {
+	double sec = elapsed_ns / 1e9;
+
+	for (int i = 0; i < num_socks; i++) {
+		struct socket_info* xsk = xsks[i];
+		uint64_t rx = xsk->rx_count, tx = xsk->tx_count;
+
+		printf("Socket %d:\t %.0f Rx pps,\t %.0f Tx pps,\t batch %u\n", i,
+			(rx - xsk->prev_rx_count) / sec, (tx - xsk->prev_tx_count) / sec,
+			xsk->batch.size);
+		xsk->prev_rx_count = rx;
+		xsk->prev_tx_count = tx;
+	}
+}
+
 // Функция завершения работы сокетов.
 static void
 socks_cleanup(void) {
@@ -398,6 +1134,18 @@ socks_cleanup(void) {
 	printf("\n");
 	for (int i = 0; i < num_socks; i++) {
 		printf("Socket %d:\t %llu Rx,\t %llu Tx\n", i, xsks[i]->rx_count, xsks[i]->tx_count);
+		if (xsks[i]->hist)
+			print_latency_hist(xsks[i]->hist);
+		if (opt_frags)
+			printf("\t %llu Rx fragments\n", xsks[i]->rx_frags);
+		print_pacing_stats(xsks[i]);
+		if (opt_adaptive_batch && xsks[i]->batch.polls_total)
+			printf("\t batch size: current %u, average %.1f, %llu changes\n",
+				xsks[i]->batch.size,
+				(double)xsks[i]->batch.size_sum / xsks[i]->batch.polls_total,
+				xsks[i]->batch.changes);
+		for (int w = 0; w < opt_workers; w++)
+			printf("\t worker %d: %llu processed\n", w, xsks[i]->workers[w].pkt_count);
 		// Удаление сокета.
 		// Подробнее: https://docs.ebpf.io/ebpf-library/libxdp/functions/xsk_socket__delete/
 		xsk_socket__delete(xsks[i]->xsk);
@@ -409,8 +1157,10 @@ socks_cleanup(void) {
 		munmap(xsks[i]->umem->buffer, NUM_FRAMES * opt_xsk_frame_size);
 	}
 
-	if (opt_load_xdp)
+	if (opt_load_xdp) {
+		print_xdp_stats();
 		remove_xdp_program();
+	}
 }
 
 // Функция создания кольца UMEM.
@@ -442,22 +1192,22 @@ create_umem(void* buffer, uint64_t size) {
 // Функция заполнения очереди fill (производитель для пользователя) свободными дескрипторами,
 // для последующего заполнения их ядром.
 static void
-configure_fill_ring(struct umem_info* umem) {
+configure_fill_ring(struct umem_info* umem, uint32_t count) {
 	int ret = 0;
 	uint32_t idx = 0;
 
 	// Резервирование слотов в очереди fill.
 	// Подробнее: https://docs.ebpf.io/ebpf-library/libxdp/functions/xsk_ring_prod__reserve
-	ret = xsk_ring_prod__reserve(&umem->pr, XSK_RING_PROD__DEFAULT_NUM_DESCS * 2, &idx);
-	if (ret != XSK_RING_PROD__DEFAULT_NUM_DESCS * 2)
+	ret = xsk_ring_prod__reserve(&umem->pr, count, &idx);
+	if (ret != count)
 		exit_with_error(-ret);
 	// Запись в очередь смещенией в UMEM для записи по ним пакетов.
 	// Подробнее: https://docs.ebpf.io/ebpf-library/libxdp/functions/xsk_ring_prod__fill_addr
-	for (int i = 0; i < XSK_RING_PROD__DEFAULT_NUM_DESCS * 2; i++)
+	for (int i = 0; i < count; i++)
 		*xsk_ring_prod__fill_addr(&umem->pr, idx++) = i * opt_xsk_frame_size;
 	// Указание ядру о готовности очереди.
 	// Подробнее: https://docs.ebpf.io/ebpf-library/libxdp/functions/xsk_ring_prod__submit
-	xsk_ring_prod__submit(&umem->pr, XSK_RING_PROD__DEFAULT_NUM_DESCS * 2);
+	xsk_ring_prod__submit(&umem->pr, count);
 }
 
 // Функция создания сокета.
@@ -515,80 +1265,348 @@ gen_eth_frame(struct umem_info* umem, uint64_t addr, uint32_t* len) {
 	*len -= copy_len;
 }
 
+// Функция добавления фрагмента в собираемый пакет.
+// Возвращает true, если фрагмент последний и пакет собран полностью.
+static inline bool
+xsk_frame_add(struct xsk_frame* f, struct umem_info* umem, const struct xdp_desc* desc) {
+	if (f->nr_frags == XSK_MAX_FRAGS) {
+		// Ядро не передаёт пакетов с большим количеством фрагментов.
+		fprintf(stderr, "ERROR: packet has more than %d fragments\n", XSK_MAX_FRAGS);
+		exit_with_error(EMSGSIZE);
+	}
+
+	// Получение данных фрагмента.
+	// Подробнее: https://docs.ebpf.io/ebpf-library/libxdp/functions/xsk_umem__add_offset_to_addr/
+	// Подробнее: https://docs.ebpf.io/ebpf-library/libxdp/functions/xsk_umem__get_data/
+	f->iov[f->nr_frags].iov_base = xsk_umem__get_data(umem->buffer,
+		xsk_umem__add_offset_to_addr(desc->addr));
+	f->iov[f->nr_frags].iov_len = desc->len;
+	f->addrs[f->nr_frags] = desc->addr;
+	f->nr_frags++;
+	f->len += desc->len;
+
+	return IS_EOP_DESC(desc->options);
+}
+
+// Функция записи адресов ячеек собранного пакета в массив для возврата в очередь fill.
+// Возвращает количество записанных адресов и очищает пакет.
+static inline uint32_t
+xsk_frame_release(struct xsk_frame* f, uint64_t* addrs) {
+	uint32_t n = f->nr_frags;
+
+	// Получение адреса начала ячейки в UMEM.
+	// Подробнее: https://docs.ebpf.io/ebpf-library/libxdp/functions/xsk_umem__extract_addr/
+	for (uint32_t i = 0; i < n; i++)
+		addrs[i] = xsk_umem__extract_addr(f->addrs[i]);
+	f->nr_frags = 0;
+	f->len = 0;
+	return n;
+}
+
+// Функция обработки полученного пакета.
+static inline void
+process_frame(const struct xsk_frame* f) {
+	if (f->nr_frags > 1)
+		printf("packet length = %u, fragments = %u\n", f->len, f->nr_frags);
+	for (uint32_t i = 0; i < f->nr_frags; i++)
+		hex_dump(f->iov[i].iov_base, f->iov[i].iov_len,
+			xsk_umem__add_offset_to_addr(f->addrs[i]));
+}
+
+// Функция учёта опроса кольца с `avail` доступными элементами и изменения размера блока.
+static inline void
+batch_ctl_update(struct batch_ctl* c, uint32_t avail) {
+	uint32_t avg;
+
+	c->polls++;
+	c->empty += !avail;
+	c->occupancy += avail;
+	c->size_sum += c->size;
+	c->polls_total++;
+	if (c->polls < BATCH_CTL_WINDOW)
+		return;
+
+	avg = c->occupancy / c->polls;
+	if (avg > c->size && c->size < opt_batch_size) {
+		// В кольце накапливается больше, чем забирается за раз.
+		c->size = c->size * 2 < opt_batch_size ? c->size * 2 : opt_batch_size;
+		c->changes++;
+	} else if ((c->empty * 2 > c->polls || avg < c->size / 4) && c->size > BATCH_MIN) {
+		// Нагрузка низкая: меньший блок уменьшает задержку обработки.
+		c->size = c->size / 2 > BATCH_MIN ? c->size / 2 : BATCH_MIN;
+		c->changes++;
+	}
+
+	c->polls = 0;
+	c->empty = 0;
+	c->occupancy = 0;
+}
+
+// Функция учёта заполненности кольца rx перед его опросом.
+static inline void
+batch_ctl_rx(struct socket_info* xsk) {
+	// Подробнее: https://github.com/xdp-project/xdp-tools/blob/main/headers/xdp/xsk.h
+	if (opt_adaptive_batch)
+		batch_ctl_update(&xsk->batch, xsk_cons_nb_avail(&xsk->rx, XSK_RING_CONS__DEFAULT_NUM_DESCS));
+}
+
+// Функция уведомления ядра об ожидании пакетов.
+// Системный вызов выполняется, только если его требует флаг need_wakeup очереди fill
+// или используется режим "busy-poll".
+static inline void
+rx_wakeup(struct socket_info* xsk) {
+	if (opt_busy_poll || xsk_ring_prod__needs_wakeup(&xsk->umem->pr)) {
+		// Подробнее: https://man7.org/linux/man-pages/man3/recvfrom.3p.html
+		recvfrom(xsk_socket__fd(xsk->xsk), NULL, 0, MSG_DONTWAIT, NULL, NULL);
+	}
+}
+
 // Функция получения пакетов.
-static void
+// Возвращает количество прочитанных дескрипторов. Если их нет, уведомление ядра
+// выполняет вызывающая сторона.
+static unsigned int
 rx_only(struct socket_info* xsk) {
 	unsigned int rcvd, i, eop_cnt = 0;
-	uint32_t idx_rx = 0, idx_fq = 0;
+	uint32_t idx_rx = 0, idx_fq = 0, nr_fill = 0;
+	uint64_t fill[opt_batch_size + XSK_MAX_FRAGS];
 	int ret;
 
+	batch_ctl_rx(xsk);
+
 	// Просмотр количества доступных пакетов/фрагментов для чтения.
 	// Подробнее: https://docs.ebpf.io/ebpf-library/libxdp/functions/xsk_ring_cons__peek/
-	rcvd = xsk_ring_cons__peek(&xsk->rx, opt_batch_size, &idx_rx);
-	if (!rcvd) {
-		if (opt_busy_poll || xsk_ring_prod__needs_wakeup(&xsk->umem->pr)) {
-			// Уведомление ядра об ожидании пакетов.
-			// Подробнее: https://man7.org/linux/man-pages/man3/recvfrom.3p.html
-			recvfrom(xsk_socket__fd(xsk->xsk), NULL, 0, MSG_DONTWAIT, NULL, NULL);
-		}
-		return;
-	}
-
-	// Резервирование дескрипторов для записи прочитанных пакетов/фрагментов.
-	// Подробнее: https://docs.ebpf.io/ebpf-library/libxdp/functions/xsk_ring_prod__reserve/
-	ret = xsk_ring_prod__reserve(&xsk->umem->pr, rcvd, &idx_fq);
-	while (ret != rcvd) {
-		if (ret < 0)
-			exit_with_error(-ret);
-		if (opt_busy_poll || xsk_ring_prod__needs_wakeup(&xsk->umem->pr)) {
-			// Уведомление ядра об ожидании пакетов.
-			// Подробнее: https://man7.org/linux/man-pages/man3/recvfrom.3p.html
-			recvfrom(xsk_socket__fd(xsk->xsk), NULL, 0, MSG_DONTWAIT, NULL, NULL);
-		}
-		ret = xsk_ring_prod__reserve(&xsk->umem->pr, rcvd, &idx_fq);
-	}
+	rcvd = xsk_ring_cons__peek(&xsk->rx, xsk->batch.size, &idx_rx);
+	if (!rcvd)
+		return 0;
 
 	// Чтение пакетов.
 	for (i = 0; i < rcvd; i++) {
 		// Получение дескриптора с данными.
 		const struct xdp_desc* desc = xsk_ring_cons__rx_desc(&xsk->rx, idx_rx++);
-		uint64_t addr = desc->addr;
-		uint32_t len = desc->len;
-		// Получение адреса начала доступных данных в UMEM.
-		// Подробнее: https://docs.ebpf.io/ebpf-library/libxdp/functions/xsk_umem__extract_addr/
-		uint64_t orig = xsk_umem__extract_addr(addr);
-		eop_cnt += IS_EOP_DESC(desc->options);
 
-		// Получение адреса начала данных.
-		// Подробнее: https://docs.ebpf.io/ebpf-library/libxdp/functions/xsk_umem__add_offset_to_addr/
-		addr = xsk_umem__add_offset_to_addr(addr);
-
-		// Получение данных пакета.
-		// Подробнее: https://docs.ebpf.io/ebpf-library/libxdp/functions/xsk_umem__get_data/
-		char* pkt = xsk_umem__get_data(xsk->umem->buffer, addr);
+		if (!xsk_frame_add(&xsk->frame, xsk->umem, desc))
+			continue;
 
-		hex_dump(pkt, len, addr);
-		// Установка адреса данных для последующей записи по нему данных.
-		*xsk_ring_prod__fill_addr(&xsk->umem->pr, idx_fq++) = orig;
+		// Пакет собран: обработка и возврат всех его фрагментов в очередь fill.
+		// Фрагменты незавершённого пакета остаются у приложения до следующего вызова.
+		process_frame(&xsk->frame);
+		nr_fill += xsk_frame_release(&xsk->frame, fill + nr_fill);
+		eop_cnt++;
 	}
 
-	xsk->rx_count += rcvd;
-
 	// Освобождение дескрипторов в очереди дескрипторов доступных для чтения.
-	// Подробнее: https://docs.ebpf.io/ebpf-library/libxdp/functions/xsk_ring_prod__submit/
-	xsk_ring_prod__submit(&xsk->umem->pr, rcvd);
-	// Создание дескрипторов в очереди дескрипторов доступных для записи.
 	// Подробнее: https://docs.ebpf.io/ebpf-library/libxdp/functions/xsk_ring_cons__release/
 	xsk_ring_cons__release(&xsk->rx, rcvd);
-}
 
-// Функция чтения и ожидания пакетов.
-static void
-rx_only_all(struct socket_info* xsk) {
-	struct pollfd poll_fd;
-	int ret;
+	xsk->rx_count += eop_cnt;
+	xsk->rx_frags += rcvd;
 
-	poll_fd.fd = xsk_socket__fd(xsk->xsk);
+	if (!nr_fill)
+		return rcvd;
+
+	// Резервирование дескрипторов для записи прочитанных пакетов/фрагментов.
+	// Подробнее: https://docs.ebpf.io/ebpf-library/libxdp/functions/xsk_ring_prod__reserve/
+	ret = xsk_ring_prod__reserve(&xsk->umem->pr, nr_fill, &idx_fq);
+	while (ret != nr_fill) {
+		if (ret < 0)
+			exit_with_error(-ret);
+		rx_wakeup(xsk);
+		ret = xsk_ring_prod__reserve(&xsk->umem->pr, nr_fill, &idx_fq);
+	}
+
+	// Установка адресов ячеек для последующей записи по ним данных.
+	// Подробнее: https://docs.ebpf.io/ebpf-library/libxdp/functions/xsk_ring_prod__fill_addr/
+	for (i = 0; i < nr_fill; i++)
+		*xsk_ring_prod__fill_addr(&xsk->umem->pr, idx_fq++) = fill[i];
+
+	// Передача ячеек ядру.
+	// Подробнее: https://docs.ebpf.io/ebpf-library/libxdp/functions/xsk_ring_prod__submit/
+	xsk_ring_prod__submit(&xsk->umem->pr, nr_fill);
+
+	return rcvd;
+}
+
+// Функция записи дескрипторов в кольцо конвейера.
+// Возвращает количество записанных дескрипторов.
+static inline uint32_t
+pipe_ring_enqueue(struct pipe_ring* r, const struct xdp_desc* descs, uint32_t n) {
+	uint32_t prod = r->prod;
+	// Чтение индекса потребителя с барьером, чтобы не перезаписать ещё не прочитанные ячейки.
+	uint32_t cons = __atomic_load_n(&r->cons, __ATOMIC_ACQUIRE);
+	uint32_t free_entries = PIPE_RING_SIZE - (prod - cons);
+
+	if (n > free_entries)
+		n = free_entries;
+	for (uint32_t i = 0; i < n; i++)
+		r->descs[(prod + i) & (PIPE_RING_SIZE - 1)] = descs[i];
+	// Публикация записанных дескрипторов потребителю.
+	__atomic_store_n(&r->prod, prod + n, __ATOMIC_RELEASE);
+	return n;
+}
+
+// Функция чтения не более `n` дескрипторов из кольца конвейера.
+static inline uint32_t
+pipe_ring_dequeue(struct pipe_ring* r, struct xdp_desc* descs, uint32_t n) {
+	uint32_t cons = r->cons;
+	uint32_t prod = __atomic_load_n(&r->prod, __ATOMIC_ACQUIRE);
+
+	if (n > prod - cons)
+		n = prod - cons;
+	for (uint32_t i = 0; i < n; i++)
+		descs[i] = r->descs[(cons + i) & (PIPE_RING_SIZE - 1)];
+	// Освобождение прочитанных ячеек для производителя.
+	__atomic_store_n(&r->cons, cons + n, __ATOMIC_RELEASE);
+	return n;
+}
+
+// Функция создания кольца конвейера.
+static struct pipe_ring*
+pipe_ring_create(void) {
+	struct pipe_ring* r = aligned_alloc(64, sizeof(*r));
+	if (!r)
+		exit_with_error(ENOMEM);
+	memset(r, 0, sizeof(*r));
+	return r;
+}
+
+// Функция возврата обработанных потоками обработки ячеек в очередь fill.
+static void
+pipe_refill(struct socket_info* xsk) {
+	struct xdp_desc descs[opt_batch_size];
+	uint32_t idx_fq = 0;
+
+	for (uint32_t w = 0; w < opt_workers; w++) {
+		for (;;) {
+			// Забираем не больше, чем есть свободного места в очереди fill,
+			// чтобы резервирование ниже всегда было успешным. xsk_prod_nb_free()
+			// возвращает всё свободное место кольца, поэтому порция ограничивается
+			// размером массива на стеке.
+			uint32_t n = xsk_prod_nb_free(&xsk->umem->pr, opt_batch_size);
+			if (!n)
+				return;
+			n = n < opt_batch_size ? n : opt_batch_size;
+
+			n = pipe_ring_dequeue(xsk->workers[w].ret, descs, n);
+			if (!n)
+				break;
+
+			xsk_ring_prod__reserve(&xsk->umem->pr, n, &idx_fq);
+			for (uint32_t i = 0; i < n; i++)
+				*xsk_ring_prod__fill_addr(&xsk->umem->pr, idx_fq++) = descs[i].addr;
+			xsk_ring_prod__submit(&xsk->umem->pr, n);
+			xsk->frames_in_workers -= n;
+		}
+	}
+}
+
+// Функция получения пакетов с передачей их потокам обработки.
+// Поток приёма только обслуживает кольца rx и fill, сами пакеты не копируются:
+// потокам обработки передаются дескрипторы с адресами в UMEM.
+static unsigned int
+rx_pipeline(struct socket_info* xsk) {
+	struct xdp_desc descs[opt_batch_size];
+	struct worker_info* w = &xsk->workers[xsk->next_worker];
+	uint32_t rcvd, idx_rx = 0, eop_cnt = 0;
+
+	pipe_refill(xsk);
+	batch_ctl_rx(xsk);
+
+	rcvd = xsk_ring_cons__peek(&xsk->rx, xsk->batch.size, &idx_rx);
+	if (!rcvd)
+		return 0;
+
+	for (uint32_t i = 0; i < rcvd; i++) {
+		descs[i] = *xsk_ring_cons__rx_desc(&xsk->rx, idx_rx++);
+		eop_cnt += IS_EOP_DESC(descs[i].options);
+	}
+
+	// Кольцо потока обработки вмещает все ячейки UMEM, поэтому запись всегда успешна.
+	pipe_ring_enqueue(w->in, descs, rcvd);
+	xsk_ring_cons__release(&xsk->rx, rcvd);
+
+	// Распределение блоков по потокам обработки по кругу. Если блок закончился
+	// посреди пакета, его оставшиеся фрагменты передаются тому же потоку.
+	if (IS_EOP_DESC(descs[rcvd - 1].options))
+		xsk->next_worker = (xsk->next_worker + 1) % opt_workers;
+
+	xsk->frames_in_workers += rcvd;
+	xsk->rx_count += eop_cnt;
+	xsk->rx_frags += rcvd;
+
+	return rcvd;
+}
+
+// Функция завершения работы потока приёма в режиме конвейера.
+// Дожидается, пока потоки обработки вернут все переданные им ячейки UMEM.
+static void
+rx_pipeline_stop(struct socket_info* xsk) {
+	struct xdp_desc descs[opt_batch_size];
+
+	__atomic_store_n(&xsk->rx_stopped, true, __ATOMIC_RELEASE);
+
+	// Приём остановлен, поэтому ячейки не возвращаются в очередь fill, а только учитываются.
+	while (xsk->frames_in_workers) {
+		for (uint32_t w = 0; w < opt_workers; w++)
+			xsk->frames_in_workers -= pipe_ring_dequeue(xsk->workers[w].ret,
+				descs, opt_batch_size);
+	}
+}
+
+// Функция потока обработки пакетов.
+static void*
+run_worker(void* ptr) {
+	struct worker_info* w = ptr;
+	struct xdp_desc descs[opt_batch_size];
+	struct xdp_desc ret[opt_batch_size + XSK_MAX_FRAGS];
+	uint64_t addrs[XSK_MAX_FRAGS];
+	uint32_t n, nr_ret;
+
+	while (true) {
+		n = pipe_ring_dequeue(w->in, descs, opt_batch_size);
+		if (!n) {
+			// Завершение только после того, как поток приёма перестал передавать пакеты,
+			// а кольцо опустело.
+			if (__atomic_load_n(&w->xsk->rx_stopped, __ATOMIC_ACQUIRE) &&
+					w->in->prod == w->in->cons)
+				break;
+			sched_yield();
+			continue;
+		}
+
+		nr_ret = 0;
+		for (uint32_t i = 0; i < n; i++) {
+			if (!xsk_frame_add(&w->frame, w->xsk->umem, &descs[i]))
+				continue;
+
+			process_frame(&w->frame);
+			w->pkt_count++;
+
+			// Все фрагменты пакета возвращаются потоку приёма вместе.
+			for (uint32_t j = 0, nr = xsk_frame_release(&w->frame, addrs); j < nr; j++)
+				ret[nr_ret++].addr = addrs[j];
+		}
+
+		// Кольцо возврата вмещает все ячейки UMEM, поэтому запись всегда успешна.
+		if (nr_ret)
+			pipe_ring_enqueue(w->ret, ret, nr_ret);
+	}
+
+	// Фрагменты незавершённого пакета тоже возвращаются, чтобы учёт ячеек сошёлся.
+	nr_ret = xsk_frame_release(&w->frame, addrs);
+	for (uint32_t j = 0; j < nr_ret; j++)
+		ret[j].addr = addrs[j];
+	pipe_ring_enqueue(w->ret, ret, nr_ret);
+
+	return NULL;
+}
+
+// Функция чтения и ожидания пакетов.
+static void
+rx_only_all(struct socket_info* xsk) {
+	struct pollfd poll_fd;
+	int ret;
+
+	poll_fd.fd = xsk_socket__fd(xsk->xsk);
 	poll_fd.events = POLLIN;
 
 	while (true) {
@@ -603,18 +1621,60 @@ rx_only_all(struct socket_info* xsk) {
 				continue;
 		}
 
-		rx_only(xsk);
+		if (!(opt_workers ? rx_pipeline(xsk) : rx_only(xsk)))
+			rx_wakeup(xsk);
 
 		if (work_done)
 			break;
 	}
+
+	if (opt_workers)
+		rx_pipeline_stop(xsk);
+}
+
+// Функция чтения пакетов из группы сокетов одним потоком.
+// Сокеты обслуживаются по кругу, а уведомление ядра выполняется после полного
+// прохода только для сокетов без пакетов, чей флаг need_wakeup это требует.
+static void
+rx_only_group(struct socket_info** group, int count) {
+	struct pollfd poll_fds[MAX_SOCKS];
+	unsigned int rcvd[MAX_SOCKS];
+	int ret;
+
+	for (int j = 0; j < count; j++) {
+		poll_fds[j].fd = xsk_socket__fd(group[j]->xsk);
+		poll_fds[j].events = POLLIN;
+	}
+
+	while (!work_done) {
+		if (opt_poll) {
+			// Ожидание пакетов сразу на всех сокетах группы.
+			// Подробнее: https://man7.org/linux/man-pages/man2/poll.2.html
+			ret = poll(poll_fds, count, opt_timeout);
+			if (ret <= 0)
+				continue;
+		}
+
+		for (int j = 0; j < count; j++)
+			rcvd[j] = opt_workers ? rx_pipeline(group[j]) : rx_only(group[j]);
+
+		for (int j = 0; j < count; j++) {
+			if (!rcvd[j])
+				rx_wakeup(group[j]);
+		}
+	}
+
+	if (opt_workers) {
+		for (int j = 0; j < count; j++)
+			rx_pipeline_stop(group[j]);
+	}
 }
 
 // Функция получение длины набора пакетов/фрагментов для отправки.
 static inline int
-get_batch_size(int pkt_cnt) {
-	if (!opt_pkt_count || pkt_cnt + opt_batch_size <= opt_pkt_count)
-		return opt_batch_size * frames_per_pkt;
+get_batch_size(struct socket_info* xsk, int pkt_cnt) {
+	if (!opt_pkt_count || pkt_cnt + xsk->batch.size <= opt_pkt_count)
+		return xsk->batch.size * frames_per_pkt;
 
 	return (opt_pkt_count - pkt_cnt) * frames_per_pkt;
 }
@@ -633,15 +1693,18 @@ kick_tx(struct socket_info* xsk) {
 	exit_with_error(errno);
 }
 
-// Функция отправки записанных пакетов.
+// Функция проверки необходимости уведомления ядра об отправке.
+static inline bool
+tx_needs_kick(struct socket_info* xsk) {
+	return !opt_need_wakeup || xsk_ring_prod__needs_wakeup(&xsk->tx);
+}
+
+// Функция освобождения отправленных ядром дескрипторов без его уведомления.
 static inline unsigned int
-complete_tx_only(struct socket_info* xsk, int batch_size) {
+reap_tx(struct socket_info* xsk, int batch_size) {
 	unsigned int rcvd;
 	uint32_t idx;
 
-	if (!opt_need_wakeup || xsk_ring_prod__needs_wakeup(&xsk->tx))
-		kick_tx(xsk);
-
 	// Получение количества освободивщихся/отправленных пакетов.
 	// Подробнее: https://docs.ebpf.io/ebpf-library/libxdp/functions/xsk_ring_cons__peek/
 	rcvd = xsk_ring_cons__peek(&xsk->umem->cr, batch_size, &idx);
@@ -649,24 +1712,77 @@ complete_tx_only(struct socket_info* xsk, int batch_size) {
 		// Возвращаем ядру дескрипторы, которые он отправил, чтобы записать в них данные заного.
 		// Подробнее: https://docs.ebpf.io/ebpf-library/libxdp/functions/xsk_ring_cons__peek/
 		xsk_ring_cons__release(&xsk->umem->cr, rcvd);
+		xsk->outstanding_tx -= rcvd;
 	}
-  return rcvd;
+	return rcvd;
 }
 
-// Функция записи и отправки `batch_size` пакетов.
-static int
-tx_only(struct socket_info* xsk, uint32_t* frame_nb, int batch_size) {
-	uint32_t idx, tv_sec, tv_usec;
-	unsigned int i;
+// Функция отправки записанных пакетов.
+static inline unsigned int
+complete_tx_only(struct socket_info* xsk, int batch_size) {
+	if (tx_needs_kick(xsk))
+		kick_tx(xsk);
 
-	// Резервирование `batch_size` пакетов/фрагментов в очереди записи.
-	// Подробнее: https://docs.ebpf.io/ebpf-library/libxdp/functions/xsk_ring_prod__reserve/
-	while (xsk_ring_prod__reserve(&xsk->tx, batch_size, &idx) < batch_size) {
-		complete_tx_only(xsk, batch_size);
-		if (work_done)
-			return 0;
+	return reap_tx(xsk, batch_size);
+}
+
+// Функция проверки наличия токенов для отправки `pkts` пакетов с целевой скоростью.
+// При наличии токенов списывает их и учитывает отклонение от целевого интервала.
+static bool
+tx_pacing_try(struct socket_info* xsk, uint32_t pkts) {
+	struct tx_pacing* p = &xsk->pacing;
+	uint64_t now = get_nsecs();
+
+	if (!opt_tx_rate_pps)
+		return true;
+
+	if (!p->start_ns) {
+		// "Ведро" изначально заполнено на один блок, поэтому первый блок уходит сразу.
+		p->start_ns = p->last_ns = p->prev_ns = now;
+		p->tokens = pkts;
 	}
 
+	p->tokens += (double)(now - p->last_ns) * opt_tx_rate_pps / 1e9;
+	p->last_ns = now;
+	// Глубина "ведра" ограничена одним блоком, чтобы после простоя
+	// не происходило отправки пачки сверх целевой скорости.
+	if (p->tokens > pkts)
+		p->tokens = pkts;
+	if (p->tokens < pkts)
+		return false;
+	p->tokens -= pkts;
+
+	// Отклонение фактического интервала между блоками от целевого.
+	if (p->batches) {
+		uint64_t target = p->prev_pkts * 1000000000UL / opt_tx_rate_pps;
+		uint64_t actual = now - p->prev_ns;
+		uint64_t jitter = actual > target ? actual - target : target - actual;
+
+		p->jitter_sum += jitter;
+		if (jitter > p->jitter_max)
+			p->jitter_max = jitter;
+	}
+	p->prev_ns = now;
+	p->prev_pkts = pkts;
+	p->batches++;
+	return true;
+}
+
+// Функция ожидания токенов для отправки `pkts` пакетов с целевой скоростью.
+// Пока токенов недостаточно, продолжает забирать подтверждения отправки.
+static void
+tx_pacing_wait(struct socket_info* xsk, uint32_t pkts) {
+	while (!tx_pacing_try(xsk, pkts) && !work_done) {
+		if (xsk->outstanding_tx)
+			complete_tx_only(xsk, opt_batch_size);
+	}
+}
+
+// Функция записи `batch_size` дескрипторов, начиная с `idx`, и передачи их ядру.
+static void
+tx_submit(struct socket_info* xsk, uint32_t* frame_nb, uint32_t idx, int batch_size) {
+	unsigned int i;
+
 	for (i = 0; i < batch_size;) {
 		uint32_t len = sizeof(syn_pkt);
 
@@ -691,7 +1807,29 @@ tx_only(struct socket_info* xsk, uint32_t* frame_nb, int batch_size) {
 	// Подтверждение записи пакетов/фрагментов.
 	// Подтверждение: https://docs.ebpf.io/ebpf-library/libxdp/functions/xsk_ring_prod__submit/
 	xsk_ring_prod__submit(&xsk->tx, batch_size);
-	xsk->tx_count += batch_size;
+	xsk->outstanding_tx += batch_size;
+	xsk->tx_count += batch_size / frames_per_pkt;
+}
+
+// Функция записи и отправки `batch_size` пакетов.
+static int
+tx_only(struct socket_info* xsk, uint32_t* frame_nb, int batch_size) {
+	uint32_t idx;
+
+	// Резервирование `batch_size` пакетов/фрагментов в очереди записи.
+	// Подробнее: https://docs.ebpf.io/ebpf-library/libxdp/functions/xsk_ring_prod__reserve/
+	while (xsk_ring_prod__reserve(&xsk->tx, batch_size, &idx) < batch_size) {
+		complete_tx_only(xsk, batch_size);
+		if (work_done)
+			return 0;
+	}
+
+	tx_pacing_wait(xsk, batch_size / frames_per_pkt);
+	tx_submit(xsk, frame_nb, idx, batch_size);
+	// Размер блока отправки подстраивается под заполненность очереди completion.
+	if (opt_adaptive_batch)
+		batch_ctl_update(&xsk->batch, xsk_cons_nb_avail(&xsk->umem->cr,
+			XSK_RING_CONS__DEFAULT_NUM_DESCS) / frames_per_pkt);
 	// Ожидание отправки пакетов/фрагментов ядром.
 	complete_tx_only(xsk, batch_size);
 
@@ -699,19 +1837,20 @@ tx_only(struct socket_info* xsk, uint32_t* frame_nb, int batch_size) {
 }
 
 // Функция заверщения отправки пакетов.
+// Ожидает возврата всех переданных ядру фрагментов, но не дольше `TX_COMPLETE_TIMEOUT` секунд.
 static void
 complete_tx_only_all(struct socket_info* xsk)
 {
-	bool pending;
+	uint64_t deadline = get_nsecs() + TX_COMPLETE_TIMEOUT * 1000000000UL;
 
-	do {
-		pending = false;
-		if (xsk->tx_count) {
-			complete_tx_only(xsk, opt_batch_size);
-			pending = !!xsk->tx_count;
-		}
-		sleep(1);
-	} while (pending && retries_count-- > 0);
+	while (xsk->outstanding_tx && get_nsecs() < deadline) {
+		if (!complete_tx_only(xsk, opt_batch_size))
+			usleep(10);
+	}
+
+	if (xsk->outstanding_tx)
+		fprintf(stderr, "WARNING: %llu frames were not completed by the kernel\n",
+			xsk->outstanding_tx);
 }
 
 // Функция отправки пакетов.
@@ -727,7 +1866,7 @@ tx_only_all(struct socket_info* xsk)
 	poll_fd.events = POLLOUT;
 
 	while ((opt_pkt_count && pkt_cnt < opt_pkt_count) || !opt_pkt_count) {
-		int batch_size = get_batch_size(pkt_cnt);
+		int batch_size = get_batch_size(xsk, pkt_cnt);
 		int tx_cnt = 0;
 
 		if (work_done)
@@ -747,8 +1886,254 @@ tx_only_all(struct socket_info* xsk)
 		pkt_cnt += tx_cnt;
 	}
 
-	if (opt_pkt_count)
-		complete_tx_only_all(xsk);
+	complete_tx_only_all(xsk);
+}
+
+// Функция отправки пакетов через группу сокетов одним потоком.
+// Блоки записываются во все сокеты группы, после чего уведомление ядра (sendto)
+// выполняется один раз за проход и только для сокетов, которым оно требуется.
+static void
+tx_only_group(struct socket_info** group, int count)
+{
+	uint32_t frame_nb[MAX_SOCKS] = {0};
+	int pkt_cnt[MAX_SOCKS] = {0};
+	bool kick[MAX_SOCKS];
+	bool active = true;
+	uint32_t idx;
+
+	while (active && !work_done) {
+		active = false;
+
+		for (int j = 0; j < count; j++) {
+			struct socket_info* xsk = group[j];
+			int batch_size;
+
+			kick[j] = false;
+			if (opt_pkt_count && pkt_cnt[j] >= opt_pkt_count)
+				continue;
+			active = true;
+
+			// При заполненной очереди записи ядру нужно только уведомление.
+			batch_size = get_batch_size(xsk, pkt_cnt[j]);
+			if (xsk_ring_prod__reserve(&xsk->tx, batch_size, &idx) < batch_size) {
+				kick[j] = true;
+				continue;
+			}
+			// Ограничитель скорости не должен блокировать остальные сокеты группы.
+			if (!tx_pacing_try(xsk, batch_size / frames_per_pkt)) {
+				xsk_ring_prod__cancel(&xsk->tx, batch_size);
+				kick[j] = xsk->outstanding_tx > 0;
+				continue;
+			}
+
+			tx_submit(xsk, &frame_nb[j], idx, batch_size);
+			pkt_cnt[j] += batch_size / frames_per_pkt;
+			if (opt_adaptive_batch)
+				batch_ctl_update(&xsk->batch, xsk_cons_nb_avail(&xsk->umem->cr,
+					XSK_RING_CONS__DEFAULT_NUM_DESCS) / frames_per_pkt);
+			kick[j] = true;
+		}
+
+		for (int j = 0; j < count; j++) {
+			if (kick[j] && tx_needs_kick(group[j]))
+				kick_tx(group[j]);
+		}
+
+		for (int j = 0; j < count; j++)
+			reap_tx(group[j], opt_batch_size);
+	}
+
+	for (int j = 0; j < count; j++)
+		complete_tx_only_all(group[j]);
+}
+
+// Функция возврата отправленных ядром ячеек в очередь fill.
+// Используется, когда одни и те же ячейки служат и для приёма, и для отправки.
+static void
+recycle_tx_frames(struct socket_info* xsk, bool to_fill) {
+	uint32_t idx_cq = 0, idx_fq = 0;
+	unsigned int rcvd;
+	int ret;
+
+	rcvd = xsk_ring_cons__peek(&xsk->umem->cr, opt_batch_size, &idx_cq);
+	if (!rcvd)
+		return;
+
+	if (to_fill) {
+		ret = xsk_ring_prod__reserve(&xsk->umem->pr, rcvd, &idx_fq);
+		while (ret != rcvd) {
+			if (ret < 0)
+				exit_with_error(-ret);
+			rx_wakeup(xsk);
+			ret = xsk_ring_prod__reserve(&xsk->umem->pr, rcvd, &idx_fq);
+		}
+		// Подробнее: https://docs.ebpf.io/ebpf-library/libxdp/functions/xsk_ring_cons__comp_addr/
+		for (unsigned int i = 0; i < rcvd; i++)
+			*xsk_ring_prod__fill_addr(&xsk->umem->pr, idx_fq++) =
+				*xsk_ring_cons__comp_addr(&xsk->umem->cr, idx_cq++);
+		xsk_ring_prod__submit(&xsk->umem->pr, rcvd);
+	}
+
+	xsk_ring_cons__release(&xsk->umem->cr, rcvd);
+	xsk->outstanding_tx -= rcvd;
+}
+
+// Функция отражения полученных пакетов отправителю.
+// Пакет отправляется из той же ячейки UMEM, в которую был получен, с обменом MAC адресов.
+static void
+reflect(struct socket_info* xsk) {
+	unsigned int rcvd, i;
+	uint32_t idx_rx = 0, idx_tx = 0;
+
+	recycle_tx_frames(xsk, true);
+
+	rcvd = xsk_ring_cons__peek(&xsk->rx, opt_batch_size, &idx_rx);
+	if (!rcvd) {
+		rx_wakeup(xsk);
+		if (xsk->outstanding_tx && tx_needs_kick(xsk))
+			kick_tx(xsk);
+		return;
+	}
+
+	while (xsk_ring_prod__reserve(&xsk->tx, rcvd, &idx_tx) < rcvd) {
+		kick_tx(xsk);
+		recycle_tx_frames(xsk, true);
+		if (work_done)
+			return;
+	}
+
+	for (i = 0; i < rcvd; i++) {
+		const struct xdp_desc* rx_desc = xsk_ring_cons__rx_desc(&xsk->rx, idx_rx++);
+		struct xdp_desc* tx_desc = xsk_ring_prod__tx_desc(&xsk->tx, idx_tx++);
+		struct ether_header* eth = xsk_umem__get_data(xsk->umem->buffer,
+			xsk_umem__add_offset_to_addr(rx_desc->addr));
+		uint8_t tmp[ETH_ALEN];
+
+		memcpy(tmp, eth->ether_dhost, ETH_ALEN);
+		memcpy(eth->ether_dhost, eth->ether_shost, ETH_ALEN);
+		memcpy(eth->ether_shost, tmp, ETH_ALEN);
+
+		*tx_desc = *rx_desc;
+	}
+
+	xsk_ring_prod__submit(&xsk->tx, rcvd);
+	xsk_ring_cons__release(&xsk->rx, rcvd);
+	xsk->outstanding_tx += rcvd;
+	xsk->rx_count += rcvd;
+	xsk->tx_count += rcvd;
+
+	if (tx_needs_kick(xsk))
+		kick_tx(xsk);
+}
+
+// Функция отражения пакетов до завершения работы.
+static void
+reflect_all(struct socket_info* xsk) {
+	struct pollfd poll_fd = { .fd = xsk_socket__fd(xsk->xsk), .events = POLLIN };
+
+	while (!work_done) {
+		if (opt_poll && poll(&poll_fd, 1, opt_timeout) <= 0)
+			continue;
+		reflect(xsk);
+	}
+}
+
+// Функция ожидания ответа на зонд с номером `seq` до момента `deadline`.
+// Возвращает true, если ответ получен.
+static bool
+ping_wait_reply(struct socket_info* xsk, uint32_t seq, uint64_t deadline) {
+	struct pollfd poll_fd = { .fd = xsk_socket__fd(xsk->xsk), .events = POLLIN };
+	uint32_t idx_rx = 0, idx_fq = 0;
+	bool found = false;
+	unsigned int rcvd;
+	uint64_t now;
+
+	while (!found && !work_done && (now = get_nsecs()) < deadline) {
+		if (opt_poll) {
+			// Ожидание с помощью poll() вместо активного опроса кольца.
+			int timeout = (deadline - now + 999999) / 1000000;
+			if (poll(&poll_fd, 1, timeout) <= 0)
+				continue;
+		}
+
+		recycle_tx_frames(xsk, false);
+
+		rcvd = xsk_ring_cons__peek(&xsk->rx, opt_batch_size, &idx_rx);
+		if (!rcvd) {
+			// Уведомление ядра выполняется только при установленном флаге need_wakeup
+			// или в режиме "busy-poll", иначе кольцо опрашивается без системных вызовов.
+			rx_wakeup(xsk);
+			continue;
+		}
+
+		while (xsk_ring_prod__reserve(&xsk->umem->pr, rcvd, &idx_fq) != rcvd)
+			rx_wakeup(xsk);
+
+		for (unsigned int i = 0; i < rcvd; i++) {
+			const struct xdp_desc* desc = xsk_ring_cons__rx_desc(&xsk->rx, idx_rx++);
+			char* pkt = xsk_umem__get_data(xsk->umem->buffer,
+				xsk_umem__add_offset_to_addr(desc->addr));
+			struct latency_probe* probe = (struct latency_probe*)(pkt + probe_offset);
+
+			// Ответы на просроченные зонды и посторонние пакеты пропускаются.
+			if (desc->len >= probe_offset + sizeof(*probe) &&
+					probe->magic == LATENCY_PROBE_MAGIC && probe->seq == seq) {
+				hist_record(xsk->hist, get_nsecs() - probe->ts);
+				found = true;
+			}
+			*xsk_ring_prod__fill_addr(&xsk->umem->pr, idx_fq++) =
+				xsk_umem__extract_addr(desc->addr);
+		}
+
+		xsk_ring_prod__submit(&xsk->umem->pr, rcvd);
+		xsk_ring_cons__release(&xsk->rx, rcvd);
+		xsk->rx_count += rcvd;
+	}
+
+	return found;
+}
+
+// Функция измерения задержки методом "ping-pong".
+// Следующий зонд отправляется только после получения ответа на предыдущий
+// или истечения времени ожидания (`opt_timeout`).
+static void
+ping_all(struct socket_info* xsk) {
+	uint32_t seq = 0, idx;
+
+	while (!work_done && (!opt_pkt_count || seq < opt_pkt_count)) {
+		uint64_t addr = (PING_RX_FRAMES + seq % (NUM_FRAMES - PING_RX_FRAMES)) *
+			opt_xsk_frame_size;
+		struct latency_probe* probe = xsk_umem__get_data(xsk->umem->buffer,
+			addr + probe_offset);
+		struct xdp_desc* tx_desc;
+
+		while (xsk_ring_prod__reserve(&xsk->tx, 1, &idx) != 1) {
+			complete_tx_only(xsk, opt_batch_size);
+			if (work_done)
+				return;
+		}
+
+		tx_desc = xsk_ring_prod__tx_desc(&xsk->tx, idx);
+		tx_desc->addr = addr;
+		tx_desc->len = probe_offset + sizeof(*probe);
+		tx_desc->options = 0;
+
+		probe->magic = LATENCY_PROBE_MAGIC;
+		probe->seq = seq;
+		probe->ts = get_nsecs();
+
+		xsk_ring_prod__submit(&xsk->tx, 1);
+		xsk->outstanding_tx++;
+		xsk->tx_count++;
+		if (tx_needs_kick(xsk))
+			kick_tx(xsk);
+
+		if (!ping_wait_reply(xsk, seq, probe->ts + opt_timeout * 1000000UL))
+			xsk->hist->lost++;
+		seq++;
+	}
+
+	complete_tx_only_all(xsk);
 }
 
 // Доступные аргументы программы.
@@ -768,6 +2153,23 @@ static struct option long_options[] = {
 	{"frags", no_argument, 0, 'F'},
 	{"batch-size", required_argument, 0, 's'},
 	{"tx-pkt-count", required_argument, 0, 'C'},
+	{"tx-rate", required_argument, 0, 'R'},
+	{"tx-rate-bps", required_argument, 0, 'B'},
+	{"workers", required_argument, 0, 'w'},
+	{"xsks-per-thread", required_argument, 0, 'g'},
+	{"hot-swap", no_argument, 0, 'H'},
+	{"ping", no_argument, 0, 'P'},
+	{"reflect", no_argument, 0, 'E'},
+	{"parallel-setup", no_argument, 0, 'j'},
+	{"adaptive-batch", no_argument, 0, 'A'},
+	{"interval", required_argument, 0, 'n'},
+	{"aggregate", no_argument, 0, 'a'},
+	{"aggregate-drop", no_argument, 0, 'D'},
+	{"capture", no_argument, 0, 'c'},
+	{"flow-sample", required_argument, 0, 'e'},
+	{"pkt-sample", required_argument, 0, 'k'},
+	{"sample-seed", required_argument, 0, 'x'},
+	{"wakeup-batch", required_argument, 0, 'W'},
 	{0, 0, 0, 0}
 };
 
@@ -778,6 +2180,25 @@ static void usage(const char* prog) {
 		"  Options:\n"
 		"  -r, --rxonly		Print all incoming packets (default)\n"
 		"  -t, --txonly		Only send packets\n"
+		"  -P, --ping		Send latency probes one at a time and report RTT.\n"
+		"			Combine with -b, -p or -m to compare wait modes;\n"
+		"			-C limits the number of probes.\n"
+		"  -a, --aggregate	Count packets per flow in the XDP program (-l) without\n"
+		"			sockets and drain the flow table every --interval seconds.\n"
+		"  -D, --aggregate-drop	Drop packets after counting (or capturing) instead of\n"
+		"			passing them.\n"
+		"  -c, --capture		Copy the first %d bytes of every packet into a BPF ring\n"
+		"			buffer (-l) and read it without sockets or UMEM.\n"
+		"  -W, --wakeup-batch=n	Wake the capture reader once per n records. Default: %d\n"
+		"  -E, --reflect		Send every received packet back with swapped MACs\n"
+		"			(peer for --ping; xdp_reflect.o does the same with XDP_TX).\n"
+		"  -e, --flow-sample=n	Send only 1 in n flows (whole conversations, chosen by\n"
+		"			5-tuple hash) to the sockets; the rest go to the stack.\n"
+		"  -k, --pkt-sample=n	Of the sampled flows, send 1 in n packets at random.\n"
+		"  -x, --sample-seed=n	Flow hash seed for --flow-sample; another value\n"
+		"			selects another set of flows. Default: 0\n"
+		"			Rates live in config_map and can be changed at runtime\n"
+		"			(e.g. with bpftool map update); they survive --hot-swap.\n"
 		"  -i, --interface=<NAME>	Run on interface n\n"
 		"  -q, --queues=n	Use n queue (default 1)\n"
 		"  -l, --load-xdp	Load xdp programm\n"
@@ -788,13 +2209,27 @@ static void usage(const char* prog) {
 		"  -m, --no-need-wakeup Turn off use of driver need wakeup flag.\n"
 		"  -f, --frame-size=n   Set the frame size (must be a power of two in aligned mode, default is %d).\n"
 		"  -u, --unaligned	Enable unaligned chunk placement\n"
-		// "  -F, --frags		Enable frags (multi-buffer) support\n"
+		"  -F, --frags		Enable frags (multi-buffer) support\n"
 		"  -s, --batch-size=n	Batch size for sending or receiving\n"
 		"			packets. Default: %d\n"
+		"  -A, --adaptive-batch	Adjust the batch size at runtime between %d and\n"
+		"			--batch-size from ring occupancy and empty polls.\n"
+		"  -n, --interval=n	Print per-socket rates and batch size every n seconds.\n"
 		"  -C, --tx-pkt-count=n	Number of packets to send.\n"
 		"			Default: Continuous packets.\n"
+		"  -R, --tx-rate=n	Send at n packets per second per socket.\n"
+		"  -B, --tx-rate-bps=n	Send at n bits per second (on the wire) per socket.\n"
+		"  -w, --workers=n	Hand received packets off to n worker threads per socket.\n"
+		"			Default: process packets in the RX thread.\n"
+		"  -g, --xsks-per-thread=n	Service n sockets round-robin from one thread.\n"
+		"			Default: 1\n"
+		"  -j, --parallel-setup	Set up sockets concurrently, each on its target core,\n"
+		"			and prefault UMEM pages.\n"
+		"  -H, --hot-swap		Attach the XDP program via bpf_link and reload it\n"
+		"			from the same file on SIGHUP without recreating sockets.\n"
 		"\n";
-	fprintf(stderr, str, prog, XSK_UMEM__DEFAULT_FRAME_SIZE, opt_batch_size);
+	fprintf(stderr, str, prog, CAPTURE_HDR_LEN, opt_wakeup_batch,
+		XSK_UMEM__DEFAULT_FRAME_SIZE, opt_batch_size, BATCH_MIN);
 
 	exit(EXIT_FAILURE);
 }
@@ -808,7 +2243,7 @@ parse_command_line(int argc, char** argv) {
 
 	for (;;) {
 		c = getopt_long(argc, argv,
-				"rti:q:pSNf:muMb:C:Fl:",
+				"rti:q:pSNf:muMb:C:Fl:R:B:w:g:HPEjAn:s:aDcW:e:k:x:",
 				long_options, &option_index);
 		if (c == -1)
 			break;
@@ -820,6 +2255,33 @@ parse_command_line(int argc, char** argv) {
 		case 't':
 			opt_mode = MODE_TXONLY;
 			break;
+		case 'P':
+			opt_mode = MODE_PING;
+			break;
+		case 'E':
+			opt_mode = MODE_REFLECT;
+			break;
+		case 'a':
+			opt_mode = MODE_AGGREGATE;
+			break;
+		case 'D':
+			opt_agg_action = XDP_DROP;
+			break;
+		case 'c':
+			opt_mode = MODE_CAPTURE;
+			break;
+		case 'W':
+			opt_wakeup_batch = atoi(optarg);
+			break;
+		case 'e':
+			opt_flow_sample = atoi(optarg);
+			break;
+		case 'k':
+			opt_pkt_sample = atoi(optarg);
+			break;
+		case 'x':
+			opt_sample_seed = strtoul(optarg, NULL, 0);
+			break;
 		case 'i':
 			opt_if = optarg;
 			break;
@@ -851,6 +2313,10 @@ parse_command_line(int argc, char** argv) {
 		case 'f':
 			opt_xsk_frame_size = atoi(optarg);
 			break;
+		case 'F':
+			opt_frags = true;
+			opt_xdp_bind_flags |= XDP_USE_SG;
+			break;
 		case 'm':
 			opt_need_wakeup = false;
 			opt_xdp_bind_flags &= ~XDP_USE_NEED_WAKEUP;
@@ -861,6 +2327,30 @@ parse_command_line(int argc, char** argv) {
 		case 'C':
 			opt_pkt_count = atoi(optarg);
 			break;
+		case 'R':
+			opt_tx_rate_pps = strtoull(optarg, NULL, 0);
+			break;
+		case 'B':
+			opt_tx_rate_bps = strtoull(optarg, NULL, 0);
+			break;
+		case 'w':
+			opt_workers = atoi(optarg);
+			break;
+		case 'g':
+			opt_xsks_per_thread = atoi(optarg);
+			break;
+		case 'H':
+			opt_hot_swap = true;
+			break;
+		case 'j':
+			opt_parallel_setup = true;
+			break;
+		case 'A':
+			opt_adaptive_batch = true;
+			break;
+		case 'n':
+			opt_interval = atoi(optarg);
+			break;
 		default:
 			usage(basename(argv[0]));
 		}
@@ -879,16 +2369,63 @@ parse_command_line(int argc, char** argv) {
 		fprintf(stderr, "--frame-size=%d is not a power of two\n", opt_xsk_frame_size);
 		usage(basename(argv[0]));
 	}
+
+	// Перевод скорости в битах в секунду в пакеты в секунду с учётом накладных расходов на линии.
+	if (opt_tx_rate_bps)
+		opt_tx_rate_pps = opt_tx_rate_bps / ((sizeof(syn_pkt) + ETH_WIRE_OVERHEAD) * 8);
+	if ((opt_tx_rate_bps || opt_tx_rate_pps) && !opt_tx_rate_pps) {
+		fprintf(stderr, "--tx-rate-bps is lower than one packet per second\n");
+		usage(basename(argv[0]));
+	}
+
+	if (opt_workers > MAX_WORKERS || (opt_workers && opt_mode != MODE_RXONLY)) {
+		fprintf(stderr, "--workers must be at most %d and is only supported in rxonly mode\n",
+			MAX_WORKERS);
+		usage(basename(argv[0]));
+	}
+
+	if (!opt_xsks_per_thread ||
+			(opt_xsks_per_thread > 1 && opt_mode != MODE_RXONLY && opt_mode != MODE_TXONLY)) {
+		fprintf(stderr, "--xsks-per-thread must be positive and is only supported "
+			"in rxonly and txonly modes\n");
+		usage(basename(argv[0]));
+	}
+
+	if (opt_hot_swap && !opt_load_xdp) {
+		fprintf(stderr, "--hot-swap requires --load-xdp\n");
+		usage(basename(argv[0]));
+	}
 }
 
 
 void*
 run_af_xdp(void* ptr) {
 	int i = *(int*)ptr;
-	if (opt_mode == MODE_RXONLY)
-		rx_only_all(xsks[i]);
-	else if (opt_mode == MODE_TXONLY)
-		tx_only_all(xsks[i]);
+
+	if (opt_xsks_per_thread > 1) {
+		// Поток обслуживает сокеты с `i * opt_xsks_per_thread` по следующую группу.
+		int first = i * opt_xsks_per_thread;
+		int count = num_socks - first;
+
+		if (count > opt_xsks_per_thread)
+			count = opt_xsks_per_thread;
+		if (opt_mode == MODE_RXONLY)
+			rx_only_group(&xsks[first], count);
+		else if (opt_mode == MODE_TXONLY)
+			tx_only_group(&xsks[first], count);
+	} else {
+		if (opt_mode == MODE_RXONLY)
+			rx_only_all(xsks[i]);
+		else if (opt_mode == MODE_TXONLY)
+			tx_only_all(xsks[i]);
+		else if (opt_mode == MODE_PING)
+			ping_all(xsks[i]);
+		else if (opt_mode == MODE_REFLECT)
+			reflect_all(xsks[i]);
+	}
+
+	__atomic_sub_fetch(&io_threads_running, 1, __ATOMIC_RELEASE);
+	return NULL;
 }
 
 int
@@ -904,16 +2441,153 @@ set_affinity_attr(pthread_attr_t *attr, int cpu) {
 	return (ret > 0) ? -ret : ret;
 }
 
-int main(int argc, char** argv) {
+// Функция создания UMEM и сокета для очереди `i` с замером длительности этапов.
+static void
+setup_socket(int i, struct setup_times* t) {
+	size_t page_size = sysconf(_SC_PAGESIZE);
 	struct umem_info* umem;
+	uint64_t ts = get_nsecs();
+	void* bufs;
+
+	bufs = mmap(NULL, NUM_FRAMES * opt_xsk_frame_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | opt_mmap_flags, -1, 0);
+	if (bufs == MAP_FAILED) {
+		printf("ERROR: mmap failed\n");
+		exit(EXIT_FAILURE);
+	}
+	setup_phase_end(t, PHASE_MMAP, &ts);
+
+	// Выделение страниц UMEM заранее. Страницы выделяются на узле NUMA
+	// логического процессора, который первым к ним обратился.
+	if (opt_parallel_setup) {
+		for (size_t off = 0; off < NUM_FRAMES * opt_xsk_frame_size; off += page_size)
+			((volatile char*)bufs)[off] = 0;
+	}
+	setup_phase_end(t, PHASE_PREFAULT, &ts);
+
+	umem = create_umem(bufs, NUM_FRAMES * opt_xsk_frame_size);
+	setup_phase_end(t, PHASE_UMEM, &ts);
+
+	// Без флага INHIBIT_PROG_LOAD libxdp загружает программу по умолчанию при создании
+	// первого сокета, поэтому параллельное создание сокетов в этом случае запрещено.
+	if (!opt_load_xdp)
+		pthread_mutex_lock(&setup_mutex);
+	xsks[i] = create_socket(umem, opt_mode != MODE_TXONLY, opt_mode != MODE_RXONLY, i);
+	if (!opt_load_xdp)
+		pthread_mutex_unlock(&setup_mutex);
+	xsks[i]->batch.size = opt_adaptive_batch && opt_batch_size > BATCH_MIN ?
+		BATCH_MIN : opt_batch_size;
+	apply_setsockopt(xsks[i]);
+	setup_phase_end(t, PHASE_SOCKET, &ts);
+
+	if (opt_mode == MODE_RXONLY || opt_mode == MODE_REFLECT) {
+		configure_fill_ring(umem, XSK_RING_PROD__DEFAULT_NUM_DESCS * 2);
+	}
+	if (opt_mode == MODE_TXONLY) {
+		uint32_t len = 0;
+		for (int j = 0; j < NUM_FRAMES; j++)
+			gen_eth_frame(umem, j * opt_xsk_frame_size, &len);
+	}
+	if (opt_mode == MODE_PING) {
+		// Первая половина UMEM используется для приёма ответов, вторая - для зондов.
+		configure_fill_ring(umem, PING_RX_FRAMES);
+		for (int j = PING_RX_FRAMES; j < NUM_FRAMES; j++)
+			probe_frame_init(xsk_umem__get_data(umem->buffer, j * opt_xsk_frame_size));
+		xsks[i]->hist = calloc(1, sizeof(struct latency_hist));
+		if (!xsks[i]->hist)
+			exit_with_error(ENOMEM);
+	}
+	if (opt_workers) {
+		xsks[i]->workers = calloc(opt_workers, sizeof(struct worker_info));
+		if (!xsks[i]->workers)
+			exit_with_error(ENOMEM);
+		for (int w = 0; w < opt_workers; w++) {
+			xsks[i]->workers[w].in = pipe_ring_create();
+			xsks[i]->workers[w].ret = pipe_ring_create();
+			xsks[i]->workers[w].xsk = xsks[i];
+		}
+	}
+	setup_phase_end(t, PHASE_RINGS, &ts);
+}
+
+
+// Аргументы потока параллельной настройки сокета.
+struct setup_args {
+	int index;
+	struct setup_times* times;
+};
+
+// Функция потока параллельной настройки сокета.
+static void*
+run_setup(void* ptr) {
+	struct setup_args* args = ptr;
+
+	setup_socket(args->index, args->times);
+	return NULL;
+}
+
+// Функция параллельной настройки сокетов.
+// Каждый сокет настраивается потоком на том логическом процессоре, на котором затем
+// будет работать поток его обслуживания, поэтому UMEM и кольца оказываются
+// в локальной для него памяти.
+static void
+setup_sockets_parallel(int cpu_count, struct setup_times* times) {
+	pthread_t threads[MAX_SOCKS];
+	pthread_attr_t attrs[MAX_SOCKS];
+	struct setup_args args[MAX_SOCKS];
+	int ret;
+
+	for (int i = 0; i < opt_num_xsks; i++) {
+		int cpu = (i / opt_xsks_per_thread) % cpu_count;
+
+		args[i].index = i;
+		args[i].times = &times[i];
+		pthread_attr_init(&attrs[i]);
+		if (set_affinity_attr(&attrs[i], cpu) < 0)
+			exit_with_error(EINVAL);
+		if ((ret = pthread_create(&threads[i], &attrs[i], run_setup, &args[i])) != 0)
+			exit_with_error(ret);
+	}
+
+	for (int i = 0; i < opt_num_xsks; i++) {
+		pthread_join(threads[i], NULL);
+		pthread_attr_destroy(&attrs[i]);
+	}
+}
+
+// Функция вывода длительности этапов настройки сокетов.
+static void
+print_setup_times(const struct setup_times* times, uint64_t total_ns) {
+	static const char* names[PHASE_MAX] = { "mmap", "prefault", "umem", "socket", "rings" };
+
+	printf("Startup %s: %llu us total\n", opt_parallel_setup ? "(parallel)" : "(sequential)",
+		total_ns / 1000);
+	for (int p = 0; p < PHASE_MAX; p++) {
+		uint64_t sum = 0, max = 0;
+
+		for (int i = 0; i < opt_num_xsks; i++) {
+			sum += times[i].ns[p];
+			if (times[i].ns[p] > max)
+				max = times[i].ns[p];
+		}
+		printf("\t %-8s sum %8llu us, max per socket %8llu us\n", names[p],
+			sum / 1000, max / 1000);
+	}
+}
+
+int main(int argc, char** argv) {
+	struct setup_times setup_times[MAX_SOCKS] = {};
+	int cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+	uint64_t setup_start;
 	int ret;
-	void*bufs = NULL;
 
 	pthread_t* threads = NULL;
 	pthread_attr_t* attrs = NULL;
 	int* args = NULL;
+	int num_threads, num_io_threads;
 
 	parse_command_line(argc, argv);
+	probe_offset = probe_frame_offset(syn_pkt);
 
 	if (opt_num_xsks > MAX_SOCKS)
 		exit_with_error(EINVAL);
@@ -921,45 +2595,55 @@ int main(int argc, char** argv) {
 	signal(SIGINT, int_exit);
 	signal(SIGTERM, int_exit);
 	signal(SIGABRT, int_exit);
+	// Без --hot-swap SIGHUP по-прежнему завершает программу.
+	if (opt_hot_swap)
+		signal(SIGHUP, hup_reload);
 
   if (opt_load_xdp)
     load_xdp_program();
 
-	threads = calloc(opt_num_xsks, sizeof(pthread_t));
-	attrs = calloc(opt_num_xsks, sizeof(pthread_attr_t));
-	args = calloc(opt_num_xsks, sizeof(int));
+	// Режимы агрегации и захвата не используют сокеты, поэтому требуют XDP программу.
+	if (opt_mode == MODE_AGGREGATE || opt_mode == MODE_CAPTURE) {
+		if (!opt_load_xdp)
+			exit_with_error(EINVAL);
+		if (opt_mode == MODE_AGGREGATE)
+			run_aggregate();
+		else
+			run_capture();
+		return 0;
+	}
+
+	// Поток приёма/отправки на каждую группу сокетов и потоки обработки в режиме конвейера.
+	num_io_threads = (opt_num_xsks + opt_xsks_per_thread - 1) / opt_xsks_per_thread;
+	num_threads = num_io_threads + opt_num_xsks * opt_workers;
+	threads = calloc(num_threads, sizeof(pthread_t));
+	attrs = calloc(num_threads, sizeof(pthread_attr_t));
+	args = calloc(num_io_threads, sizeof(int));
 	if (!threads || !attrs || !args)
 		exit_with_error(ENOMEM);
 
 	frames_per_pkt = (sizeof(syn_pkt) - 1) / XSK_UMEM__DEFAULT_FRAME_SIZE + 1;
 
-	for (int i = 0; i < opt_num_xsks; i++) {
-		bufs = mmap(NULL, NUM_FRAMES * opt_xsk_frame_size, PROT_READ | PROT_WRITE,
-				MAP_PRIVATE | MAP_ANONYMOUS | opt_mmap_flags, -1, 0);
-		if (bufs == MAP_FAILED) {
-			printf("ERROR: mmap failed\n");
-			exit(EXIT_FAILURE);
-		}
+	setup_start = get_nsecs();
 
-		umem = create_umem(bufs, NUM_FRAMES * opt_xsk_frame_size);
-		xsks[i] = create_socket(umem, opt_mode == MODE_RXONLY, opt_mode == MODE_TXONLY, i);
-		apply_setsockopt(xsks[i]);
-		if (opt_mode == MODE_RXONLY) {
-			configure_fill_ring(umem);
-		}
-		if (opt_mode == MODE_TXONLY) {
-			uint32_t len = 0;
-			for (int j = 0; j < NUM_FRAMES; j++)
-				gen_eth_frame(umem, j * opt_xsk_frame_size, &len);
-		}
-	}
+	if (opt_parallel_setup)
+		setup_sockets_parallel(cpu_count, setup_times);
+	else
+		for (int i = 0; i < opt_num_xsks; i++)
+			setup_socket(i, &setup_times[i]);
 
 	num_socks = opt_num_xsks;
-	if (opt_load_xdp && opt_mode != MODE_TXONLY)
-		enter_xsks_into_map();
+	if (opt_load_xdp && write_xdp_config(xdp_bpf_obj()))
+		exit_with_error(EINVAL);
+	if (opt_load_xdp && opt_mode != MODE_TXONLY &&
+			enter_xsks_into_map(xdp_bpf_obj(), opt_hot_swap ?
+				xdp_object_prog_fd(xdp_obj) : xdp_program__fd(xdp_prog)))
+		exit_with_error(EINVAL);
 
-	int cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
-	for (int i = 0; i < opt_num_xsks; i++) {
+	print_setup_times(setup_times, get_nsecs() - setup_start);
+
+	io_threads_running = num_io_threads;
+	for (int i = 0; i < num_io_threads; i++) {
 		int cpu = i % cpu_count;
 		args[i] = i;
 
@@ -974,7 +2658,44 @@ int main(int argc, char** argv) {
 		}
 	}
 
-	for (int i = 0; i < opt_num_xsks; ++i) {
+	// Потоки обработки размещаются на ядрах после потоков приёма.
+	for (int i = num_io_threads; i < num_threads; i++) {
+		int cpu = i % cpu_count;
+		int sock = (i - num_io_threads) / opt_workers;
+		int w = (i - num_io_threads) % opt_workers;
+
+		pthread_attr_init(&attrs[i]);
+
+		if (set_affinity_attr(&attrs[i], cpu) < 0)
+			exit_with_error(EINVAL);
+
+		if ((ret = pthread_create(&threads[i], &attrs[i], run_worker, &xsks[sock]->workers[w])) != 0) {
+			printf("Create worker thread for core %d\n", cpu);
+			exit_with_error(ret);
+		}
+	}
+
+	// Основной поток ожидает завершения работы, обрабатывает запросы замены XDP программы
+	// и выводит статистику.
+	uint64_t last_stats = get_nsecs();
+	while (!work_done && __atomic_load_n(&io_threads_running, __ATOMIC_ACQUIRE) > 0) {
+		uint64_t now;
+
+		usleep(100000);
+		if (reload_xdp) {
+			reload_xdp = 0;
+			if (opt_hot_swap)
+				hot_swap_xdp_program();
+		}
+
+		now = get_nsecs();
+		if (opt_interval && now - last_stats >= opt_interval * 1000000000UL) {
+			print_stats(now - last_stats);
+			last_stats = now;
+		}
+	}
+
+	for (int i = 0; i < num_threads; ++i) {
 		pthread_join(threads[i], NULL);
 		pthread_attr_destroy(&attrs[i]);
 	}
@@ -1,19 +1,46 @@
 
 #include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <rte_eal.h>
 #include <rte_ethdev.h>
 #include <rte_cycles.h>
+#include <rte_time.h>
 #include <rte_lcore.h>
 #include <rte_mbuf.h>
+#include <rte_ring.h>
+#include <rte_ip.h>
+#include <rte_jhash.h>
+#include <rte_bus_vdev.h>
+#include <rte_eventdev.h>
+#include <rte_service.h>
+#include <rte_mbuf_dyn.h>
+#include <rte_acl.h>
+#include <rte_telemetry.h>
+#include <rte_malloc.h>
+#include <rte_udp.h>
+#include <rte_pcapng.h>
+#include <rte_hash.h>
+#include <rte_hash_crc.h>
+#include <rte_thash.h>
+#include <rte_prefetch.h>
+#include <rte_power.h>
+#include <rte_power_pmd_mgmt.h>
+#include <rte_gro.h>
+#include <rte_net.h>
+#include <rte_tcp.h>
+#include <rte_vxlan.h>
 
 // Основан на примере:
 //   https://github.com/DPDK/dpdk/tree/main/examples/skeleton
@@ -26,12 +53,148 @@
 #define TX_RING_SIZE 1024
 
 // Параметры памяти `rte_mempool`.
-#define NUM_MBUFS 8191
+// Количество mbuf в пуле очереди вычисляется из размеров колец (create_queue_pools).
 #define MBUF_CACHE_SIZE 250
 
 // Количество пакетов обрабатываемых на одно действие чтения или отправки.
 #define BURST_SIZE 256
 
+// Размер кольца между ядром приёма и ядром обработки (степень двойки).
+#define PIPE_RING_SIZE 4096
+// Максимальное количество ядер обработки.
+#define MAX_WORKERS 64
+
+// Режимы работы программы.
+enum mode_type {
+	MODE_RXONLY = 0,   // Захват пакетов.
+	MODE_TXONLY = 1,   // Отправка пакетов.
+	MODE_PIPELINE = 2, // Захват пакетов с передачей на отдельные ядра обработки.
+	MODE_EVENTDEV = 3, // Захват пакетов с планированием потоков через программный eventdev.
+	MODE_LATENCY = 4,  // Измерение задержки между ядрами отправки и приёма.
+	MODE_FORWARD = 5,  // Пересылка пакетов между парами портов.
+};
+
+// Роли ядер.
+enum lcore_role {
+	ROLE_IO = 0,     // Приём или отправка пакетов через очередь порта.
+	ROLE_WORKER = 1, // Обработка пакетов, полученных от ядер приёма.
+	ROLE_SINK = 2,   // Завершающий этап eventdev с восстановленным порядком потоков.
+	ROLE_TX = 3,     // Отправка пакетов с меткой времени в режиме измерения задержки.
+	ROLE_WRITER = 4, // Запись захваченных пакетов в файл pcapng.
+};
+
+// Количество событий, одновременно находящихся в программном eventdev.
+#define EVENT_LIMIT 4096
+// Количество отслеживаемых потоков при проверке порядка (размер flow_id события).
+#define EVENT_FLOWS (1 << 20)
+
+// Способ классификации пакетов на ядрах приёма.
+enum classify_type {
+	CLASSIFY_NONE = 0,   // Без классификации, выводятся все пакеты.
+	CLASSIFY_ACL = 1,    // Векторная классификация блока пакетов через `rte_acl`.
+	CLASSIFY_SCALAR = 2, // Вызов check_filter() для каждого пакета.
+};
+
+// Поведение ядра приёма при отсутствии пакетов.
+enum idle_type {
+	IDLE_SPIN = 0,      // Опрос с rte_pause() (по умолчанию).
+	IDLE_MONITOR = 1,   // `rte_power` PMD: ожидание записи в кольцо RX (UMWAIT/MONITORX).
+	IDLE_PAUSE = 2,     // `rte_power` PMD: TPAUSE или rte_pause() внутри rx_burst.
+	IDLE_SCALE = 3,     // `rte_power` PMD: снижение частоты ядра.
+	IDLE_INTERRUPT = 4, // Прерывания RX и ожидание в epoll.
+	IDLE_SLEEP = 5,     // Сон с увеличением длительности.
+};
+
+// Количество пустых опросов перед переходом к ожиданию и пределы длительности сна.
+#define IDLE_SPIN_POLLS 512
+#define IDLE_SLEEP_MIN_US 1
+#define IDLE_SLEEP_MAX_US 1000
+// Наибольшее время ожидания прерывания, после которого выполняется опрос.
+#define IDLE_INTR_TIMEOUT_MS 10
+
+// Размещение кадра, не помещающегося в буфер mbuf по умолчанию.
+enum buffer_type {
+	BUFFERS_CHAIN = 0, // Цепочка сегментов RTE_MBUF_DEFAULT_BUF_SIZE (scattered RX, multi-seg TX).
+	BUFFERS_LARGE = 1, // Один mbuf с буфером под кадр целиком.
+};
+
+// Наибольшее количество сегментов отправляемого пакета.
+#define TX_MAX_SEGS 16
+// Размер буфера mbuf в режиме BUFFERS_LARGE округляется до кратного этому значению.
+#define LARGE_BUF_ALIGN 1024
+
+// Максимальное количество правил классификации (включая правила пользователя).
+#define ACL_MAX_RULES 256
+
+// Параметры пакетов измерения задержки: порт UDP назначения, признак данных
+// и количество потоков (поток соответствует ядру отправки).
+#define LATENCY_UDP_PORT 9
+#define LATENCY_MAGIC 0x6c6174656e637921ULL
+#define LATENCY_MAX_FLOWS 64
+// Гистограмма задержки в наносекундах: на каждую степень двойки 8 интервалов.
+#define LATENCY_SUB_BITS 3
+#define LATENCY_BUCKETS (64 << LATENCY_SUB_BITS)
+// Время ожидания пакетов в пути после остановки ядер отправки.
+#define LATENCY_DRAIN_MS 100
+
+// Данные UDP пакета измерения задержки.
+struct latency_payload {
+	uint64_t magic;
+	uint64_t tsc;  // Время отправки в тиках процессора.
+	uint32_t seq;  // Порядковый номер пакета в потоке.
+	uint16_t flow; // Номер потока (ядра отправки).
+} __attribute__((packed));
+
+#define LATENCY_PKT_LEN (sizeof(struct rte_ether_hdr) + sizeof(struct rte_ipv4_hdr) + \
+	sizeof(struct rte_udp_hdr) + sizeof(struct latency_payload))
+
+// Статистика задержки ядра приёма. Изменяется только своим ядром, поэтому
+// не требует блокировок; объединяется по ядрам при выводе результатов.
+struct latency_stats {
+	uint64_t hist[LATENCY_BUCKETS];
+	uint64_t samples;
+	uint64_t sum_ns;
+	uint64_t min_ns;
+	uint64_t max_ns;
+	uint64_t foreign;                       // Пакеты без данных измерения задержки.
+	uint64_t received[LATENCY_MAX_FLOWS];
+	uint64_t reorders[LATENCY_MAX_FLOWS];   // Пакеты с номером меньше уже принятого.
+	uint32_t next_seq[LATENCY_MAX_FLOWS];   // Наибольший принятый номер, увеличенный на 1.
+	uint64_t prev_ns[LATENCY_MAX_FLOWS];    // Задержка предыдущего пакета потока.
+	double jitter_ns[LATENCY_MAX_FLOWS];    // Оценка вариации задержки (RFC 3550).
+};
+
+// Размер кольца копий пакетов для записи в файл (степень двойки).
+#define PCAPNG_RING_SIZE 16384
+// Количество пакетов в одной записи в файл и наибольшее время накопления записи.
+#define PCAPNG_WRITE_BURST 1024
+#define PCAPNG_FLUSH_US 1000
+
+// Отслеживание потоков: количество проверяемых на истечение записей на блок пакетов,
+// время неактивности потока по умолчанию и размер кольца выгрузки истёкших потоков.
+#define FLOW_EXPIRE_BATCH 32
+#define FLOW_TIMEOUT_SEC 30
+// Начальное значение перемешивания хэша RSS в сигнатуру `rte_hash`.
+#define FLOW_SIG_SEED 0x9e3779b9
+// Доля потоков -f, которые должны помещаться в таблицу при проверке её ёмкости.
+#define FLOW_MIN_FILL 0.9
+#define FLOW_EXPORT_RING_SIZE 65536
+
+// Наибольшее время накопления пакетов в буфере отправки при пересылке.
+#define FWD_FLUSH_US 100
+
+// Размер ключа Toeplitz, если драйвер его не сообщает.
+#define RSS_KEY_SIZE 40
+// Наибольшее количество записей RETA, переносимых за одну проверку нагрузки.
+#define RETA_MAX_MOVES 16
+
+// Метаданные пакета в динамическом поле mbuf для режима eventdev.
+struct event_meta {
+	uint64_t tsc; // Время приёма в тиках процессора.
+	uint32_t seq; // Порядковый номер пакета в очереди приёма.
+	uint16_t queue; // Очередь приёма, в которой назначен номер.
+};
+
 // Данные для отправки пакета.
 char syn_pkt[] = {
 	0x08, 0x00, 0x27, 0x99, 0x66, 0xc5, 0x08, 0x00,
@@ -56,12 +219,98 @@ uint64_t tsc_hz;
 uint64_t tsc_start;
 // Индекс сетевого интерфейса (порта).
 static uint16_t opt_port_id = 0;
-// Режим работы программы (захват или отправка).
-static int opt_mode = 0;
+// Режим работы программы.
+static enum mode_type opt_mode = MODE_RXONLY;
 // Количество очередей (колец) приема или отправки пакетов.
 static uint16_t opt_queue_count = 1;
 // Количество пакетов для отправки.
 static uint64_t opt_tx_count = INT64_MAX;
+// Пулы mbuf для каждой очереди.
+static struct rte_mempool** mbuf_pools;
+// Порт отправки и отдельные пулы ядер отправки в режиме измерения задержки.
+static uint16_t opt_tx_port_id = 0;
+static bool opt_tx_port_set = false;
+static struct rte_mempool** latency_pools;
+// Количество работающих ядер отправки в режиме измерения задержки.
+static uint16_t tx_running;
+// Размер таблицы перенаправления RSS (RETA) порта приёма и порог перераспределения:
+// отношение нагрузки самой загруженной очереди к средней (0 - не перераспределять).
+static uint16_t reta_size;
+// Ключ RSS портов (заполняется в port_init).
+static uint8_t rss_key[UINT8_MAX];
+static double opt_rebalance = 0;
+// Количество ядер обработки в режиме конвейера.
+static uint16_t opt_workers = 1;
+// Количество работающих ядер приёма в режимах конвейера и eventdev.
+static uint16_t rx_running;
+// Идентификатор программного eventdev, ядро его планировщика
+// и количество событий, ещё не дошедших до завершающего этапа.
+static uint8_t event_dev_id;
+static unsigned event_service_lcore;
+static uint64_t events_in_flight;
+// Смещение динамического поля `struct event_meta` в mbuf.
+static int event_meta_offset = -1;
+#define EVENT_META(m) RTE_MBUF_DYNFIELD((m), event_meta_offset, struct event_meta*)
+// Способ классификации пакетов и файл дополнительных правил.
+static enum classify_type opt_classify = CLASSIFY_NONE;
+static const char* opt_acl_rules = NULL;
+
+// Запись захваченных пакетов в файл pcapng: имя файла, длина сохраняемой части пакета
+// (0 - кадр MTU целиком), размер (МБ) и время (секунды) записи одного файла
+// до перехода к следующему.
+static const char* opt_pcapng_path = NULL;
+static uint32_t opt_snaplen = 0;
+static uint64_t opt_rotate_mb = 0;
+static unsigned opt_rotate_sec = 0;
+// Кольцо копий пакетов от ядер приёма к ядру записи.
+static struct rte_ring* pcapng_ring;
+
+// Отслеживание потоков: размер таблицы ядра приёма (0 - не отслеживать),
+// время неактивности потока в секундах и файл выгрузки (CSV).
+static uint32_t opt_flows = 0;
+static unsigned opt_flow_timeout = FLOW_TIMEOUT_SEC;
+static const char* opt_flow_export = NULL;
+// Кольцо истёкших потоков от ядер приёма к главному ядру и файл выгрузки.
+static struct rte_ring* flow_export_ring;
+static FILE* flow_export_file;
+
+// Пересылка: маска портов (0 - все доступные), замена MAC адресов,
+// порт назначения, MAC адрес и пулы mbuf каждого порта.
+static uint64_t opt_portmask = 0;
+static bool opt_mac_rewrite = false;
+static uint16_t fwd_dst_port[RTE_MAX_ETHPORTS];
+static struct rte_ether_addr port_macs[RTE_MAX_ETHPORTS];
+static struct rte_mempool** port_pools[RTE_MAX_ETHPORTS];
+
+// Объединение сегментов TCP (GRO) на ядрах приёма. Переключается сигналом SIGUSR1.
+static volatile bool gro_enabled = false;
+static bool opt_gro = false;
+
+// Большие кадры: MTU порта, размещение кадров больше буфера mbuf и длина отправляемых пакетов.
+static uint16_t opt_mtu = RTE_ETHER_MTU;
+static enum buffer_type opt_buffers = BUFFERS_CHAIN;
+static uint16_t opt_tx_size = sizeof(syn_pkt);
+// Размер буфера mbuf (включая RTE_PKTMBUF_HEADROOM) и количество сегментов отправляемого пакета.
+static uint16_t mbuf_buf_size = RTE_MBUF_DEFAULT_BUF_SIZE;
+static uint16_t tx_segs = 1;
+
+// Поведение ядер приёма при отсутствии пакетов.
+static enum idle_type opt_idle = IDLE_SPIN;
+static const char* idle_names[] = { "spin", "monitor", "pause", "scale", "interrupt", "sleep" };
+
+// Период вывода статистики порта в секундах (0 - не выводить).
+static unsigned opt_stats_interval = 0;
+// Количество ещё работающих потоков на «дополнительных» ядрах.
+static uint16_t threads_running;
+// Скорости порта, вычисленные ядром статистики, для запросов `rte_telemetry`.
+static struct {
+	uint64_t rx_pps, tx_pps;
+	uint64_t rx_bps, tx_bps;
+	uint64_t missed_pps;
+} port_rates;
+
+// Правила фильтрации захвата из src/bpf/filter.c (выражение FILTER в src/bpf/test.c).
+bool check_filter(const uint8_t* packet, size_t length);
 
 // Функция получения тиков процессора.
 static inline uint64_t
@@ -115,11 +364,126 @@ hex_dump(struct rte_mbuf* buff, int id) {
 	pthread_mutex_unlock(&mutex);
 }
 
-// Инициализация сетевого интерфейса (порта).
-// Аргументы: индекс сетевого интерфейса и указатель на кольцо пакетов.
+// Функция заполнения mbuf шаблоном пакета для отправки.
+// Вызывается один раз для каждого объекта `rte_mempool` при создании пула, до настройки
+// очередей, пока mbuf не переданы драйверу в кольцо RX. Выделенный mbuf
+// сбрасывается на то же смещение данных, поэтому при отправке данные не копируются.
+// Подробнее: https://doc.dpdk.org/api/rte__mempool_8h.html
+static void
+fill_tx_template(struct rte_mempool* mp, void* opaque, void* obj, unsigned obj_idx) {
+	struct rte_mbuf* m = obj;
+
+	rte_pktmbuf_reset(m);
+	rte_memcpy(rte_pktmbuf_mtod(m, char*), syn_pkt, sizeof(syn_pkt));
+
+	// Длина IPv4 соответствует opt_tx_size, данные после заголовков не заполняются.
+	struct rte_ipv4_hdr* ip = rte_pktmbuf_mtod_offset(m, struct rte_ipv4_hdr*, sizeof(struct rte_ether_hdr));
+	ip->total_length = rte_cpu_to_be_16(opt_tx_size - sizeof(struct rte_ether_hdr));
+	ip->hdr_checksum = 0;
+	ip->hdr_checksum = rte_ipv4_cksum(ip);
+}
+
+// Функция создания пулов mbuf для каждой очереди на NUMA узле сетевого интерфейса.
+// Пул очереди используется одним ядром, поэтому кэш `rte_mempool` обслуживает
+// почти все выделения и освобождения без обращения к общему кольцу пула.
+// Размер покрывает кольца RX и TX, блоки в обработке и кэш ядра, что исключает
+// нехватку mbuf (rx_nombuf), пока приложение не удерживает пакеты.
+// Блок отправляемых пакетов из нескольких сегментов занимает tx_segs mbuf на пакет.
+// Если задана функция `fill`, она вызывается для каждого mbuf пула с номером очереди.
+static struct rte_mempool**
+create_queue_pools(const char* prefix, uint16_t port, uint16_t nb_rxd, uint16_t nb_txd,
+		rte_mempool_obj_cb_t* fill) {
+	// Для виртуальных устройств возвращается SOCKET_ID_ANY.
+	// Подробнее: https://doc.dpdk.org/api/rte__ethdev_8h.html
+	int socket = rte_eth_dev_socket_id(port);
+	unsigned nb_mbufs = nb_rxd + nb_txd + 2 * BURST_SIZE * tx_segs + MBUF_CACHE_SIZE;
+	char name[RTE_MEMPOOL_NAMESIZE];
+	struct rte_mempool** pools;
+
+	// Оптимальный размер пула на единицу меньше степени двойки.
+	// Подробнее: https://doc.dpdk.org/api/rte__mempool_8h.html
+	nb_mbufs = rte_align32pow2(nb_mbufs + 1) - 1;
+
+	pools = calloc(opt_queue_count, sizeof(*pools));
+	if (pools == NULL)
+		return NULL;
+
+	for (uint16_t q = 0; q < opt_queue_count; q++) {
+		snprintf(name, sizeof(name), "%s_%u_%u", prefix, port, q);
+		// Создание именованного кольца памяти.
+		// Подробнее: https://doc.dpdk.org/api/rte__mbuf_8h.html#a8f4abb0d54753d2fde515f35c1ba402a
+		pools[q] = rte_pktmbuf_pool_create(name, nb_mbufs,
+			MBUF_CACHE_SIZE, 0, mbuf_buf_size, socket);
+		if (pools[q] == NULL) {
+			printf("Error: cannot create mbuf pool %s: %s\n", name, rte_strerror(rte_errno));
+			free(pools);
+			return NULL;
+		}
+		if (fill != NULL)
+			rte_mempool_obj_iter(pools[q], fill, &q);
+	}
+
+	printf("Created %u mbuf pools of %u mbufs (%u bytes) on socket %d\n", opt_queue_count, nb_mbufs,
+		mbuf_buf_size, socket);
+	return pools;
+}
+
+// Функция выбора размера буфера mbuf и количества сегментов отправляемого пакета.
+// Цепочка сегментов расходует память пула одинаково при любом MTU, но каждый сегмент
+// занимает дескриптор кольца и проходится при обработке. Увеличенный буфер сохраняет
+// один mbuf на кадр ценой памяти: короткие пакеты занимают буфер под кадр MTU целиком.
+// Подробнее: https://doc.dpdk.org/guides/prog_guide/mbuf_lib.html
+static void
+setup_buffers(void) {
+	uint32_t frame_len = (uint32_t)opt_mtu + RTE_ETHER_HDR_LEN + RTE_ETHER_CRC_LEN;
+
+	if (opt_tx_size < sizeof(syn_pkt))
+		rte_exit(EXIT_FAILURE, "Error: TX packet size must be at least %zu\n", sizeof(syn_pkt));
+	// Кадр больше MTU порт не отправит: драйвер отбросит пакет или вернёт ошибку.
+	if (opt_mode == MODE_TXONLY && opt_tx_size > opt_mtu + RTE_ETHER_HDR_LEN)
+		rte_exit(EXIT_FAILURE, "Error: TX packet size %u exceeds MTU %u + %u byte Ethernet header\n",
+			opt_tx_size, opt_mtu, RTE_ETHER_HDR_LEN);
+
+	if (opt_buffers == BUFFERS_LARGE && frame_len > RTE_MBUF_DEFAULT_DATAROOM) {
+		uint32_t buf_size = RTE_PKTMBUF_HEADROOM + RTE_ALIGN_CEIL(frame_len, LARGE_BUF_ALIGN);
+
+		if (buf_size > UINT16_MAX)
+			rte_exit(EXIT_FAILURE, "Error: %u byte frames do not fit one mbuf\n", frame_len);
+		mbuf_buf_size = buf_size;
+	}
+
+	const uint16_t data_room = mbuf_buf_size - RTE_PKTMBUF_HEADROOM;
+	if (opt_mode == MODE_TXONLY)
+		tx_segs = (opt_tx_size + data_room - 1) / data_room;
+	if (tx_segs > TX_MAX_SEGS)
+		rte_exit(EXIT_FAILURE, "Error: %u byte packets need more than %u segments\n",
+			opt_tx_size, TX_MAX_SEGS);
+
+	printf("Frames up to %u bytes: %u byte mbuf data room, %u %s\n", frame_len, data_room,
+		frame_len > data_room ? (frame_len + data_room - 1) / data_room : 1,
+		frame_len > data_room ? "segments max" : "segment");
+}
+
+// Функция вывода заполненности пула очереди и кэша ядра, которое его использует.
+static void
+print_pool_stats(uint16_t queue, unsigned lcore_id) {
+	struct rte_mempool* mp = mbuf_pools[queue];
+	// Подробнее: https://doc.dpdk.org/api/rte__mempool_8h.html
+	struct rte_mempool_cache* cache = rte_mempool_default_cache(mp, lcore_id);
+
+	printf("Pool %s:\t %u in use\t %u available", mp->name,
+		rte_mempool_in_use_count(mp), rte_mempool_avail_count(mp));
+	if (cache != NULL)
+		printf("\t cache %u/%u (flush at %u) on lcore %u", cache->len, cache->size,
+			cache->flushthresh, lcore_id);
+	printf("\n");
+}
+
+// Инициализация сетевого интерфейса (порта) и пулов mbuf его очередей.
+// Аргументы: индекс сетевого интерфейса.
 static inline int
-port_init(uint16_t port, struct rte_mempool *mbuf_pool) {
-	const uint16_t rx_queue_count = opt_queue_count
+port_init(uint16_t port) {
+	const uint16_t rx_queue_count = opt_queue_count;
 	const uint16_t tx_queue_count = opt_queue_count;
 	uint16_t nb_rxd = RX_RING_SIZE;
 	uint16_t nb_txd = TX_RING_SIZE;
@@ -133,15 +497,23 @@ port_init(uint16_t port, struct rte_mempool *mbuf_pool) {
 	if (!rte_eth_dev_is_valid_port(port))
 		return -1;
 
+	// Симметричный ключ Toeplitz: повторяющиеся 0x6d5a дают одинаковый хэш при перестановке
+	// адресов и портов, поэтому оба направления потока попадают в одну очередь.
+	// Подробнее: https://doc.dpdk.org/guides/prog_guide/toeplitz_hash_lib.html
+	for (size_t i = 0; i < sizeof(rss_key); i++)
+		rss_key[i] = i % 2 ? 0x5a : 0x6d;
+
 	struct rte_eth_conf port_conf = {
 		.rxmode = {
-			.mtu = 1500, // Величена MTU
+			.mtu = opt_mtu, // Величена MTU
 			.mq_mode = RTE_ETH_MQ_RX_RSS, // Включение распределения пакетов по очередям.
 		},
 		.rx_adv_conf = {
 			.rss_conf = { // Правила распределения пакетов по очередям
-				.rss_key = NULL, // Распределение пакетов на основе IPv4, TCP и UDP.
-				.rss_hf = RTE_ETH_RSS_NONFRAG_IPV4_TCP | RTE_ETH_RSS_NONFRAG_IPV4_UDP,
+				.rss_key = rss_key,
+				// Распределение пакетов IPv4 и IPv6 по адресам, а TCP, UDP и SCTP - и по портам.
+				// Остальные протоколы и фрагменты распределяются по адресам.
+				.rss_hf = RTE_ETH_RSS_IP | RTE_ETH_RSS_TCP | RTE_ETH_RSS_UDP | RTE_ETH_RSS_SCTP,
 			},
 		}
 	};
@@ -154,8 +526,57 @@ port_init(uint16_t port, struct rte_mempool *mbuf_pool) {
 		return retval;
 	}
 
-	// Установка гарантии, что все отправляемые пакеты принадлежат одному кольцу.
-	if (dev_info.tx_offload_capa & RTE_ETH_TX_OFFLOAD_MBUF_FAST_FREE)
+	// Виртуальные устройства (net_ring, net_af_packet) не поддерживают RSS,
+	// и запрос неподдерживаемых типов хэша завершает настройку порта ошибкой.
+	// Типы хэша ограничиваются поддерживаемыми устройством.
+	if (port_conf.rx_adv_conf.rss_conf.rss_hf & ~dev_info.flow_type_rss_offloads)
+		printf("Port %u: RSS hash types 0x%"PRIx64" not supported\n", port,
+			port_conf.rx_adv_conf.rss_conf.rss_hf & ~dev_info.flow_type_rss_offloads);
+	port_conf.rx_adv_conf.rss_conf.rss_hf &= dev_info.flow_type_rss_offloads;
+	port_conf.rx_adv_conf.rss_conf.rss_key_len = dev_info.hash_key_size ? dev_info.hash_key_size : RSS_KEY_SIZE;
+	if (port_conf.rx_adv_conf.rss_conf.rss_hf == 0)
+		port_conf.rxmode.mq_mode = RTE_ETH_MQ_RX_NONE;
+	if (port == opt_port_id && port_conf.rxmode.mq_mode == RTE_ETH_MQ_RX_RSS)
+		reta_size = dev_info.reta_size;
+
+	// Кадр MTU, не помещающийся в буфер mbuf, принимается в цепочку сегментов (scattered RX).
+	// Цепочки отправляются с MULTI_SEGS, который включается только при необходимости
+	// (пакеты tx_loop из нескольких сегментов или пересылка принятых цепочек): многие
+	// драйверы с ним отказываются от векторного пути отправки.
+	// Подробнее: https://doc.dpdk.org/guides/nics/features.html
+	uint32_t frame_len = opt_mtu + RTE_ETHER_HDR_LEN + RTE_ETHER_CRC_LEN;
+	if (opt_mtu < dev_info.min_mtu || opt_mtu > dev_info.max_mtu) {
+		printf("Error: port %u MTU must be in %u..%u\n", port, dev_info.min_mtu, dev_info.max_mtu);
+		return -EINVAL;
+	}
+	if (frame_len > mbuf_buf_size - RTE_PKTMBUF_HEADROOM) {
+		if (!(dev_info.rx_offload_capa & RTE_ETH_RX_OFFLOAD_SCATTER)) {
+			printf("Error: port %u has no scattered RX for MTU %u, use --buffers=large\n", port, opt_mtu);
+			return -ENOTSUP;
+		}
+		port_conf.rxmode.offloads |= RTE_ETH_RX_OFFLOAD_SCATTER;
+	}
+	if (tx_segs > 1 || (opt_mode == MODE_FORWARD && (port_conf.rxmode.offloads & RTE_ETH_RX_OFFLOAD_SCATTER))) {
+		if (!(dev_info.tx_offload_capa & RTE_ETH_TX_OFFLOAD_MULTI_SEGS)) {
+			printf("Error: port %u cannot send multi-segment packets, use --buffers=large\n", port);
+			return -ENOTSUP;
+		}
+		port_conf.txmode.offloads |= RTE_ETH_TX_OFFLOAD_MULTI_SEGS;
+	}
+
+	// Прерывания очередей RX для ожидания пакетов в epoll.
+	if (opt_idle == IDLE_INTERRUPT)
+		port_conf.intr_conf.rxq = 1;
+
+	// Сохранение хэша RSS в mbuf для распределения пакетов по ядрам обработки.
+	if (dev_info.rx_offload_capa & RTE_ETH_RX_OFFLOAD_RSS_HASH)
+		port_conf.rxmode.offloads |= RTE_ETH_RX_OFFLOAD_RSS_HASH;
+
+	// Установка гарантии, что все отправляемые пакеты принадлежат одному кольцу
+	// и не используются повторно (счётчик ссылок равен 1). Быстрое освобождение возвращает
+	// mbuf в пул без сброса полей цепочки, поэтому не сочетается с MULTI_SEGS.
+	if ((dev_info.tx_offload_capa & RTE_ETH_TX_OFFLOAD_MBUF_FAST_FREE) &&
+			!(port_conf.txmode.offloads & RTE_ETH_TX_OFFLOAD_MULTI_SEGS))
 		port_conf.txmode.offloads |= RTE_ETH_TX_OFFLOAD_MBUF_FAST_FREE;
 
 	// Настройка колец `RX` и `TX` сетевого интерфейса согласно параметрам.
@@ -170,10 +591,16 @@ port_init(uint16_t port, struct rte_mempool *mbuf_pool) {
 	if (retval != 0)
 		return retval;
 
+	// Однократное заполнение всех mbuf шаблоном пакета для отправки.
+	mbuf_pools = create_queue_pools("MBUF_POOL", port, nb_rxd, nb_txd,
+		opt_mode == MODE_TXONLY ? fill_tx_template : NULL);
+	if (mbuf_pools == NULL)
+		return -rte_errno;
+
 	for (q = 0; q < rx_queue_count; q++) {
 		// Выделение памяти для кольца RX и ей настройка.
 		// Подробнее: https://doc.dpdk.org/api/rte__ethdev_8h.html#a36ba70a5a6fce2c2c1f774828ba78f8d
-		retval = rte_eth_rx_queue_setup(port, q, nb_rxd, rte_eth_dev_socket_id(port), NULL, mbuf_pool);
+		retval = rte_eth_rx_queue_setup(port, q, nb_rxd, rte_eth_dev_socket_id(port), NULL, mbuf_pools[q]);
 		if (retval < 0)
 			return retval;
 	}
@@ -203,247 +630,2941 @@ port_init(uint16_t port, struct rte_mempool *mbuf_pool) {
 	return 0;
 }
 
-// Структура данных для потока захвата/отправки пакетов.
-struct thread_args {
-	struct rte_mempool* mbuf_pool;
-	uint16_t port;
-	uint16_t queue;
-	int mode;
-	uint64_t* count;
+// Поля правил `rte_acl`. Первое поле должно занимать один байт.
+enum acl_field {
+	ACL_FIELD_PROTO = 0,  // Протокол транспортного уровня.
+	ACL_FIELD_DST_MAC0,   // Первый байт MAC адреса назначения (признак групповой рассылки).
+	ACL_FIELD_TTL,        // TTL (IPv4) или Hop Limit (IPv6).
+	ACL_FIELD_SRC_PORT,
+	ACL_FIELD_DST_PORT,
+	ACL_FIELD_TCP_FLAGS,
+	ACL_FIELD_UDP_LEN,
+	ACL_FIELD_UDP_DATA,   // Два байта данных UDP со смещением 20.
+	ACL_NUM_FIELDS
 };
 
-// Функция захвата или отправки пакетов.
-static int
-lcore_main(void* arg) {
-	struct thread_args* args = (struct thread_args*)arg;
+RTE_ACL_RULE_DEF(acl_rule, ACL_NUM_FIELDS);
+
+// Контексты классификации для IPv4 (заголовок без опций) и IPv6 (без заголовков расширений).
+// Пакеты, захваченные короче ACL_L4_FULL байт после IP заголовка, классифицируются
+// контекстами *_SHORT без правил, которым нужно больше данных (l4_min_len): длина,
+// как и в check_filter(), определяется по захваченным данным, а не по заголовку IP.
+enum acl_ctx_type {
+	ACL_CTX_IPV4 = 0,
+	ACL_CTX_IPV6 = 1,
+	ACL_CTX_IPV4_SHORT = 2,
+	ACL_CTX_IPV6_SHORT = 3,
+	ACL_NUM_CTX
+};
 
-	if (args->mode == 0) {
-		while (!work_done) {
-			struct rte_mbuf *bufs[BURST_SIZE];
-			// Получения аллоцированных пакетов.
-			// Подробнее: https://doc.dpdk.org/api/rte__ethdev_8h.html#a3e7d76a451b46348686ea97d6367f102
-			const uint16_t nb_rx = rte_eth_rx_burst(args->port, args->queue, bufs, BURST_SIZE);
-
-			if (unlikely(nb_rx == 0)) {
-				// Небольшая задержка для снижения энергопотребления.
-				// Подробнее: https://doc.dpdk.org/api/rte__pause_8h.html#ad59aa7777c93d3cfd5f10617a3acd1c5
-				rte_pause();
-				continue;
-			}
+// Описание правила. Верхняя граница диапазона 0 означает любое значение
+// (в правилах пользователя диапазон с верхней границей 0 не допускается).
+struct acl_rule_spec {
+	const char* name;
+	uint8_t proto;
+	uint16_t sport_lo, sport_hi;
+	uint16_t dport_lo, dport_hi;
+	uint8_t tcp_flags, tcp_flags_mask;
+	uint8_t ttl, ttl_mask;
+	uint8_t dst_mac0_mask;          // Биты первого байта MAC адреса, равные нулю.
+	uint16_t udp_len_lo, udp_len_hi;
+	uint16_t udp_data_lo, udp_data_hi;
+	uint16_t l4_min_len;            // Минимальная захваченная длина после IP заголовка.
+	bool ipv4_only;
+	bool same_as_prev;              // Часть предыдущего правила (общий счётчик).
+};
 
-			for (uint16_t i = 0; i < nb_rx; ++i) {
-				hex_dump(bufs[i], args->queue);
-				// Возвращение буфера в память `rte_mempool`.
-				// Подробнее: https://doc.dpdk.org/api/rte__mbuf_8h.html#a1215458932900b7cd5192326fa4a6902
-				rte_pktmbuf_free(bufs[i]);
-			}
+// Правила check_filter(). Условия "не равно" разбиты на два диапазона.
+// Правило "dst port 1900 and ip[9] == 0x01" не может совпасть с UDP пакетом и не добавляется.
+static const struct acl_rule_spec filter_rules[] = {
+	{ .name = "tcp dst port 80 syn", .proto = IPPROTO_TCP, .dport_lo = 80, .dport_hi = 80,
+		.tcp_flags = 0x02, .tcp_flags_mask = 0x02 },
+	{ .name = "tcp dst port 443 syn+ack", .proto = IPPROTO_TCP, .dport_lo = 443, .dport_hi = 443,
+		.tcp_flags = 0x12, .tcp_flags_mask = 0x12 },
+	{ .name = "tcp dst port 22 syn", .proto = IPPROTO_TCP, .dport_lo = 22, .dport_hi = 22,
+		.tcp_flags = 0x02, .tcp_flags_mask = 0x02 },
+	{ .name = "tcp dst portrange 10000-20000 and not src port 53", .proto = IPPROTO_TCP,
+		.sport_lo = 0, .sport_hi = 52, .dport_lo = 10000, .dport_hi = 20000 },
+	{ .proto = IPPROTO_TCP, .sport_lo = 54, .sport_hi = 65535, .dport_lo = 10000, .dport_hi = 20000,
+		.same_as_prev = true },
+	{ .name = "udp dst port 53 and length > 100", .proto = IPPROTO_UDP, .dport_lo = 53, .dport_hi = 53,
+		.udp_len_lo = 101, .udp_len_hi = 65535 },
+	{ .name = "udp dst port 123 and ip[8] == 0x48", .proto = IPPROTO_UDP, .dport_lo = 123, .dport_hi = 123,
+		.ttl = 0x48, .ttl_mask = 0xff, .ipv4_only = true },
+	{ .name = "udp src port 67 and dst port 68 and unicast", .proto = IPPROTO_UDP,
+		.sport_lo = 67, .sport_hi = 67, .dport_lo = 68, .dport_hi = 68, .dst_mac0_mask = 0x01 },
+	{ .name = "udp dst port 5060 and udp[20:2] != 0x5349", .proto = IPPROTO_UDP,
+		.dport_lo = 5060, .dport_hi = 5060, .udp_data_lo = 0, .udp_data_hi = 0x5348,
+		.l4_min_len = sizeof(struct rte_udp_hdr) + 22 },
+	{ .proto = IPPROTO_UDP, .dport_lo = 5060, .dport_hi = 5060, .udp_data_lo = 0x534a, .udp_data_hi = 0xffff,
+		.l4_min_len = sizeof(struct rte_udp_hdr) + 22, .same_as_prev = true },
+};
 
-			*args->count += nb_rx;
-		}
-	} else {
-		while (!work_done && *args->count < opt_tx_count) {
-			struct rte_mbuf *bufs[BURST_SIZE];
-			// Аллоцирование нескольких пакетов (взятие из `rte_mempool`).
-			// Подробнее: https://doc.dpdk.org/api/rte__mbuf_8h.html#ae3d2aeb7f1189a3a6c33c861391cb16b
-			if (rte_pktmbuf_alloc_bulk(args->mbuf_pool, bufs, BURST_SIZE) < 0) {
-				printf("Error: failed to allocate mbuf\n");
-				continue;
-			}
+// Минимальная длина данных первого сегмента после IP заголовка для классификации через
+// `rte_acl`: полный заголовок TCP, как в check_filter(). Более короткие пакеты
+// проверяются check_filter(). С длины ACL_L4_FULL доступны все поля правил.
+#define ACL_L4_MIN sizeof(struct rte_tcp_hdr)
+#define ACL_L4_FULL (sizeof(struct rte_udp_hdr) + 22)
+
+// Контексты `rte_acl`, общие для всех ядер (классификация только читает контекст).
+static struct rte_acl_ctx* acl_ctx[ACL_NUM_CTX];
+// Названия правил по номеру (userdata). Номер 0 - нет совпадения,
+// номер 1 - совпадение check_filter() для пакетов, не подходящих для `rte_acl`.
+static char acl_rule_names[ACL_MAX_RULES][64];
+static uint32_t acl_num_rules = 2;
+#define ACL_RULE_SCALAR 1
+
+// Функция заполнения описания полей для заголовка IP по смещению `l3` и транспортного по `l4`.
+// Поля, не входящие в соседние 4 байта, получают отдельную группу чтения (input_index).
+// Подробнее: https://doc.dpdk.org/guides/prog_guide/packet_classif_access_ctrl.html
+static void
+acl_config_fields(struct rte_acl_config* cfg, uint32_t l3, uint32_t l4, bool ipv6) {
+	const struct rte_acl_field_def defs[ACL_NUM_FIELDS] = {
+		[ACL_FIELD_PROTO] = { RTE_ACL_FIELD_TYPE_BITMASK, 1, ACL_FIELD_PROTO, 0, l3 + (ipv6 ? 6 : 9) },
+		[ACL_FIELD_DST_MAC0] = { RTE_ACL_FIELD_TYPE_BITMASK, 1, ACL_FIELD_DST_MAC0, 1, 0 },
+		[ACL_FIELD_TTL] = { RTE_ACL_FIELD_TYPE_BITMASK, 1, ACL_FIELD_TTL, 2, l3 + (ipv6 ? 7 : 8) },
+		[ACL_FIELD_SRC_PORT] = { RTE_ACL_FIELD_TYPE_RANGE, 2, ACL_FIELD_SRC_PORT, 3, l4 },
+		[ACL_FIELD_DST_PORT] = { RTE_ACL_FIELD_TYPE_RANGE, 2, ACL_FIELD_DST_PORT, 3, l4 + 2 },
+		[ACL_FIELD_TCP_FLAGS] = { RTE_ACL_FIELD_TYPE_BITMASK, 1, ACL_FIELD_TCP_FLAGS, 4, l4 + 13 },
+		[ACL_FIELD_UDP_LEN] = { RTE_ACL_FIELD_TYPE_RANGE, 2, ACL_FIELD_UDP_LEN, 5, l4 + 4 },
+		[ACL_FIELD_UDP_DATA] = { RTE_ACL_FIELD_TYPE_RANGE, 2, ACL_FIELD_UDP_DATA, 6,
+			l4 + sizeof(struct rte_udp_hdr) + 20 },
+	};
 
-			int i = 0;
-			for (; i < BURST_SIZE; ++i) {
-				// Получение свободного места в буфере.
-				// Подробнее: https://doc.dpdk.org/api/rte__mbuf_8h.html#a257bc8af3e8fde7eb6603bdf4ae0528e
-				if (unlikely(rte_pktmbuf_tailroom(bufs[i]) < sizeof(syn_pkt))) {
-        	printf("Error: not enough tailroom in mbuf %d\n", i);
-					rte_pktmbuf_free_bulk(bufs, BURST_SIZE);
-        	break;
-				}
+	cfg->num_categories = 1;
+	cfg->num_fields = ACL_NUM_FIELDS;
+	memcpy(cfg->defs, defs, sizeof(defs));
+}
 
-				// Настройка буфера до опреленной длины и получение данных.
-				// Подробнее: https://doc.dpdk.org/api/rte__mbuf_8h.html#a603c04217c8dd3e35c45e71b15cf11f4
-				char *data = rte_pktmbuf_append(bufs[i], sizeof(syn_pkt));
-				if (unlikely(data == NULL)) {
-					rte_pktmbuf_free_bulk(bufs, BURST_SIZE);
-					printf("Error: failed to append data to mbuf %d\n", i);
-					break;
-				}
+// Функция преобразования описания в правило `rte_acl`. Значения задаются в порядке байт хоста.
+static void
+acl_make_rule(struct acl_rule* rule, const struct acl_rule_spec* spec, uint32_t id, int32_t priority) {
+	memset(rule, 0, sizeof(*rule));
+	rule->data.category_mask = 1;
+	rule->data.priority = priority;
+	rule->data.userdata = id;
+
+	rule->field[ACL_FIELD_PROTO].value.u8 = spec->proto;
+	rule->field[ACL_FIELD_PROTO].mask_range.u8 = 0xff;
+	rule->field[ACL_FIELD_DST_MAC0].mask_range.u8 = spec->dst_mac0_mask;
+	rule->field[ACL_FIELD_TTL].value.u8 = spec->ttl;
+	rule->field[ACL_FIELD_TTL].mask_range.u8 = spec->ttl_mask;
+	rule->field[ACL_FIELD_SRC_PORT].value.u16 = spec->sport_lo;
+	rule->field[ACL_FIELD_SRC_PORT].mask_range.u16 = spec->sport_hi ? spec->sport_hi : 0xffff;
+	rule->field[ACL_FIELD_DST_PORT].value.u16 = spec->dport_lo;
+	rule->field[ACL_FIELD_DST_PORT].mask_range.u16 = spec->dport_hi ? spec->dport_hi : 0xffff;
+	rule->field[ACL_FIELD_TCP_FLAGS].value.u8 = spec->tcp_flags;
+	rule->field[ACL_FIELD_TCP_FLAGS].mask_range.u8 = spec->tcp_flags_mask;
+	rule->field[ACL_FIELD_UDP_LEN].value.u16 = spec->udp_len_lo;
+	rule->field[ACL_FIELD_UDP_LEN].mask_range.u16 = spec->udp_len_hi ? spec->udp_len_hi : 0xffff;
+	rule->field[ACL_FIELD_UDP_DATA].value.u16 = spec->udp_data_lo;
+	rule->field[ACL_FIELD_UDP_DATA].mask_range.u16 = spec->udp_data_hi ? spec->udp_data_hi : 0xffff;
+}
 
-				// Аналог memcpy для копирования данных.
-				rte_memcpy(data, syn_pkt, sizeof(syn_pkt));
-			}
+// Функция разбора диапазона портов правила пользователя: "*", "<port>" или "<lo>-<hi>".
+// Возвращает false для неверного значения или диапазона.
+static bool
+acl_parse_range(const char* str, uint16_t* lo, uint16_t* hi) {
+	unsigned long l, h;
+	char* end;
+
+	if (!strcmp(str, "*")) {
+		*lo = 0;
+		*hi = UINT16_MAX;
+		return true;
+	}
+	errno = 0;
+	l = h = strtoul(str, &end, 10);
+	if (*end == '-')
+		h = strtoul(end + 1, &end, 10);
+	// Верхняя граница 0 в описании правила означает любой порт, поэтому диапазон 0-0 отклоняется.
+	if (errno || end == str || *end != '\0' || l > h || h > UINT16_MAX || h == 0)
+		return false;
+	*lo = l;
+	*hi = h;
+	return true;
+}
 
-			if (i == BURST_SIZE) {
-				// Отправка нескольких пакетов и их последующие освобожнение в `rte_mempool`.
-				// Подробнее: https://doc.dpdk.org/api/rte__ethdev_8h.html#a83e56cabbd31637efd648e3fc010392b
-				const uint16_t nb_tx = rte_eth_tx_burst(args->port, args->queue, bufs,
-						((opt_tx_count - *args->count) > BURST_SIZE ? BURST_SIZE : opt_tx_count - *args->count));
-				// Освобождение в `rte_mempool` неотправленных пакетов.
-				// Подробнее: https://doc.dpdk.org/api/rte__mbuf_8h.html#a90e7796f902bcaa856e274a30c68e47f
-				rte_pktmbuf_free_bulk(bufs, BURST_SIZE);
-				*args->count += nb_tx;
-			}
+// Функция чтения правил пользователя. Формат строки:
+//   tcp|udp <src> <dst> [<flags>/<mask>]
+// где <src> и <dst> - "*", порт или диапазон "<lo>-<hi>", флаги задаются только для TCP.
+// Строки, начинающиеся с '#', пропускаются. Ошибка в строке завершает программу.
+static int
+acl_read_rules(const char* path, struct acl_rule_spec* specs, int max) {
+	char line[256];
+	FILE* f = fopen(path, "r");
+	int n = 0;
+
+	if (f == NULL)
+		rte_exit(EXIT_FAILURE, "Error: cannot open %s: %s\n", path, strerror(errno));
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		char* tok[5] = { NULL };
+		char* save = NULL;
+		int nb_tok = 0;
+		unsigned long flags, mask;
+		char* end;
+
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] == '#' || line[0] == '\0')
+			continue;
+		if (n == max)
+			rte_exit(EXIT_FAILURE, "Error: too many rules in %s (max %d)\n", path, max);
+
+		memset(&specs[n], 0, sizeof(specs[n]));
+		specs[n].name = strdup(line);
+		for (char* t = strtok_r(line, " \t", &save); t != NULL; t = strtok_r(NULL, " \t", &save))
+			if (nb_tok < (int)RTE_DIM(tok))
+				tok[nb_tok++] = t;
+
+		if (nb_tok != 3 && nb_tok != 4)
+			rte_exit(EXIT_FAILURE, "Error: bad rule in %s: %s\n", path, specs[n].name);
+		if (!strcmp(tok[0], "tcp"))
+			specs[n].proto = IPPROTO_TCP;
+		else if (!strcmp(tok[0], "udp"))
+			specs[n].proto = IPPROTO_UDP;
+		else
+			rte_exit(EXIT_FAILURE, "Error: unknown protocol in %s: %s\n", path, specs[n].name);
+		if (!acl_parse_range(tok[1], &specs[n].sport_lo, &specs[n].sport_hi) ||
+				!acl_parse_range(tok[2], &specs[n].dport_lo, &specs[n].dport_hi))
+			rte_exit(EXIT_FAILURE, "Error: bad port range (0-65535, * for any) in %s: %s\n",
+				path, specs[n].name);
+		if (nb_tok == 4) {
+			flags = strtoul(tok[3], &end, 16);
+			mask = *end == '/' ? strtoul(end + 1, &end, 16) : ULONG_MAX;
+			if (specs[n].proto != IPPROTO_TCP || *end != '\0' || flags > 0xff || mask > 0xff)
+				rte_exit(EXIT_FAILURE, "Error: bad TCP flags in %s: %s\n", path, specs[n].name);
+			specs[n].tcp_flags = flags;
+			specs[n].tcp_flags_mask = mask;
 		}
+		n++;
 	}
-	return 0;
+
+	fclose(f);
+	return n;
 }
 
-// Обработка сигнала SIGINT.
+// Функция создания и компиляции контекстов `rte_acl` для IPv4 и IPv6 (полных и коротких пакетов).
+// Правила получают убывающий приоритет, поэтому результатом, как и в check_filter(),
+// является первое совпавшее правило.
 static void
-signal_handler(int signum) {
-	if (signum == SIGINT) {
-		printf("\n\nSignal %d received, preparing to exit...\n", signum);
-		work_done = true;
+setup_acl(int socket) {
+	struct acl_rule_spec specs[ACL_MAX_RULES];
+	struct acl_rule rules[ACL_MAX_RULES];
+	int nb_specs = 0;
+
+	memcpy(specs, filter_rules, sizeof(filter_rules));
+	nb_specs = RTE_DIM(filter_rules);
+	if (opt_acl_rules != NULL)
+		nb_specs += acl_read_rules(opt_acl_rules, &specs[nb_specs], ACL_MAX_RULES - nb_specs);
+
+	snprintf(acl_rule_names[ACL_RULE_SCALAR], sizeof(acl_rule_names[0]), "check_filter() fallback");
+
+	for (int c = 0; c < ACL_NUM_CTX; c++) {
+		static const char* names[ACL_NUM_CTX] = { "acl_ipv4", "acl_ipv6", "acl_ipv4_short", "acl_ipv6_short" };
+		bool ipv6 = c == ACL_CTX_IPV6 || c == ACL_CTX_IPV6_SHORT;
+		bool is_short = c == ACL_CTX_IPV4_SHORT || c == ACL_CTX_IPV6_SHORT;
+		uint32_t l3 = sizeof(struct rte_ether_hdr);
+		uint32_t l4 = l3 + (ipv6 ? sizeof(struct rte_ipv6_hdr) : sizeof(struct rte_ipv4_hdr));
+		struct rte_acl_param param = {
+			.name = names[c],
+			.socket_id = socket,
+			.rule_size = RTE_ACL_RULE_SZ(ACL_NUM_FIELDS),
+			.max_rule_num = ACL_MAX_RULES,
+		};
+		struct rte_acl_config cfg = {};
+		uint32_t id = ACL_RULE_SCALAR;
+		int nb_rules = 0;
+
+		// Подробнее: https://doc.dpdk.org/api/rte__acl_8h.html
+		acl_ctx[c] = rte_acl_create(&param);
+		if (acl_ctx[c] == NULL)
+			rte_exit(EXIT_FAILURE, "Error: cannot create ACL context\n");
+
+		for (int i = 0; i < nb_specs; i++) {
+			if (!specs[i].same_as_prev) {
+				id++;
+				if (c == ACL_CTX_IPV4)
+					snprintf(acl_rule_names[id], sizeof(acl_rule_names[0]), "%s", specs[i].name);
+			}
+			if ((ipv6 && specs[i].ipv4_only) || (is_short && specs[i].l4_min_len > ACL_L4_MIN))
+				continue;
+			acl_make_rule(&rules[nb_rules++], &specs[i], id, RTE_ACL_MAX_PRIORITY - i);
+		}
+		acl_num_rules = id + 1;
+
+		if (rte_acl_add_rules(acl_ctx[c], (struct rte_acl_rule*)rules, nb_rules) != 0)
+			rte_exit(EXIT_FAILURE, "Error: cannot add ACL rules\n");
+
+		// Компиляция правил в дерево переходов. Алгоритм классификации (SSE, AVX2, AVX512, NEON)
+		// выбирается по возможностям процессора.
+		acl_config_fields(&cfg, l3, l4, ipv6);
+		if (rte_acl_build(acl_ctx[c], &cfg) != 0)
+			rte_exit(EXIT_FAILURE, "Error: cannot build ACL context\n");
 	}
-}
 
-static struct option long_options[] = {
-	{"rxonly", no_argument, 0, 'r'},
-	{"txonly", no_argument, 0, 't'},
-	{"port", required_argument, 0, 'p'},
-	{"queue_count", required_argument, 0, 'q'},
-	{"tx-pkt-count", required_argument, 0, 'C'},
-	{"help", no_argument, 0, 'h'},
-	{0, 0, 0, 0}
-};
+	printf("ACL: %u rules compiled\n", acl_num_rules - 2);
+}
 
+// Функция классификации блока пакетов. В `results` записывается номер совпавшего правила или 0.
+// Пакеты IPv4 без опций и IPv6 классифицируются через `rte_acl` одним вызовом на контекст,
+// остальные (опции IPv4, пакеты короче заголовка TCP) - через check_filter().
 static void
-usage(const char* prog) {
-	const char* str =
-		"  Usage: %s [OPTIONS]\n"
-		"  Options:\n"
-		"  -r, --rxonly		Print all incoming packets (default).\n"
-		"  -t, --txonly		Only send packets.\n"
-		"  -p, --port=<INDEX>	Run on port.\n"
-		"  -q, --queues=n	Use n queues (default 1).\n"
-		"  -C, --tx-pkt-count=n	Number of packets to send.\n"
-		"			Default: Continuous packets.\n"
-		"  -h, --help	Print this help.\n"
-		"\n";
-	fprintf(stderr, str, prog);
+classify_burst(struct rte_mbuf** bufs, uint16_t nb, uint32_t* results) {
+	const uint8_t* data[ACL_NUM_CTX][BURST_SIZE];
+	uint16_t idx[ACL_NUM_CTX][BURST_SIZE];
+	uint32_t res[BURST_SIZE];
+	uint16_t n[ACL_NUM_CTX] = { 0 };
+
+	for (uint16_t i = 0; i < nb; i++) {
+		const uint8_t* pkt = rte_pktmbuf_mtod(bufs[i], const uint8_t*);
+		const struct rte_ether_hdr* eth = (const struct rte_ether_hdr*)pkt;
+		uint16_t len = rte_pktmbuf_data_len(bufs[i]);
+		int c = -1;
+
+		results[i] = 0;
+		if (opt_classify == CLASSIFY_SCALAR) {
+			results[i] = check_filter(pkt, len) ? ACL_RULE_SCALAR : 0;
+			continue;
+		}
 
-	exit(EXIT_FAILURE);
+		uint16_t l4 = 0;
+
+		if (len >= sizeof(*eth) + sizeof(struct rte_ipv4_hdr) + ACL_L4_MIN &&
+				eth->ether_type == rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4) &&
+				rte_ipv4_hdr_len((const struct rte_ipv4_hdr*)(eth + 1)) == sizeof(struct rte_ipv4_hdr)) {
+			c = ACL_CTX_IPV4;
+			l4 = sizeof(*eth) + sizeof(struct rte_ipv4_hdr);
+		} else if (len >= sizeof(*eth) + sizeof(struct rte_ipv6_hdr) + ACL_L4_MIN &&
+				eth->ether_type == rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV6)) {
+			c = ACL_CTX_IPV6;
+			l4 = sizeof(*eth) + sizeof(struct rte_ipv6_hdr);
+		}
+		if (c >= 0 && len < l4 + ACL_L4_FULL)
+			c += ACL_CTX_IPV4_SHORT;
+
+		if (c < 0) {
+			results[i] = check_filter(pkt, len) ? ACL_RULE_SCALAR : 0;
+			continue;
+		}
+		data[c][n[c]] = pkt;
+		idx[c][n[c]++] = i;
+	}
+
+	for (int c = 0; c < ACL_NUM_CTX; c++) {
+		if (n[c] == 0)
+			continue;
+		// Подробнее: https://doc.dpdk.org/api/rte__acl_8h.html
+		rte_acl_classify(acl_ctx[c], data[c], res, n[c], 1);
+		for (uint16_t j = 0; j < n[c]; j++)
+			results[idx[c][j]] = res[j];
+	}
 }
 
-// Функция парсинга аргументов командной строки.
+// Функция построения тестового пакета для acl_self_check(). `l4_len` - захваченная длина
+// после IP заголовка, `trailer` - байты в конце кадра за пределами длины из заголовка IP
+// (заполнение кадра Ethernet). Для UDP бит 0 `variant` задаёт групповой MAC адрес
+// назначения, бит 1 - значение udp[20:2] == 0x5349; для TCP `variant` - флаги.
 static void
-parse_command_line(int argc, char** argv) {
-	int option_index, c;
-	opterr = 0;
+acl_check_packet(struct rte_mbuf* m, bool ipv6, uint8_t proto, uint16_t sport, uint16_t dport,
+		uint8_t variant, uint8_t ttl, uint16_t l4_len, uint16_t trailer) {
+	uint16_t l4 = sizeof(struct rte_ether_hdr) + (ipv6 ? sizeof(struct rte_ipv6_hdr) : sizeof(struct rte_ipv4_hdr));
+	uint16_t ip_l4_len = l4_len > trailer ? l4_len - trailer : 0;
+	uint8_t* pkt = (uint8_t*)rte_pktmbuf_append(m, l4 + l4_len);
+	struct rte_ether_hdr* eth = (struct rte_ether_hdr*)pkt;
+
+	memset(pkt, 0, l4 + l4_len);
+	eth->dst_addr.addr_bytes[0] = proto == IPPROTO_UDP && (variant & 1) ? 0x01 : 0x00;
+	if (ipv6) {
+		struct rte_ipv6_hdr* ip = (struct rte_ipv6_hdr*)(eth + 1);
+
+		eth->ether_type = rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV6);
+		ip->vtc_flow = rte_cpu_to_be_32(6 << 28);
+		ip->payload_len = rte_cpu_to_be_16(ip_l4_len);
+		ip->proto = proto;
+		ip->hop_limits = ttl;
+	} else {
+		struct rte_ipv4_hdr* ip = (struct rte_ipv4_hdr*)(eth + 1);
 
-	for (;;) {
-		c = getopt_long(argc, argv, "rtp:q:C:h", long_options, &option_index);
-		if (c == -1)
-			break;
+		eth->ether_type = rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4);
+		ip->version_ihl = RTE_IPV4_VHL_DEF;
+		ip->total_length = rte_cpu_to_be_16(sizeof(*ip) + ip_l4_len);
+		ip->next_proto_id = proto;
+		ip->time_to_live = ttl;
+	}
 
-		switch (c) {
-		case 'r':
-			opt_mode = 0;
-			break;
-		case 't':
-			opt_mode = 1;
-			break;
-		case 'p':
-			opt_port_id = (uint16_t)atoi(optarg);
-			break;
-		case 'q':
-			opt_queue_count = (uint16_t)atoi(optarg);
-			break;
-		case 'C':
-			opt_tx_count = (uint64_t)atoll(optarg);
-			break;
-		default:
-			usage(argv[0]);
+	*(uint16_t*)(pkt + l4) = rte_cpu_to_be_16(sport);
+	*(uint16_t*)(pkt + l4 + 2) = rte_cpu_to_be_16(dport);
+	if (proto == IPPROTO_TCP && l4_len > 13)
+		pkt[l4 + 13] = variant;
+	if (proto == IPPROTO_UDP) {
+		*(uint16_t*)(pkt + l4 + 4) = rte_cpu_to_be_16(ip_l4_len);
+		if (l4_len >= ACL_L4_FULL)
+			*(uint16_t*)(pkt + l4 + sizeof(struct rte_udp_hdr) + 20) =
+				rte_cpu_to_be_16(variant & 2 ? 0x5349 : 0x1234);
+	}
+}
+
+// Функция проверки совпадения результатов `rte_acl` с check_filter() на наборе пакетов,
+// перебирающем значения полей правил у границ, захваченную длину и версию IP.
+// Совпадение только с правилами пользователя (-a) не считается совпадением фильтра.
+// Расхождение завершает программу.
+static void
+acl_self_check(void) {
+	static const uint16_t dports[] = { 22, 53, 68, 80, 123, 443, 1900, 5060, 9999, 10000, 20000, 20001 };
+	static const uint16_t sports[] = { 52, 53, 67 };
+	static const uint8_t tcp_flags[] = { 0x00, 0x02, 0x10, 0x12 };
+	static const uint16_t l4_lens[] = { 8, 14, 19, 20, 26, 29, 30, 200 };
+	static const uint8_t ttls[] = { 0x40, 0x48 };
+	static const uint16_t trailers[] = { 0, 10 };
+	const uint32_t total = 2 * 2 * RTE_DIM(dports) * RTE_DIM(sports) * RTE_DIM(tcp_flags) *
+		RTE_DIM(l4_lens) * RTE_DIM(ttls) * RTE_DIM(trailers);
+	struct rte_mbuf* bufs[BURST_SIZE];
+	uint32_t results[BURST_SIZE];
+	uint32_t filter_ids = ACL_RULE_SCALAR + 1;
+	uint32_t mismatches = 0;
+	uint16_t nb = 0;
+	struct rte_mempool* mp;
+
+	// Номера правил check_filter() предшествуют номерам правил пользователя.
+	for (size_t i = 0; i < RTE_DIM(filter_rules); i++)
+		if (!filter_rules[i].same_as_prev)
+			filter_ids++;
+
+	mp = rte_pktmbuf_pool_create("ACL_CHECK", 2 * BURST_SIZE - 1, 0, 0, RTE_MBUF_DEFAULT_BUF_SIZE,
+		rte_socket_id());
+	if (mp == NULL)
+		rte_exit(EXIT_FAILURE, "Error: cannot create ACL check pool: %s\n", rte_strerror(rte_errno));
+
+	for (uint32_t n = 0; n <= total; n++) {
+		if (nb == BURST_SIZE || (n == total && nb > 0)) {
+			classify_burst(bufs, nb, results);
+			for (uint16_t i = 0; i < nb; i++) {
+				bool acl = results[i] != 0 && results[i] < filter_ids;
+				bool ref = check_filter(rte_pktmbuf_mtod(bufs[i], const uint8_t*),
+					rte_pktmbuf_data_len(bufs[i]));
+
+				if (acl != ref && mismatches++ < 8) {
+					printf("ACL check: rte_acl %s (rule %u), check_filter() %s\n",
+						acl ? "match" : "no match", results[i], ref ? "match" : "no match");
+					hex_dump(bufs[i], 0);
+				}
+			}
+			rte_pktmbuf_free_bulk(bufs, nb);
+			nb = 0;
 		}
+		if (n == total)
+			break;
+
+		uint32_t k = n;
+		bool ipv6 = k % 2;
+		uint8_t proto = (k /= 2) % 2 ? IPPROTO_UDP : IPPROTO_TCP;
+		uint16_t dport = dports[(k /= 2) % RTE_DIM(dports)];
+		uint16_t sport = sports[(k /= RTE_DIM(dports)) % RTE_DIM(sports)];
+		uint8_t variant = tcp_flags[(k /= RTE_DIM(sports)) % RTE_DIM(tcp_flags)];
+		uint16_t l4_len = l4_lens[(k /= RTE_DIM(tcp_flags)) % RTE_DIM(l4_lens)];
+		uint8_t ttl = ttls[(k /= RTE_DIM(l4_lens)) % RTE_DIM(ttls)];
+		uint16_t trailer = trailers[(k /= RTE_DIM(ttls)) % RTE_DIM(trailers)];
+
+		bufs[nb] = rte_pktmbuf_alloc(mp);
+		if (bufs[nb] == NULL)
+			rte_exit(EXIT_FAILURE, "Error: cannot allocate ACL check mbuf\n");
+		acl_check_packet(bufs[nb++], ipv6, proto, sport, dport, variant, ttl, l4_len, trailer);
 	}
+	rte_mempool_free(mp);
+
+	if (mismatches)
+		rte_exit(EXIT_FAILURE, "Error: rte_acl and check_filter() disagree on %u of %u packets\n",
+			mismatches, total);
+	printf("ACL: %u test packets classified as by check_filter()\n", total);
 }
 
-int
-main(int argc, char *argv[]) {
-	struct rte_mempool *mbuf_pool;
-	unsigned nb_ports;
+// Ключ потока IPv4: адреса, порты (0 для протоколов без портов и фрагментов) и протокол.
+struct flow_key {
+	uint32_t src_addr;
+	uint32_t dst_addr;
+	uint16_t src_port;
+	uint16_t dst_port;
+	uint8_t proto;
+	uint8_t pad[3];
+};
 
-	pthread_mutex_init(&mutex, NULL);
+// Запись потока занимает одну строку кэша: обновление счётчиков потока
+// при приёме пакета обращается к одной строке.
+struct flow_record {
+	struct flow_key key;
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t first_tsc;  // Время первого и последнего пакета в тиках процессора.
+	uint64_t last_tsc;
+	hash_sig_t sig;      // Сигнатура ключа для удаления из `rte_hash`.
+	uint8_t tcp_flags;   // Объединение флагов TCP всех пакетов потока.
+	uint8_t in_use;
+} __rte_cache_aligned;
+
+// Таблица потоков ядра приёма. Записи хранятся в массиве по позиции ключа в `rte_hash`.
+// Таблица используется только своим ядром и не требует синхронизации.
+struct flow_table {
+	struct rte_hash* hash;
+	struct flow_record* records;
+	uint32_t size;
+	uint32_t expire_pos;   // Позиция следующей проверки истечения.
+	uint64_t timeout_tsc;
+	uint64_t created;
+	uint64_t expired;
+	uint64_t table_full;   // Пакеты новых потоков, не поместившихся в таблицу.
+	uint64_t untracked;    // Пакеты не IPv4.
+	uint64_t export_drops; // Истёкшие потоки, не поместившиеся в кольцо выгрузки.
+};
 
-	// Инициализация подсистемы EAL (Environment Abstraction Layer).
-	// Подробнее: https://doc.dpdk.org/api/rte__eal_8h.html#a5c3f4dddc25e38c5a186ecd8a69260e3
-	int ret = rte_eal_init(argc, argv);
-	if (ret < 0)
-		rte_exit(EXIT_FAILURE, "Error: EAL initialization failed\n");
+// Функция создания таблицы потоков на NUMA узле ядра приёма.
+// Подробнее: https://doc.dpdk.org/guides/prog_guide/hash_lib.html
+static struct flow_table*
+flow_table_create(uint16_t queue, unsigned socket) {
+	char name[RTE_HASH_NAMESIZE];
+	struct rte_hash_parameters params = {
+		.name = name,
+		.entries = opt_flows,
+		.key_len = sizeof(struct flow_key),
+		.hash_func = rte_hash_crc,
+		.socket_id = socket,
+	};
+	struct flow_table* ft = rte_zmalloc_socket("flow_table", sizeof(*ft), RTE_CACHE_LINE_SIZE, socket);
+
+	snprintf(name, sizeof(name), "FLOWS_%u", queue);
+	if (ft == NULL)
+		return NULL;
+	ft->hash = rte_hash_create(&params);
+	ft->records = rte_zmalloc_socket("flow_records", opt_flows * sizeof(struct flow_record),
+		RTE_CACHE_LINE_SIZE, socket);
+	if (ft->hash == NULL || ft->records == NULL)
+		return NULL;
+	ft->size = opt_flows;
+	ft->timeout_tsc = opt_flow_timeout * tsc_hz;
+	return ft;
+}
 
-	// Обработка параметров.
-	argc -= ret;
-	argv += ret;
+// Функция получения ключа потока и флагов TCP пакета. Возвращает false для пакетов не IPv4.
+static inline bool
+flow_key_get(struct rte_mbuf* m, struct flow_key* key, uint8_t* tcp_flags) {
+	const struct rte_ether_hdr* eth = rte_pktmbuf_mtod(m, struct rte_ether_hdr*);
+	const struct rte_ipv4_hdr* ip = (const struct rte_ipv4_hdr*)(eth + 1);
+	uint16_t len = rte_pktmbuf_data_len(m);
+	uint16_t l4;
+
+	if (len < sizeof(*eth) + sizeof(*ip) || eth->ether_type != rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4))
+		return false;
+
+	memset(key, 0, sizeof(*key));
+	key->src_addr = ip->src_addr;
+	key->dst_addr = ip->dst_addr;
+	key->proto = ip->next_proto_id;
+	*tcp_flags = 0;
+
+	// Порты есть только в первом фрагменте, поэтому все фрагменты учитываются без портов.
+	l4 = sizeof(*eth) + rte_ipv4_hdr_len(ip);
+	if ((ip->fragment_offset & rte_cpu_to_be_16(RTE_IPV4_HDR_OFFSET_MASK | RTE_IPV4_HDR_MF_FLAG)) ||
+			(key->proto != IPPROTO_TCP && key->proto != IPPROTO_UDP) || len < l4 + 4)
+		return true;
+
+	key->src_port = *rte_pktmbuf_mtod_offset(m, uint16_t*, l4);
+	key->dst_port = *rte_pktmbuf_mtod_offset(m, uint16_t*, l4 + 2);
+	if (key->proto == IPPROTO_TCP && len >= l4 + 14)
+		*tcp_flags = *rte_pktmbuf_mtod_offset(m, uint8_t*, l4 + 13);
+	return true;
+}
 
-	parse_command_line(argc, argv);
+// Функция проверки истечения не более FLOW_EXPIRE_BATCH записей, начиная с позиции
+// предыдущей проверки. Работа на блок пакетов ограничена, полный обход таблицы занимает
+// size / FLOW_EXPIRE_BATCH блоков. Истёкшие потоки передаются главному ядру одной операцией.
+static void
+flow_expire(struct flow_table* ft, uint64_t now) {
+	struct flow_record expired[FLOW_EXPIRE_BATCH];
+	unsigned nb = 0;
 
-	signal(SIGINT, signal_handler);
+	for (unsigned i = 0; i < FLOW_EXPIRE_BATCH; i++) {
+		struct flow_record* r = &ft->records[ft->expire_pos];
 
-	tsc_hz = rte_get_tsc_hz();
-	tsc_start = get_current_tsc();
+		if (++ft->expire_pos == ft->size)
+			ft->expire_pos = 0;
+		if (!r->in_use || now - r->last_tsc < ft->timeout_tsc)
+			continue;
 
-	// Получение количества доступных сетевых интерфейсов.
-	// Подробнее: https://doc.dpdk.org/api/rte__ethdev_8h.html#a9ab708089665bebcd65cefe5383b24f2
-	nb_ports = rte_eth_dev_count_avail();
-	if (opt_port_id >= nb_ports)
-		rte_exit(EXIT_FAILURE, "Error: unknown network port\n");
+		rte_hash_del_key_with_hash(ft->hash, &r->key, r->sig);
+		r->in_use = 0;
+		expired[nb++] = *r;
+	}
 
-	// Создание именованного кольца памяти.
-	// Подробнее: https://doc.dpdk.org/api/rte__mbuf_8h.html#a8f4abb0d54753d2fde515f35c1ba402a
-	mbuf_pool = rte_pktmbuf_pool_create("MBUF_POOL", NUM_MBUFS,
-		MBUF_CACHE_SIZE, 0, RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
+	if (nb == 0)
+		return;
+	ft->expired += nb;
+	if (flow_export_ring != NULL)
+		// Подробнее: https://doc.dpdk.org/api/rte__ring__elem_8h.html
+		ft->export_drops += nb - rte_ring_enqueue_burst_elem(flow_export_ring, expired,
+			sizeof(expired[0]), nb, NULL);
+}
 
-	if (mbuf_pool == NULL)
-		rte_exit(EXIT_FAILURE, "Error: cannot create mbuf pool\n");
+// Функция получения сигнатуры ключа потока для `rte_hash`.
+// Хэш RSS нельзя использовать как сигнатуру напрямую: с симметричным ключом (повторяющиеся
+// 0x6d5a) его старшие и младшие 16 бит совпадают, и альтернативная корзина
+// `(sig & mask) ^ (sig >> 16)` у всех ключей равна 0, а младшие биты, выбирающие очередь
+// через RETA, у потоков одной очереди одинаковы. Поэтому хэш перемешивается CRC32.
+static inline hash_sig_t
+flow_rss_sig(uint32_t rss) {
+	return rte_hash_crc_4byte(rss, FLOW_SIG_SEED);
+}
 
-	// Инициализация сетевого интерфейса.
-	if (port_init(opt_port_id, mbuf_pool) != 0)
-		rte_exit(EXIT_FAILURE, "Error: сannot init port %"PRIu16 "\n", opt_port_id);
+// Функция учёта блока пакетов в таблице потоков.
+// Сигнатура ключа - хэш RSS, вычисленный сетевой картой (хэш CRC ключа без него).
+// Поиск выполняется одним вызовом для всего блока; записи найденных потоков
+// загружаются в кэш до обновления счётчиков.
+static void
+flow_burst(struct flow_table* ft, struct rte_mbuf** bufs, uint16_t nb, uint64_t now) {
+	struct flow_key keys[BURST_SIZE];
+	const void* key_ptrs[BURST_SIZE];
+	hash_sig_t sigs[BURST_SIZE];
+	int32_t positions[BURST_SIZE];
+	uint8_t flags[BURST_SIZE];
+	uint16_t idx[BURST_SIZE];
+	uint16_t n = 0;
+
+	for (uint16_t i = 0; i < nb; i++)
+		rte_prefetch0(rte_pktmbuf_mtod(bufs[i], void*));
+
+	for (uint16_t i = 0; i < nb; i++) {
+		if (!flow_key_get(bufs[i], &keys[n], &flags[n])) {
+			ft->untracked++;
+			continue;
+		}
+		key_ptrs[n] = &keys[n];
+		sigs[n] = bufs[i]->ol_flags & RTE_MBUF_F_RX_RSS_HASH ? flow_rss_sig(bufs[i]->hash.rss) :
+			rte_hash_crc(&keys[n], sizeof(keys[n]), 0);
+		idx[n++] = i;
+	}
 
-	unsigned int lcore_id;
-	int queue_id = 0;
-	struct thread_args* args = calloc(opt_queue_count, sizeof(struct thread_args));
-	uint64_t* counts = calloc(opt_queue_count, sizeof(uint64_t));
+	// Подробнее: https://doc.dpdk.org/api/rte__hash_8h.html
+	if (n)
+		rte_hash_lookup_with_hash_bulk(ft->hash, key_ptrs, sigs, n, positions);
+	for (uint16_t j = 0; j < n; j++)
+		if (positions[j] >= 0)
+			rte_prefetch0(&ft->records[positions[j]]);
+
+	for (uint16_t j = 0; j < n; j++) {
+		struct flow_record* r;
+		int32_t pos = positions[j];
+
+		// Новый поток. Повторное добавление ключа, уже добавленного пакетом
+		// этого же блока, возвращает его позицию.
+		if (pos < 0) {
+			pos = rte_hash_add_key_with_hash(ft->hash, &keys[j], sigs[j]);
+			if (pos < 0 || (uint32_t)pos >= ft->size) {
+				ft->table_full++;
+				continue;
+			}
+		}
 
-	// Цикл по доступным «дополнительным» ядрам.
-	// Функция main исполняется на отдельном ядре.
-	RTE_LCORE_FOREACH_WORKER(lcore_id) {
-		if (queue_id >= opt_queue_count) break;
+		r = &ft->records[pos];
+		if (!r->in_use) {
+			memset(r, 0, sizeof(*r));
+			r->key = keys[j];
+			r->sig = sigs[j];
+			r->first_tsc = now;
+			r->in_use = 1;
+			ft->created++;
+		}
+		r->packets++;
+		r->bytes += rte_pktmbuf_pkt_len(bufs[idx[j]]);
+		r->last_tsc = now;
+		r->tcp_flags |= flags[j];
+	}
 
-		args[queue_id].mbuf_pool = mbuf_pool;
-		args[queue_id].port = opt_port_id;
-		args[queue_id].queue = queue_id;
-		args[queue_id].mode = opt_mode;
-		args[queue_id].count = &counts[queue_id];
-		counts[queue_id] = 0;
+	flow_expire(ft, now);
+}
 
-		// Запуск отдельного потока исполнения на ядре `lcore_id`.
-		// Подробнее: https://doc.dpdk.org/api/rte__launch_8h.html#a2bf98eda211728b3dc69aa7694758c6d
-		rte_eal_remote_launch((lcore_function_t *)lcore_main, &args[queue_id], lcore_id);
+// Функция записи потока в файл выгрузки (CSV). Время отсчитывается от запуска программы.
+static void
+flow_export_write(const struct flow_record* r, const char* reason) {
+	uint32_t src = rte_be_to_cpu_32(r->key.src_addr);
+	uint32_t dst = rte_be_to_cpu_32(r->key.dst_addr);
+
+	fprintf(flow_export_file, "%u.%u.%u.%u,%u.%u.%u.%u,%u,%u,%u,%llu,%llu,%.3f,%.3f,0x%02x,%s\n",
+		src >> 24, (src >> 16) & 0xff, (src >> 8) & 0xff, src & 0xff,
+		dst >> 24, (dst >> 16) & 0xff, (dst >> 8) & 0xff, dst & 0xff,
+		rte_be_to_cpu_16(r->key.src_port), rte_be_to_cpu_16(r->key.dst_port), r->key.proto,
+		r->packets, r->bytes, (double)(r->first_tsc - tsc_start) / tsc_hz,
+		(double)(r->last_tsc - tsc_start) / tsc_hz, r->tcp_flags, reason);
+}
 
-		queue_id++;
+// Функция выгрузки истёкших потоков из кольца. Вызывается на главном ядре.
+static void
+flow_export_drain(void) {
+	struct flow_record records[FLOW_EXPIRE_BATCH];
+	unsigned nb;
+
+	if (flow_export_ring == NULL)
+		return;
+	while ((nb = rte_ring_dequeue_burst_elem(flow_export_ring, records, sizeof(records[0]),
+			FLOW_EXPIRE_BATCH, NULL)) > 0)
+		for (unsigned i = 0; i < nb; i++)
+			flow_export_write(&records[i], "expired");
+}
+
+// Структура данных для потока захвата/отправки пакетов.
+struct thread_args {
+	struct rte_mempool* mbuf_pool;
+	unsigned lcore_id;
+	uint16_t port;
+	uint16_t queue;
+	enum mode_type mode;
+	uint64_t* count;
+	// Кольца конвейера: у ядра приёма - по одному на каждое ядро обработки,
+	// у ядра обработки - по одному от каждого ядра приёма.
+	struct rte_ring** rings;
+	uint16_t nb_rings;
+	enum lcore_role role;
+	uint64_t ring_drops;  // Пакеты, не поместившиеся в кольцо.
+	uint64_t fill_sum;    // Сумма и максимум заполненности колец после передачи блока.
+	uint64_t fill_max;
+	uint64_t fill_samples;
+	uint64_t lat_sum;     // Сумма и максимум задержки от приёма до этапа в тиках процессора.
+	uint64_t lat_max;
+	uint64_t reorders;    // Пакеты потока, пришедшие на завершающий этап не по порядку.
+	uint64_t classify_tsc; // Время классификации в тиках процессора.
+	uint64_t* rule_hits;   // Количество совпадений по номерам правил.
+	uint64_t alloc_fail;  // Количество неудачных выделений mbuf.
+	uint64_t tx_partial;  // Количество вызовов отправки, принявших не все пакеты.
+	uint64_t start_tsc;   // Время начала и окончания работы потока в тиках процессора.
+	uint64_t end_tsc;
+	struct rte_mempool* pcap_pool; // Пул копий пакетов для записи в файл.
+	uint64_t pcap_drops;  // Пакеты, не записанные из-за заполненного кольца или пула копий.
+	uint64_t pcap_bytes;  // Количество записанных в файлы байт.
+	uint64_t pcap_errors; // Количество ошибок записи.
+	uint32_t pcap_files;  // Количество созданных файлов.
+	uint64_t* reta_hits;  // Количество пакетов по записям RETA (при перераспределении RSS).
+	struct flow_table* flows; // Таблица потоков ядра приёма.
+	uint16_t tx_port;     // Порт отправки при пересылке.
+	struct rte_eth_dev_tx_buffer* tx_buffer; // Буфер отправки при пересылке.
+	uint64_t tx_dropped;  // Пакеты, не принятые заполненным кольцом TX порта отправки.
+	enum idle_type idle;  // Поведение ядра при отсутствии пакетов.
+	unsigned idle_polls;  // Количество пустых опросов подряд.
+	unsigned sleep_us;    // Текущая длительность сна.
+	uint64_t idle_tsc;    // Время между пустыми опросами (включая ожидание).
+	uint64_t idle_exit_tsc; // Время окончания предыдущего пустого опроса.
+	uint64_t wait_tsc;    // Время сна или ожидания прерывания.
+	uint64_t last_wait_tsc; // Длительность последнего ожидания.
+	uint64_t wakeups;     // Количество выходов из ожидания с поступлением пакетов.
+	uint64_t wake_sum_tsc;  // Длительность ожиданий, завершившихся поступлением пакетов.
+	uint64_t wake_max_tsc;
+	uint64_t cpu_ns;      // Процессорное время потока.
+	struct rte_gro_param gro_param; // Параметры GRO ядра приёма.
+	uint64_t gro_in;      // Пакеты до и после объединения GRO.
+	uint64_t gro_out;
+	uint64_t gro_tsc;     // Время разбора заголовков и объединения.
+	uint64_t proc_tsc[2]; // Время обработки пакетов без GRO и с GRO (включая gro_tsc).
+	uint64_t proc_pkts[2]; // Принятые пакеты без GRO и с GRO.
+	uint64_t flow_tsc;    // Время учёта потоков в тиках процессора.
+	uint64_t bytes;       // Байты и сегменты принятых или отправленных пакетов.
+	uint64_t segs;
+	uint32_t tx_seq;      // Следующий номер пакета потока измерения задержки.
+	struct latency_stats* lat; // Статистика задержки ядра приёма.
+};
+
+// Функция добавления к пакету сегментов до длины opt_tx_size.
+// Сегменты берутся из того же пула, их данные не изменяются, поэтому шаблон
+// fill_tx_template сохраняется, когда mbuf позже выделяется первым сегментом.
+// Подробнее: https://doc.dpdk.org/api/rte__mbuf_8h.html
+static inline int
+tx_chain_segments(struct rte_mempool* mp, struct rte_mbuf* head) {
+	struct rte_mbuf* segs[TX_MAX_SEGS];
+	struct rte_mbuf* last = head;
+	uint32_t left = opt_tx_size - head->data_len;
+	const uint16_t data_room = rte_pktmbuf_data_room_size(mp) - RTE_PKTMBUF_HEADROOM;
+
+	if (rte_pktmbuf_alloc_bulk(mp, segs, tx_segs - 1) != 0)
+		return -1;
+	for (uint16_t i = 0; i < tx_segs - 1; i++) {
+		segs[i]->data_len = RTE_MIN(left, data_room);
+		left -= segs[i]->data_len;
+		last->next = segs[i];
+		last = segs[i];
 	}
+	head->nb_segs = tx_segs;
+	head->pkt_len = opt_tx_size;
+	return 0;
+}
 
-	printf("Started %d threads\n", queue_id);
+// Функция учёта принятых пакетов по записям RETA для перераспределения RSS.
+// Запись таблицы определяется младшими битами хэша RSS.
+static inline void
+reta_account(struct thread_args* args, struct rte_mbuf** bufs, uint16_t nb) {
+	if (args->reta_hits == NULL)
+		return;
+	for (uint16_t i = 0; i < nb; i++)
+		if (bufs[i]->ol_flags & RTE_MBUF_F_RX_RSS_HASH)
+			args->reta_hits[bufs[i]->hash.rss % reta_size]++;
+}
 
-	RTE_LCORE_FOREACH_WORKER(lcore_id) {
-		if (lcore_id < queue_id)
-			// Ожидание завершения потоков на «дополнительных» ядрах.
-			// Подробнее: https://doc.dpdk.org/api/rte__launch_8h.html#ae9500e1d35bd4cfb95d18c0be863cb1e
-			rte_eal_wait_lcore(lcore_id);
+// Функция ожидания прерывания очереди RX. Прерывание включается только на время
+// ожидания, при поступлении пакетов очередь снова опрашивается без прерываний.
+// Подробнее: https://doc.dpdk.org/guides/sample_app_ug/l3_forward_power_man.html
+static void
+idle_wait_interrupt(struct thread_args* args) {
+	struct rte_epoll_event event;
+
+	// Подробнее: https://doc.dpdk.org/api/rte__ethdev_8h.html
+	if (rte_eth_dev_rx_intr_enable(args->port, args->queue) != 0) {
+		rte_delay_us_sleep(IDLE_SLEEP_MAX_US);
+		return;
 	}
+	rte_epoll_wait(RTE_EPOLL_PER_THREAD, &event, 1, IDLE_INTR_TIMEOUT_MS);
+	rte_eth_dev_rx_intr_disable(args->port, args->queue);
+}
 
-	// Очистка подсистемы EAL.
-	// Подробнее: https://doc.dpdk.org/api/rte__eal_8h.html#a7a745887f62a82dc83f1524e2ff2a236
-	rte_eal_cleanup();
+// Функция ожидания при пустом опросе очереди RX.
+// Первые IDLE_SPIN_POLLS пустых опросов выполняются без ожидания, чтобы пакеты
+// короткой паузы в трафике не ждали пробуждения ядра. Учитывается время между пустыми
+// опросами: в режимах `rte_power` ожидание выполняется внутри rte_eth_rx_burst().
+static inline void
+idle_wait(struct thread_args* args) {
+	uint64_t start = get_current_tsc();
 
-	uint64_t all_count = 0;
-	for (int i = 0; i < opt_queue_count; ++i) {
-		all_count += counts[i];
-		printf("Thread %d: %llu\n", i, counts[i]);
+	if (args->idle_polls++ > 0)
+		args->idle_tsc += start - args->idle_exit_tsc;
+
+	if (args->idle_polls < IDLE_SPIN_POLLS || args->idle < IDLE_INTERRUPT) {
+		rte_pause();
+	} else {
+		if (args->idle == IDLE_SLEEP) {
+			// Подробнее: https://doc.dpdk.org/api/rte__cycles_8h.html
+			rte_delay_us_sleep(args->sleep_us);
+			args->sleep_us = RTE_MIN(args->sleep_us * 2, IDLE_SLEEP_MAX_US);
+		} else {
+			idle_wait_interrupt(args);
+		}
+		args->last_wait_tsc = get_current_tsc() - start;
+		args->wait_tsc += args->last_wait_tsc;
+	}
+	args->idle_exit_tsc = get_current_tsc();
+}
+
+// Функция выхода из ожидания при получении пакетов. Длительность последнего ожидания -
+// верхняя граница задержки, добавленной пакетам, пришедшим во время ожидания.
+static inline void
+idle_wake(struct thread_args* args) {
+	if (args->last_wait_tsc) {
+		args->wakeups++;
+		args->wake_sum_tsc += args->last_wait_tsc;
+		args->wake_max_tsc = RTE_MAX(args->wake_max_tsc, args->last_wait_tsc);
+		args->last_wait_tsc = 0;
+	}
+	args->idle_polls = 0;
+	args->sleep_us = IDLE_SLEEP_MIN_US;
+}
+
+// Функция заполнения mbuf шаблоном UDP пакета измерения задержки.
+// Номер потока передаётся в `opaque` и задаёт порт источника, поэтому потоки
+// разных ядер отправки распределяются RSS по разным очередям приёма.
+static void
+fill_latency_template(struct rte_mempool* mp, void* opaque, void* obj, unsigned obj_idx) {
+	uint16_t flow = *(uint16_t*)opaque;
+	struct rte_mbuf* m = obj;
+	struct rte_ether_hdr* eth;
+	struct rte_ipv4_hdr* ip;
+	struct rte_udp_hdr* udp;
+	struct latency_payload* payload;
+
+	rte_pktmbuf_reset(m);
+	eth = rte_pktmbuf_mtod(m, struct rte_ether_hdr*);
+	ip = (struct rte_ipv4_hdr*)(eth + 1);
+	udp = (struct rte_udp_hdr*)(ip + 1);
+	payload = (struct latency_payload*)(udp + 1);
+
+	// MAC и IP адреса берутся из шаблона syn_pkt.
+	memcpy(eth, syn_pkt, sizeof(*eth));
+	memcpy(ip, syn_pkt + sizeof(*eth), sizeof(*ip));
+	ip->next_proto_id = IPPROTO_UDP;
+	ip->total_length = rte_cpu_to_be_16(LATENCY_PKT_LEN - sizeof(*eth));
+	ip->hdr_checksum = 0;
+	ip->hdr_checksum = rte_ipv4_cksum(ip);
+
+	udp->src_port = rte_cpu_to_be_16(10000 + flow);
+	udp->dst_port = rte_cpu_to_be_16(LATENCY_UDP_PORT);
+	udp->dgram_len = rte_cpu_to_be_16(sizeof(*udp) + sizeof(*payload));
+	udp->dgram_cksum = 0;
+
+	payload->magic = LATENCY_MAGIC;
+	payload->flow = flow;
+}
+
+// Функция получения данных измерения задержки из пакета или NULL для других пакетов.
+static inline struct latency_payload*
+latency_payload_get(struct rte_mbuf* m) {
+	struct rte_ether_hdr* eth = rte_pktmbuf_mtod(m, struct rte_ether_hdr*);
+	struct rte_ipv4_hdr* ip = (struct rte_ipv4_hdr*)(eth + 1);
+	struct rte_udp_hdr* udp = (struct rte_udp_hdr*)(ip + 1);
+	struct latency_payload* payload = (struct latency_payload*)(udp + 1);
+
+	if (rte_pktmbuf_data_len(m) < LATENCY_PKT_LEN ||
+			eth->ether_type != rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4) ||
+			rte_ipv4_hdr_len(ip) != sizeof(*ip) || ip->next_proto_id != IPPROTO_UDP ||
+			udp->dst_port != rte_cpu_to_be_16(LATENCY_UDP_PORT) ||
+			payload->magic != LATENCY_MAGIC || payload->flow >= LATENCY_MAX_FLOWS)
+		return NULL;
+	return payload;
+}
+
+// Функция получения интервала гистограммы: 8 интервалов на каждую степень двойки,
+// относительная погрешность не превышает 12.5%.
+static inline unsigned
+latency_bucket(uint64_t ns) {
+	unsigned msb;
+
+	if (ns < (1 << LATENCY_SUB_BITS))
+		return ns;
+	msb = 63 - __builtin_clzll(ns);
+	return ((msb - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) |
+		((ns >> (msb - LATENCY_SUB_BITS)) & ((1 << LATENCY_SUB_BITS) - 1));
+}
+
+// Функция получения нижней границы интервала гистограммы в наносекундах.
+static inline uint64_t
+latency_bucket_ns(unsigned bucket) {
+	unsigned shift = bucket >> LATENCY_SUB_BITS;
+	uint64_t sub = bucket & ((1 << LATENCY_SUB_BITS) - 1);
+
+	if (shift == 0)
+		return sub;
+	return (sub | (1 << LATENCY_SUB_BITS)) << (shift - 1);
+}
+
+// Функция учёта принятого пакета измерения задержки.
+// Задержка односторонняя: TSC синхронизирован между ядрами одного узла,
+// поэтому измерение возможно только при отправке и приёме на одном узле.
+static inline void
+latency_record(struct latency_stats* lat, const struct latency_payload* payload, uint64_t now) {
+	uint16_t flow = payload->flow;
+	uint64_t ns = now > payload->tsc ? (now - payload->tsc) * NS_PER_S / tsc_hz : 0;
+
+	lat->hist[latency_bucket(ns)]++;
+	lat->samples++;
+	lat->sum_ns += ns;
+	if (ns < lat->min_ns)
+		lat->min_ns = ns;
+	if (ns > lat->max_ns)
+		lat->max_ns = ns;
+
+	if (lat->received[flow]) {
+		double d = ns > lat->prev_ns[flow] ? ns - lat->prev_ns[flow] : lat->prev_ns[flow] - ns;
+
+		lat->jitter_ns[flow] += (d - lat->jitter_ns[flow]) / 16;
+	}
+	lat->prev_ns[flow] = ns;
+	lat->received[flow]++;
+
+	if (payload->seq < lat->next_seq[flow])
+		lat->reorders[flow]++;
+	else
+		lat->next_seq[flow] = payload->seq + 1;
+}
+
+// Функция приёма пакетов измерения задержки.
+// После остановки ядер отправки приём продолжается, пока пакеты в пути
+// не перестанут поступать в течение LATENCY_DRAIN_MS.
+static void
+latency_rx_loop(struct thread_args* args) {
+	struct rte_mbuf* bufs[BURST_SIZE];
+	struct latency_stats* lat = args->lat;
+	uint64_t idle_since = 0;
+
+	lat->min_ns = UINT64_MAX;
+	for (;;) {
+		const uint16_t nb_rx = rte_eth_rx_burst(args->port, args->queue, bufs, BURST_SIZE);
+		uint64_t now = get_current_tsc();
+
+		if (unlikely(nb_rx == 0)) {
+			if (__atomic_load_n(&tx_running, __ATOMIC_ACQUIRE) > 0)
+				idle_since = now;
+			else if (now - idle_since > tsc_hz * LATENCY_DRAIN_MS / 1000)
+				break;
+			idle_wait(args);
+			continue;
+		}
+		idle_since = now;
+		idle_wake(args);
+		reta_account(args, bufs, nb_rx);
+
+		for (uint16_t i = 0; i < nb_rx; i++) {
+			struct latency_payload* payload = latency_payload_get(bufs[i]);
+
+			if (payload != NULL)
+				latency_record(lat, payload, now);
+			else
+				lat->foreign++;
+		}
+		rte_pktmbuf_free_bulk(bufs, nb_rx);
+		*args->count += nb_rx;
+	}
+}
+
+// Функция передачи копий пакетов ядру записи одной операцией с кольцом.
+// При заполненном кольце копии отбрасываются, чтобы не задерживать приём.
+static inline void
+pcapng_enqueue(struct thread_args* args, struct rte_mbuf** copies, uint16_t nb) {
+	unsigned sent;
+
+	if (nb == 0)
+		return;
+	// Подробнее: https://doc.dpdk.org/api/rte__ring_8h.html
+	sent = rte_ring_mp_enqueue_burst(pcapng_ring, (void**)copies, nb, NULL);
+	if (unlikely(sent < nb)) {
+		rte_pktmbuf_free_bulk(&copies[sent], nb - sent);
+		args->pcap_drops += nb - sent;
+	}
+}
+
+// Функция заполнения типа пакета и длин заголовков, по которым `rte_gro` выбирает
+// пакеты TCP/IPv4 и TCP/IPv4 в VXLAN. Длина L2 внутреннего пакета VXLAN включает
+// внешние заголовки UDP и VXLAN, как при разборе в testpmd.
+static inline void
+gro_prepare(struct rte_mbuf* m) {
+	struct rte_net_hdr_lens hdr_lens;
+	const struct rte_udp_hdr* udp;
+	const struct rte_ether_hdr* eth;
+	const struct rte_ipv4_hdr* ip;
+	const struct rte_tcp_hdr* tcp;
+	uint32_t off;
+
+	// Подробнее: https://doc.dpdk.org/api/rte__net_8h.html
+	m->packet_type = rte_net_get_ptype(m, &hdr_lens, RTE_PTYPE_L2_MASK | RTE_PTYPE_L3_MASK | RTE_PTYPE_L4_MASK);
+	m->l2_len = hdr_lens.l2_len;
+	m->l3_len = hdr_lens.l3_len;
+	m->l4_len = hdr_lens.l4_len;
+
+	if (!RTE_ETH_IS_IPV4_HDR(m->packet_type) || (m->packet_type & RTE_PTYPE_L4_MASK) != RTE_PTYPE_L4_UDP)
+		return;
+	off = m->l2_len + m->l3_len;
+	udp = rte_pktmbuf_mtod_offset(m, const struct rte_udp_hdr*, off);
+	if (udp->dst_port != rte_cpu_to_be_16(RTE_VXLAN_DEFAULT_PORT))
+		return;
+
+	off += sizeof(*udp) + sizeof(struct rte_vxlan_hdr);
+	if (rte_pktmbuf_data_len(m) < off + sizeof(*eth) + sizeof(*ip) + sizeof(*tcp))
+		return;
+	eth = rte_pktmbuf_mtod_offset(m, const struct rte_ether_hdr*, off);
+	ip = (const struct rte_ipv4_hdr*)(eth + 1);
+	if (eth->ether_type != rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4) || ip->next_proto_id != IPPROTO_TCP ||
+			rte_pktmbuf_data_len(m) < off + sizeof(*eth) + rte_ipv4_hdr_len(ip) + sizeof(*tcp))
+		return;
+	tcp = (const struct rte_tcp_hdr*)((const uint8_t*)ip + rte_ipv4_hdr_len(ip));
+
+	m->outer_l2_len = m->l2_len;
+	m->outer_l3_len = m->l3_len;
+	m->l2_len = sizeof(*udp) + sizeof(struct rte_vxlan_hdr) + sizeof(*eth);
+	m->l3_len = rte_ipv4_hdr_len(ip);
+	m->l4_len = (tcp->data_off >> 4) * 4;
+	m->packet_type = RTE_PTYPE_L2_ETHER | RTE_PTYPE_L3_IPV4_EXT_UNKNOWN | RTE_PTYPE_L4_UDP |
+		RTE_PTYPE_TUNNEL_VXLAN | RTE_PTYPE_INNER_L2_ETHER | RTE_PTYPE_INNER_L3_IPV4_EXT_UNKNOWN |
+		RTE_PTYPE_INNER_L4_TCP;
+}
+
+// Функция объединения сегментов TCP в блоке пакетов (облегчённый режим `rte_gro`:
+// объединяются только пакеты одного блока, состояние между блоками не хранится).
+// Блок обрабатывается частями по RTE_GRO_MAX_BURST_ITEM_NUM пакетов.
+// Возвращает количество пакетов после объединения.
+// Подробнее: https://doc.dpdk.org/guides/prog_guide/generic_receive_offload_lib.html
+static uint16_t
+gro_burst(struct thread_args* args, struct rte_mbuf** bufs, uint16_t nb) {
+	uint16_t out = 0;
+
+	for (uint16_t i = 0; i < nb; i++)
+		gro_prepare(bufs[i]);
+
+	for (uint16_t off = 0; off < nb; off += RTE_GRO_MAX_BURST_ITEM_NUM) {
+		uint16_t n = RTE_MIN(nb - off, RTE_GRO_MAX_BURST_ITEM_NUM);
+
+		n = rte_gro_reassemble_burst(&bufs[off], n, &args->gro_param);
+		memmove(&bufs[out], &bufs[off], n * sizeof(bufs[0]));
+		out += n;
+	}
+
+	args->gro_in += nb;
+	args->gro_out += out;
+	return out;
+}
+
+// Функция захвата пакетов.
+static void
+rx_loop(struct thread_args* args) {
+	while (!work_done) {
+		struct rte_mbuf *bufs[BURST_SIZE];
+		struct rte_mbuf* copies[BURST_SIZE];
+		uint16_t nb_copies = 0;
+		// Получения аллоцированных пакетов.
+		// Подробнее: https://doc.dpdk.org/api/rte__ethdev_8h.html#a3e7d76a451b46348686ea97d6367f102
+		const uint16_t nb_rx = rte_eth_rx_burst(args->port, args->queue, bufs, BURST_SIZE);
+
+		if (unlikely(nb_rx == 0)) {
+			// Небольшая задержка для снижения энергопотребления.
+			// Истечение потоков продолжается и при отсутствии трафика.
+			if (args->flows != NULL)
+				flow_expire(args->flows, get_current_tsc());
+			// Подробнее: https://doc.dpdk.org/api/rte__pause_8h.html#ad59aa7777c93d3cfd5f10617a3acd1c5
+			idle_wait(args);
+			continue;
+		}
+		idle_wake(args);
+		reta_account(args, bufs, nb_rx);
+		// Учёт до GRO: объединение не меняет объём, но сокращает количество пакетов.
+		for (uint16_t i = 0; i < nb_rx; i++) {
+			args->bytes += rte_pktmbuf_pkt_len(bufs[i]);
+			args->segs += bufs[i]->nb_segs;
+		}
+
+		// Дальнейшая обработка выполняется для объединённых пакетов: потоки и правила
+		// учитывают объединённый пакет как один.
+		const bool gro = gro_enabled;
+		const uint64_t proc_start = get_current_tsc();
+		uint16_t nb = nb_rx;
+		if (gro) {
+			nb = gro_burst(args, bufs, nb_rx);
+			args->gro_tsc += get_current_tsc() - proc_start;
+		}
+
+		if (args->flows != NULL) {
+			uint64_t start = get_current_tsc();
+
+			flow_burst(args->flows, bufs, nb, start);
+			args->flow_tsc += get_current_tsc() - start;
+		}
+
+		uint32_t results[BURST_SIZE];
+		if (opt_classify != CLASSIFY_NONE) {
+			uint64_t start = get_current_tsc();
+
+			classify_burst(bufs, nb, results);
+			args->classify_tsc += get_current_tsc() - start;
+		}
+
+		for (uint16_t i = 0; i < nb; ++i) {
+			// При классификации выводятся или записываются только совпавшие с правилами пакеты.
+			if (opt_classify != CLASSIFY_NONE) {
+				if (!results[i])
+					goto next;
+				args->rule_hits[results[i]]++;
+			}
+
+			if (opt_pcapng_path == NULL) {
+				hex_dump(bufs[i], args->queue);
+			} else {
+				// Копия первых opt_snaplen байт в пул записи: mbuf кольца RX сразу
+				// возвращается драйверу и не удерживается до записи на диск.
+				// Подробнее: https://doc.dpdk.org/api/rte__pcapng_8h.html
+				struct rte_mbuf* copy = rte_pcapng_copy(args->port, args->queue, bufs[i],
+					args->pcap_pool, opt_snaplen, RTE_PCAPNG_DIRECTION_IN, NULL);
+
+				if (likely(copy != NULL))
+					copies[nb_copies++] = copy;
+				else
+					args->pcap_drops++;
+			}
+next:
+			// Возвращение буфера в память `rte_mempool`.
+			// Подробнее: https://doc.dpdk.org/api/rte__mbuf_8h.html#a1215458932900b7cd5192326fa4a6902
+			rte_pktmbuf_free(bufs[i]);
+		}
+		pcapng_enqueue(args, copies, nb_copies);
+
+		args->proc_tsc[gro] += get_current_tsc() - proc_start;
+		args->proc_pkts[gro] += nb_rx;
+		*args->count += nb_rx;
+	}
+}
+
+// Функция открытия следующего файла pcapng. При ротации к имени добавляется номер файла.
+static rte_pcapng_t*
+pcapng_open(struct thread_args* args) {
+	char path[PATH_MAX];
+	rte_pcapng_t* pcapng;
+	int fd;
+
+	if (opt_rotate_mb || opt_rotate_sec)
+		snprintf(path, sizeof(path), "%s.%u", opt_pcapng_path, args->pcap_files);
+	else
+		snprintf(path, sizeof(path), "%s", opt_pcapng_path);
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		rte_exit(EXIT_FAILURE, "Error: cannot open %s: %s\n", path, strerror(errno));
+
+	// Подробнее: https://doc.dpdk.org/api/rte__pcapng_8h.html
+	pcapng = rte_pcapng_fdopen(fd, NULL, NULL, "test_dpdk", NULL);
+	if (pcapng == NULL || rte_pcapng_add_interface(pcapng, opt_port_id, NULL, NULL, NULL) < 0)
+		rte_exit(EXIT_FAILURE, "Error: cannot write pcapng header to %s\n", path);
+
+	args->pcap_files++;
+	return pcapng;
+}
+
+// Функция записи копий пакетов в файл pcapng на отдельном ядре.
+// Копии накапливаются до PCAPNG_WRITE_BURST пакетов или PCAPNG_FLUSH_US микросекунд,
+// и блок записывается одним вызовом writev(). Заполненность кольца (очередь записи)
+// измеряется при каждой записи.
+static void
+pcapng_writer_loop(struct thread_args* args) {
+	struct rte_mbuf* bufs[PCAPNG_WRITE_BURST];
+	rte_pcapng_t* pcapng = pcapng_open(args);
+	const uint64_t flush_tsc = tsc_hz * PCAPNG_FLUSH_US / 1000000;
+	uint64_t opened = get_current_tsc();
+	uint64_t last_write = opened;
+	uint64_t file_bytes = 0;
+
+	for (;;) {
+		bool running = __atomic_load_n(&rx_running, __ATOMIC_ACQUIRE) > 0;
+		uint64_t now = get_current_tsc();
+		unsigned backlog = rte_ring_count(pcapng_ring);
+		unsigned nb;
+		ssize_t len;
+
+		if (backlog < PCAPNG_WRITE_BURST && running && now - last_write < flush_tsc) {
+			rte_pause();
+			continue;
+		}
+		last_write = now;
+
+		nb = rte_ring_sc_dequeue_burst(pcapng_ring, (void**)bufs, PCAPNG_WRITE_BURST, NULL);
+		if (nb == 0) {
+			if (!running)
+				break;
+			continue;
+		}
+
+		args->fill_sum += backlog;
+		args->fill_max = RTE_MAX(args->fill_max, backlog);
+		args->fill_samples++;
+
+		len = rte_pcapng_write_packets(pcapng, bufs, nb);
+		rte_pktmbuf_free_bulk(bufs, nb);
+		if (unlikely(len < 0)) {
+			args->pcap_errors++;
+			continue;
+		}
+		file_bytes += len;
+		args->pcap_bytes += len;
+		*args->count += nb;
+
+		// Ротация файла по размеру или времени записи.
+		if ((opt_rotate_mb && file_bytes >= (opt_rotate_mb << 20)) ||
+				(opt_rotate_sec && now - opened >= opt_rotate_sec * tsc_hz)) {
+			rte_pcapng_close(pcapng);
+			pcapng = pcapng_open(args);
+			opened = now;
+			file_bytes = 0;
+		}
+	}
+
+	rte_pcapng_close(pcapng);
+}
+
+// Функция замены MAC адресов: источник - адрес порта отправки,
+// назначение - 02:00:00:00:00:<порт> (как в примере l2fwd).
+static inline void
+fwd_mac_rewrite(struct rte_mbuf* m, uint16_t port) {
+	struct rte_ether_hdr* eth = rte_pktmbuf_mtod(m, struct rte_ether_hdr*);
+
+	memset(&eth->dst_addr, 0, sizeof(eth->dst_addr));
+	eth->dst_addr.addr_bytes[0] = 0x02;
+	eth->dst_addr.addr_bytes[5] = port;
+	rte_ether_addr_copy(&port_macs[port], &eth->src_addr);
+}
+
+// Функция пересылки пакетов из очереди порта приёма в очередь с тем же номером порта пары.
+// Пакеты накапливаются в `rte_eth_dev_tx_buffer` и отправляются полным блоком,
+// неполный блок отправляется через FWD_FLUSH_US. Пакеты, не принятые кольцом TX,
+// освобождаются и учитываются в tx_dropped.
+// Подробнее: https://doc.dpdk.org/guides/sample_app_ug/l2_forward_real_virtual.html
+static void
+fwd_loop(struct thread_args* args) {
+	struct rte_mbuf* bufs[BURST_SIZE];
+	const uint64_t drain_tsc = tsc_hz * FWD_FLUSH_US / 1000000;
+	uint64_t last_flush = get_current_tsc();
+
+	while (!work_done) {
+		uint64_t now = get_current_tsc();
+		uint16_t nb_rx;
+
+		if (unlikely(now - last_flush > drain_tsc)) {
+			// Подробнее: https://doc.dpdk.org/api/rte__ethdev_8h.html
+			rte_eth_tx_buffer_flush(args->tx_port, args->queue, args->tx_buffer);
+			last_flush = now;
+		}
+
+		nb_rx = rte_eth_rx_burst(args->port, args->queue, bufs, BURST_SIZE);
+		if (unlikely(nb_rx == 0)) {
+			// Накопленные пакеты отправляются до ожидания.
+			if (args->tx_buffer->length)
+				rte_eth_tx_buffer_flush(args->tx_port, args->queue, args->tx_buffer);
+			idle_wait(args);
+			continue;
+		}
+		idle_wake(args);
+		reta_account(args, bufs, nb_rx);
+
+		for (uint16_t i = 0; i < nb_rx; i++) {
+			args->bytes += rte_pktmbuf_pkt_len(bufs[i]);
+			args->segs += bufs[i]->nb_segs;
+			if (opt_mac_rewrite)
+				fwd_mac_rewrite(bufs[i], args->tx_port);
+			// Отправка выполняется при заполнении буфера.
+			if (rte_eth_tx_buffer(args->tx_port, args->queue, args->tx_buffer, bufs[i]))
+				last_flush = now;
+		}
+		*args->count += nb_rx;
+	}
+
+	rte_eth_tx_buffer_flush(args->tx_port, args->queue, args->tx_buffer);
+}
+
+// Функция получения хэша потока пакета.
+// Используется хэш RSS, вычисленный сетевой картой; без него хэш считается
+// по адресам и портам IPv4, чтобы пакеты одного потока попадали на одно ядро.
+static inline uint32_t
+pkt_flow_hash(struct rte_mbuf* m) {
+	struct rte_ether_hdr* eth;
+	struct rte_ipv4_hdr* ip;
+	uint32_t ports = 0;
+
+	if (m->ol_flags & RTE_MBUF_F_RX_RSS_HASH)
+		return m->hash.rss;
+
+	eth = rte_pktmbuf_mtod(m, struct rte_ether_hdr*);
+	if (rte_pktmbuf_data_len(m) < sizeof(*eth) + sizeof(*ip) + sizeof(ports) ||
+			eth->ether_type != rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4))
+		return 0;
+
+	ip = (struct rte_ipv4_hdr*)(eth + 1);
+	if ((ip->next_proto_id == IPPROTO_TCP || ip->next_proto_id == IPPROTO_UDP) &&
+			rte_pktmbuf_data_len(m) >= sizeof(*eth) + rte_ipv4_hdr_len(ip) + sizeof(ports))
+		ports = *rte_pktmbuf_mtod_offset(m, uint32_t*, sizeof(*eth) + rte_ipv4_hdr_len(ip));
+	// Подробнее: https://doc.dpdk.org/api/rte__jhash_8h.html
+	return rte_jhash_3words(ip->src_addr, ip->dst_addr, ports, 0);
+}
+
+// Функция захвата пакетов с передачей на ядра обработки по хэшу потока.
+// Пакеты раскладываются по кольцам ядер обработки и передаются блоками,
+// одна операция с кольцом на ядро обработки вместо операции на каждый пакет.
+static void
+pipeline_rx_loop(struct thread_args* args) {
+	struct rte_mbuf* bufs[BURST_SIZE];
+	struct rte_mbuf* out[MAX_WORKERS][BURST_SIZE];
+	uint16_t nb_out[MAX_WORKERS];
+
+	while (!work_done) {
+		const uint16_t nb_rx = rte_eth_rx_burst(args->port, args->queue, bufs, BURST_SIZE);
+
+		if (unlikely(nb_rx == 0)) {
+			idle_wait(args);
+			continue;
+		}
+		idle_wake(args);
+		reta_account(args, bufs, nb_rx);
+
+		memset(nb_out, 0, sizeof(nb_out[0]) * args->nb_rings);
+		for (uint16_t i = 0; i < nb_rx; i++) {
+			uint16_t w = pkt_flow_hash(bufs[i]) % args->nb_rings;
+
+			out[w][nb_out[w]++] = bufs[i];
+		}
+
+		for (uint16_t w = 0; w < args->nb_rings; w++) {
+			unsigned free_space;
+			unsigned sent;
+
+			if (nb_out[w] == 0)
+				continue;
+
+			// Передача блока указателей на mbuf. Оставшееся место в кольце возвращается
+			// без дополнительного чтения индексов.
+			// Подробнее: https://doc.dpdk.org/api/rte__ring_8h.html
+			sent = rte_ring_enqueue_burst(args->rings[w], (void**)out[w], nb_out[w], &free_space);
+			if (unlikely(sent < nb_out[w])) {
+				// Ядро обработки не успевает: пакеты отбрасываются, чтобы не задерживать приём.
+				args->ring_drops += nb_out[w] - sent;
+				rte_pktmbuf_free_bulk(&out[w][sent], nb_out[w] - sent);
+			}
+
+			args->fill_sum += rte_ring_get_capacity(args->rings[w]) - free_space;
+			if (rte_ring_get_capacity(args->rings[w]) - free_space > args->fill_max)
+				args->fill_max = rte_ring_get_capacity(args->rings[w]) - free_space;
+			args->fill_samples++;
+		}
+
+		*args->count += nb_rx;
+	}
+
+	__atomic_fetch_sub(&rx_running, 1, __ATOMIC_RELEASE);
+}
+
+// Функция обработки пакетов, полученных от ядер приёма.
+// Работа завершается после остановки всех ядер приёма и опустошения колец.
+static void
+pipeline_worker_loop(struct thread_args* args) {
+	struct rte_mbuf* bufs[BURST_SIZE];
+
+	for (;;) {
+		bool running = __atomic_load_n(&rx_running, __ATOMIC_ACQUIRE) > 0;
+		unsigned total = 0;
+
+		for (uint16_t r = 0; r < args->nb_rings; r++) {
+			// Подробнее: https://doc.dpdk.org/api/rte__ring_8h.html
+			unsigned nb = rte_ring_dequeue_burst(args->rings[r], (void**)bufs, BURST_SIZE, NULL);
+
+			for (unsigned i = 0; i < nb; i++)
+				hex_dump(bufs[i], args->queue);
+			if (nb)
+				rte_pktmbuf_free_bulk(bufs, nb);
+			total += nb;
+		}
+
+		*args->count += total;
+		if (total == 0) {
+			if (!running)
+				break;
+			rte_pause();
+		}
+	}
+}
+
+// Функция учёта задержки пакета от приёма до текущего этапа.
+static inline void
+event_latency(struct thread_args* args, struct rte_mbuf* m, uint64_t now) {
+	uint64_t lat = now - EVENT_META(m)->tsc;
+
+	args->lat_sum += lat;
+	if (lat > args->lat_max)
+		args->lat_max = lat;
+}
+
+// Проверка завершения работы этапов eventdev: ядра приёма остановлены
+// и все события дошли до завершающего этапа.
+static inline bool
+event_pipeline_done(void) {
+	return __atomic_load_n(&rx_running, __ATOMIC_ACQUIRE) == 0 &&
+		__atomic_load_n(&events_in_flight, __ATOMIC_ACQUIRE) == 0;
+}
+
+// Функция захвата пакетов с передачей в eventdev.
+// Номер порта eventdev совпадает с индексом ядра.
+// Поток определяется хэшем, поэтому атомарное планирование передаёт пакеты
+// одного потока только одному ядру обработки в каждый момент времени.
+static void
+event_rx_loop(struct thread_args* args) {
+	struct rte_mbuf* bufs[BURST_SIZE];
+	struct rte_event ev[BURST_SIZE];
+	uint32_t seq = 0;
+
+	while (!work_done) {
+		const uint16_t nb_rx = rte_eth_rx_burst(args->port, args->queue, bufs, BURST_SIZE);
+		uint64_t now = get_current_tsc();
+		uint16_t sent;
+
+		if (unlikely(nb_rx == 0)) {
+			idle_wait(args);
+			continue;
+		}
+		idle_wake(args);
+		reta_account(args, bufs, nb_rx);
+
+		for (uint16_t i = 0; i < nb_rx; i++) {
+			EVENT_META(bufs[i])->tsc = now;
+			EVENT_META(bufs[i])->seq = seq++;
+			EVENT_META(bufs[i])->queue = args->queue;
+
+			ev[i].event = 0;
+			ev[i].flow_id = pkt_flow_hash(bufs[i]);
+			ev[i].op = RTE_EVENT_OP_NEW;
+			ev[i].sched_type = RTE_SCHED_TYPE_ATOMIC;
+			ev[i].queue_id = 0;
+			ev[i].event_type = RTE_EVENT_TYPE_ETHDEV;
+			ev[i].priority = RTE_EVENT_DEV_PRIORITY_NORMAL;
+			ev[i].mbuf = bufs[i];
+		}
+
+		// Новые события отклоняются при достижении new_event_threshold,
+		// что ограничивает очередь перед перегруженными ядрами обработки.
+		// Подробнее: https://doc.dpdk.org/api/rte__eventdev_8h.html
+		__atomic_fetch_add(&events_in_flight, nb_rx, __ATOMIC_RELEASE);
+		sent = rte_event_enqueue_new_burst(event_dev_id, args->queue, ev, nb_rx);
+		if (unlikely(sent < nb_rx)) {
+			args->ring_drops += nb_rx - sent;
+			for (uint16_t i = sent; i < nb_rx; i++)
+				rte_pktmbuf_free(bufs[i]);
+			__atomic_fetch_sub(&events_in_flight, nb_rx - sent, __ATOMIC_RELEASE);
+		}
+
+		*args->count += nb_rx;
+	}
+
+	__atomic_fetch_sub(&rx_running, 1, __ATOMIC_RELEASE);
+}
+
+// Функция обработки событий атомарной очереди и передачи их на завершающий этап.
+// Пересылка события освобождает атомарный контекст потока.
+static void
+event_worker_loop(struct thread_args* args) {
+	struct rte_event ev[BURST_SIZE];
+
+	for (;;) {
+		uint16_t nb = rte_event_dequeue_burst(event_dev_id, args->queue, ev, BURST_SIZE, 0);
+		uint64_t now = get_current_tsc();
+		uint16_t sent = 0;
+
+		if (nb == 0) {
+			if (event_pipeline_done())
+				break;
+			rte_pause();
+			continue;
+		}
+
+		for (uint16_t i = 0; i < nb; i++) {
+			event_latency(args, ev[i].mbuf, now);
+			hex_dump(ev[i].mbuf, args->queue);
+
+			ev[i].queue_id = 1;
+			ev[i].op = RTE_EVENT_OP_FORWARD;
+			ev[i].sched_type = RTE_SCHED_TYPE_ATOMIC;
+		}
+
+		// Пересылаемые события не ограничиваются порогом новых событий,
+		// поэтому повтор не приводит к взаимной блокировке.
+		while (sent < nb)
+			sent += rte_event_enqueue_forward_burst(event_dev_id, args->queue, ev + sent, nb - sent);
+
+		*args->count += nb;
+	}
+}
+
+// Функция завершающего этапа eventdev.
+// Очередь этапа связана с одним портом, поэтому пакеты каждого потока приходят
+// в порядке приёма. Порядок проверяется по номерам из метаданных пакета.
+static void
+event_sink_loop(struct thread_args* args) {
+	struct rte_event ev[BURST_SIZE];
+	struct rte_mbuf* bufs[BURST_SIZE];
+	// Последний номер пакета потока, увеличенный на 1 (0 - поток ещё не встречался).
+	// Номера назначаются в каждой очереди приёма отдельно, поэтому состояние хранится
+	// по паре (очередь, flow_id): одинаковые flow_id потоков разных очередей и перенос
+	// потока в другую очередь при перераспределении RETA не считаются нарушением порядка.
+	uint32_t* last_seq = rte_zmalloc_socket("event_order",
+		(size_t)opt_queue_count * EVENT_FLOWS * sizeof(uint32_t), RTE_CACHE_LINE_SIZE, rte_socket_id());
+
+	if (last_seq == NULL)
+		rte_exit(EXIT_FAILURE, "Error: cannot allocate order table\n");
+
+	for (;;) {
+		uint16_t nb = rte_event_dequeue_burst(event_dev_id, args->queue, ev, BURST_SIZE, 0);
+		uint64_t now = get_current_tsc();
+
+		if (nb == 0) {
+			if (event_pipeline_done())
+				break;
+			rte_pause();
+			continue;
+		}
+
+		for (uint16_t i = 0; i < nb; i++) {
+			struct event_meta* meta = EVENT_META(ev[i].mbuf);
+			uint32_t* last = &last_seq[(size_t)meta->queue * EVENT_FLOWS + ev[i].flow_id];
+
+			event_latency(args, ev[i].mbuf, now);
+			if (*last > meta->seq + 1)
+				args->reorders++;
+			*last = meta->seq + 1;
+			bufs[i] = ev[i].mbuf;
+		}
+		rte_pktmbuf_free_bulk(bufs, nb);
+
+		__atomic_fetch_sub(&events_in_flight, nb, __ATOMIC_RELEASE);
+		*args->count += nb;
+	}
+
+	rte_free(last_seq);
+}
+
+// Функция отправки пакетов.
+// Пакеты заполнены шаблоном заранее (fill_tx_template), поэтому выделение mbuf сводится
+// к установке длины. Принятые драйвером mbuf освобождаются драйвером после отправки,
+// а неотправленный хвост остаётся у приложения и повторяется в следующей итерации.
+static void
+tx_loop(struct thread_args* args) {
+	struct rte_mbuf* bufs[BURST_SIZE];
+	uint16_t nb_pending = 0;
+	const uint16_t pkt_len = args->mode == MODE_LATENCY ? LATENCY_PKT_LEN : opt_tx_size;
+	// Пакет больше буфера mbuf занимает tx_segs сегментов.
+	const uint16_t nb_segs = args->mode == MODE_LATENCY ? 1 : tx_segs;
+	const uint16_t head_len = RTE_MIN(pkt_len, rte_pktmbuf_data_room_size(args->mbuf_pool) - RTE_PKTMBUF_HEADROOM);
+
+	while (!work_done && *args->count < opt_tx_count) {
+		uint64_t left = opt_tx_count - *args->count;
+		uint16_t nb_burst = left > BURST_SIZE ? BURST_SIZE : left;
+		uint16_t nb_tx;
+
+		// Добор пакетов до полного блока после неотправленного хвоста.
+		if (nb_pending < nb_burst) {
+			// Аллоцирование нескольких пакетов (взятие из `rte_mempool`).
+			// Подробнее: https://doc.dpdk.org/api/rte__mbuf_8h.html#ae3d2aeb7f1189a3a6c33c861391cb16b
+			if (rte_pktmbuf_alloc_bulk(args->mbuf_pool, &bufs[nb_pending], nb_burst - nb_pending) == 0) {
+				uint16_t i;
+
+				for (i = nb_pending; i < nb_burst; i++) {
+					bufs[i]->data_len = head_len;
+					bufs[i]->pkt_len = pkt_len;
+					if (nb_segs > 1 && tx_chain_segments(args->mbuf_pool, bufs[i]) != 0) {
+						// Пакеты без хвостовых сегментов возвращаются в пул.
+						rte_pktmbuf_free_bulk(&bufs[i], nb_burst - i);
+						args->alloc_fail++;
+						break;
+					}
+					if (args->mode == MODE_LATENCY)
+						rte_pktmbuf_mtod_offset(bufs[i], struct latency_payload*,
+							LATENCY_PKT_LEN - sizeof(struct latency_payload))->seq = args->tx_seq++;
+				}
+				nb_pending = i;
+			} else {
+				// Все mbuf находятся в кольце TX: ожидание их освобождения драйвером.
+				args->alloc_fail++;
+			}
+		}
+
+		if (unlikely(nb_pending == 0)) {
+			rte_pause();
+			continue;
+		}
+
+		// Метка времени ставится непосредственно перед отправкой, в том числе
+		// повторно для хвоста, не принятого драйвером в прошлый раз.
+		if (args->mode == MODE_LATENCY) {
+			uint64_t now = get_current_tsc();
+
+			for (uint16_t i = 0; i < nb_pending; i++)
+				rte_pktmbuf_mtod_offset(bufs[i], struct latency_payload*,
+					LATENCY_PKT_LEN - sizeof(struct latency_payload))->tsc = now;
+		}
+
+		// Отправка нескольких пакетов. Отправленные mbuf переходят во владение драйвера.
+		// Подробнее: https://doc.dpdk.org/api/rte__ethdev_8h.html#a83e56cabbd31637efd648e3fc010392b
+		nb_tx = rte_eth_tx_burst(args->port, args->queue, bufs, nb_pending);
+		*args->count += nb_tx;
+		args->bytes += (uint64_t)nb_tx * pkt_len;
+		args->segs += (uint64_t)nb_tx * nb_segs;
+		if (unlikely(nb_tx < nb_pending)) {
+			args->tx_partial++;
+			memmove(bufs, &bufs[nb_tx], (nb_pending - nb_tx) * sizeof(bufs[0]));
+		}
+		nb_pending -= nb_tx;
+	}
+
+	// Освобождение в `rte_mempool` пакетов, так и не принятых драйвером.
+	// Подробнее: https://doc.dpdk.org/api/rte__mbuf_8h.html#a90e7796f902bcaa856e274a30c68e47f
+	if (nb_pending)
+		rte_pktmbuf_free_bulk(bufs, nb_pending);
+}
+
+// Функция захвата или отправки пакетов.
+static int
+lcore_main(void* arg) {
+	struct thread_args* args = (struct thread_args*)arg;
+	struct timespec cpu_start, cpu_end;
+
+	// Прерывания очереди регистрируются в epoll потока, который их ожидает.
+	if (args->idle == IDLE_INTERRUPT &&
+			rte_eth_dev_rx_intr_ctl_q(args->port, args->queue, RTE_EPOLL_PER_THREAD,
+				RTE_INTR_EVENT_ADD, NULL) != 0) {
+		printf("Warning: no Rx interrupts on port %u queue %u, using sleep\n", args->port, args->queue);
+		args->idle = IDLE_SLEEP;
+	}
+	args->sleep_us = IDLE_SLEEP_MIN_US;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+	args->start_tsc = get_current_tsc();
+	if (args->mode == MODE_PIPELINE)
+		args->role == ROLE_WORKER ? pipeline_worker_loop(args) : pipeline_rx_loop(args);
+	else if (args->mode == MODE_EVENTDEV)
+		args->role == ROLE_WORKER ? event_worker_loop(args) :
+			args->role == ROLE_SINK ? event_sink_loop(args) : event_rx_loop(args);
+	else if (args->mode == MODE_LATENCY && args->role == ROLE_TX) {
+		tx_loop(args);
+		__atomic_fetch_sub(&tx_running, 1, __ATOMIC_RELEASE);
+	} else if (args->mode == MODE_LATENCY)
+		latency_rx_loop(args);
+	else if (args->mode == MODE_FORWARD)
+		fwd_loop(args);
+	else if (args->mode == MODE_RXONLY && args->role == ROLE_WRITER)
+		pcapng_writer_loop(args);
+	else if (args->mode == MODE_RXONLY && opt_pcapng_path != NULL) {
+		rx_loop(args);
+		__atomic_fetch_sub(&rx_running, 1, __ATOMIC_RELEASE);
+	} else if (args->mode == MODE_RXONLY)
+		rx_loop(args);
+	else
+		tx_loop(args);
+	args->end_tsc = get_current_tsc();
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+	if (args->idle == IDLE_INTERRUPT)
+		rte_eth_dev_rx_intr_ctl_q(args->port, args->queue, RTE_EPOLL_PER_THREAD,
+			RTE_INTR_EVENT_DEL, NULL);
+	args->cpu_ns = (cpu_end.tv_sec - cpu_start.tv_sec) * NS_PER_S + cpu_end.tv_nsec - cpu_start.tv_nsec;
+	__atomic_fetch_sub(&threads_running, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+// Функция создания колец конвейера: отдельное кольцо на каждую пару ядра приёма
+// и ядра обработки, поэтому у кольца один производитель и один потребитель
+// и передача не требует атомарных операций сравнения с обменом.
+static void
+setup_pipeline(struct thread_args* args) {
+	char name[RTE_RING_NAMESIZE];
+
+	for (uint16_t rx = 0; rx < opt_queue_count; rx++) {
+		args[rx].rings = calloc(opt_workers, sizeof(struct rte_ring*));
+		args[rx].nb_rings = opt_workers;
+	}
+	for (uint16_t w = 0; w < opt_workers; w++) {
+		struct thread_args* worker = &args[opt_queue_count + w];
+
+		worker->rings = calloc(opt_queue_count, sizeof(struct rte_ring*));
+		worker->nb_rings = opt_queue_count;
+		for (uint16_t rx = 0; rx < opt_queue_count; rx++) {
+			struct rte_ring* ring;
+
+			snprintf(name, sizeof(name), "PIPE_%u_%u", rx, w);
+			// Подробнее: https://doc.dpdk.org/api/rte__ring_8h.html
+			ring = rte_ring_create(name, PIPE_RING_SIZE, rte_lcore_to_socket_id(worker->lcore_id),
+				RING_F_SP_ENQ | RING_F_SC_DEQ);
+			if (ring == NULL)
+				rte_exit(EXIT_FAILURE, "Error: cannot create ring %s: %s\n", name, rte_strerror(rte_errno));
+			args[rx].rings[w] = ring;
+			worker->rings[rx] = ring;
+		}
+	}
+	rx_running = opt_queue_count;
+}
+
+// Функция создания программного eventdev (event_sw) с двумя этапами:
+// атомарная очередь 0 для ядер обработки и очередь 1, связанная только
+// с завершающим ядром. Планировщик event_sw работает как сервис на отдельном ядре.
+// Подробнее: https://doc.dpdk.org/guides/eventdevs/sw.html
+static void
+setup_eventdev(struct thread_args* args, int nb_threads) {
+	static const struct rte_mbuf_dynfield meta_desc = {
+		.name = "test_dpdk_event_meta",
+		.size = sizeof(struct event_meta),
+		.align = __alignof__(struct event_meta),
+	};
+	struct rte_event_dev_config dev_conf = {
+		.nb_event_queues = 2,
+		.nb_event_ports = nb_threads,
+		.nb_events_limit = EVENT_LIMIT,
+		.nb_event_queue_flows = 1024,
+		.nb_event_port_dequeue_depth = 128,
+		.nb_event_port_enqueue_depth = 128,
+	};
+	struct rte_event_queue_conf queue_conf = {
+		.schedule_type = RTE_SCHED_TYPE_ATOMIC,
+		.priority = RTE_EVENT_DEV_PRIORITY_NORMAL,
+		.nb_atomic_flows = 1024,
+		.nb_atomic_order_sequences = 1024,
+	};
+	struct rte_event_port_conf port_conf = {
+		// Ядра приёма не могут занять больше 3/4 событий, остаток - для пересылки.
+		.new_event_threshold = EVENT_LIMIT * 3 / 4,
+		.dequeue_depth = 128,
+		.enqueue_depth = 128,
+	};
+	uint32_t service_id;
+	uint8_t queue;
+	int ret;
+
+	// Подробнее: https://doc.dpdk.org/api/rte__mbuf__dyn_8h.html
+	event_meta_offset = rte_mbuf_dynfield_register(&meta_desc);
+	if (event_meta_offset < 0)
+		rte_exit(EXIT_FAILURE, "Error: cannot register mbuf field: %s\n", rte_strerror(rte_errno));
+
+	// Подробнее: https://doc.dpdk.org/api/rte__bus__vdev_8h.html
+	if (rte_vdev_init("event_sw0", NULL) < 0)
+		rte_exit(EXIT_FAILURE, "Error: cannot create event_sw0\n");
+	ret = rte_event_dev_get_dev_id("event_sw0");
+	if (ret < 0)
+		rte_exit(EXIT_FAILURE, "Error: event_sw0 not found\n");
+	event_dev_id = ret;
+
+	// Подробнее: https://doc.dpdk.org/api/rte__eventdev_8h.html
+	if (rte_event_dev_configure(event_dev_id, &dev_conf) < 0)
+		rte_exit(EXIT_FAILURE, "Error: cannot configure eventdev\n");
+
+	if (rte_event_queue_setup(event_dev_id, 0, &queue_conf) < 0)
+		rte_exit(EXIT_FAILURE, "Error: cannot set up event queue 0\n");
+	queue_conf.event_queue_cfg = RTE_EVENT_QUEUE_CFG_SINGLE_LINK;
+	if (rte_event_queue_setup(event_dev_id, 1, &queue_conf) < 0)
+		rte_exit(EXIT_FAILURE, "Error: cannot set up event queue 1\n");
+
+	for (int i = 0; i < nb_threads; i++) {
+		if (rte_event_port_setup(event_dev_id, i, &port_conf) < 0)
+			rte_exit(EXIT_FAILURE, "Error: cannot set up event port %d\n", i);
+		if (args[i].role == ROLE_IO)
+			continue;
+		queue = args[i].role == ROLE_WORKER ? 0 : 1;
+		if (rte_event_port_link(event_dev_id, i, &queue, NULL, 1) != 1)
+			rte_exit(EXIT_FAILURE, "Error: cannot link event port %d\n", i);
+	}
+
+	// Запуск планировщика на отдельном сервисном ядре.
+	// Подробнее: https://doc.dpdk.org/api/rte__service_8h.html
+	if (rte_event_dev_service_id_get(event_dev_id, &service_id) != 0 ||
+			rte_service_lcore_add(event_service_lcore) != 0 ||
+			rte_service_map_lcore_set(service_id, event_service_lcore, 1) != 0 ||
+			rte_service_runstate_set(service_id, 1) != 0 ||
+			rte_service_lcore_start(event_service_lcore) != 0)
+		rte_exit(EXIT_FAILURE, "Error: cannot start eventdev scheduler on lcore %u\n",
+			event_service_lcore);
+
+	if (rte_event_dev_start(event_dev_id) < 0)
+		rte_exit(EXIT_FAILURE, "Error: cannot start eventdev\n");
+	rx_running = opt_queue_count;
+}
+
+// Функция подготовки режима измерения задержки: отдельные пулы ядер отправки
+// с шаблоном UDP пакета (пулы приёма перезаписываются принятыми пакетами)
+// и статистика каждого ядра приёма на его NUMA узле.
+static void
+setup_latency(struct thread_args* args) {
+	latency_pools = create_queue_pools("LAT_POOL", opt_tx_port_id, RX_RING_SIZE, TX_RING_SIZE,
+		fill_latency_template);
+	if (latency_pools == NULL)
+		rte_exit(EXIT_FAILURE, "Error: cannot create latency mbuf pools\n");
+
+	for (uint16_t q = 0; q < opt_queue_count; q++) {
+		args[q].lat = rte_zmalloc_socket("latency_stats", sizeof(struct latency_stats),
+			RTE_CACHE_LINE_SIZE, rte_lcore_to_socket_id(args[q].lcore_id));
+		if (args[q].lat == NULL)
+			rte_exit(EXIT_FAILURE, "Error: cannot allocate latency stats\n");
+	}
+	tx_running = opt_queue_count;
+}
+
+// Функция вывода задержки, объединённой по всем ядрам приёма, и потерь по потокам.
+// Вызывается до очистки EAL, так как статистика находится в памяти `rte_malloc`.
+static void
+print_latency_report(struct thread_args* args, const uint64_t* counts) {
+	static const double percentiles[] = { 50, 90, 99, 99.9, 99.99 };
+	struct latency_stats all = { .min_ns = UINT64_MAX };
+	uint64_t seen = 0;
+	unsigned b = 0;
+
+	for (uint16_t q = 0; q < opt_queue_count; q++) {
+		struct latency_stats* lat = args[q].lat;
+
+		for (unsigned i = 0; i < LATENCY_BUCKETS; i++)
+			all.hist[i] += lat->hist[i];
+		all.samples += lat->samples;
+		all.sum_ns += lat->sum_ns;
+		all.foreign += lat->foreign;
+		all.min_ns = RTE_MIN(all.min_ns, lat->min_ns);
+		all.max_ns = RTE_MAX(all.max_ns, lat->max_ns);
+		for (unsigned f = 0; f < LATENCY_MAX_FLOWS; f++) {
+			all.received[f] += lat->received[f];
+			all.reorders[f] += lat->reorders[f];
+			all.jitter_ns[f] = RTE_MAX(all.jitter_ns[f], lat->jitter_ns[f]);
+		}
+	}
+
+	if (all.samples == 0) {
+		printf("Latency: no packets received (%llu other packets)\n", all.foreign);
+		return;
+	}
+
+	printf("Latency: %llu samples\t min %llu ns\t avg %.0f ns\t max %llu ns\t %llu other packets\n",
+		all.samples, all.min_ns, (double)all.sum_ns / all.samples, all.max_ns, all.foreign);
+	for (unsigned p = 0; p < RTE_DIM(percentiles); p++) {
+		uint64_t rank = all.samples * percentiles[p] / 100;
+
+		while (b < LATENCY_BUCKETS - 1 && seen + all.hist[b] <= rank)
+			seen += all.hist[b++];
+		printf("  p%g: %llu ns\n", percentiles[p], latency_bucket_ns(b));
+	}
+
+	// Поток соответствует ядру отправки, количество отправленных - его счётчик.
+	for (uint16_t f = 0; f < opt_queue_count && f < LATENCY_MAX_FLOWS; f++) {
+		uint64_t sent = counts[opt_queue_count + f];
+		uint64_t lost = sent > all.received[f] ? sent - all.received[f] : 0;
+
+		printf("Flow %u: sent %llu\t received %llu\t lost %llu (%.4f%%)\t reordered %llu\t jitter %.0f ns\n",
+			f, sent, all.received[f], lost, sent ? 100.0 * lost / sent : 0.0,
+			all.reorders[f], all.jitter_ns[f]);
+	}
+}
+
+// Функция создания кольца к ядру записи на его NUMA узле и пулов копий пакетов
+// для каждого ядра приёма. Размер mbuf пула копий определяется snaplen.
+static void
+setup_pcapng(struct thread_args* args, int nb_threads) {
+	unsigned writer_socket = rte_lcore_to_socket_id(args[nb_threads - 1].lcore_id);
+	char name[RTE_MEMPOOL_NAMESIZE];
+
+	pcapng_ring = rte_ring_create("PCAPNG_RING", PCAPNG_RING_SIZE, writer_socket, RING_F_SC_DEQ);
+	if (pcapng_ring == NULL)
+		rte_exit(EXIT_FAILURE, "Error: cannot create pcapng ring: %s\n", rte_strerror(rte_errno));
+
+	// Копия пакета должна помещаться в один mbuf, размер буфера которого ограничен 16 битами,
+	// поэтому длина ограничивается, как в dpdk-dumpcap. Без ограничения RTE_ALIGN(UINT32_MAX, 4)
+	// в rte_pcapng_mbuf_size() переполняется, и копия становится цепочкой крошечных сегментов.
+	// Подробнее: https://doc.dpdk.org/guides/tools/dumpcap.html
+	const uint32_t max_snaplen = RTE_ALIGN_FLOOR(UINT16_MAX - rte_pcapng_mbuf_size(0), 4);
+	if (opt_snaplen == 0)
+		opt_snaplen = (uint32_t)opt_mtu + RTE_ETHER_HDR_LEN;
+	if (opt_snaplen > max_snaplen) {
+		printf("Warning: snaplen limited to %u bytes\n", max_snaplen);
+		opt_snaplen = max_snaplen;
+	}
+
+	for (uint16_t q = 0; q < opt_queue_count; q++) {
+		snprintf(name, sizeof(name), "PCAPNG_POOL_%u", q);
+		// Подробнее: https://doc.dpdk.org/api/rte__pcapng_8h.html
+		args[q].pcap_pool = rte_pktmbuf_pool_create(name, PCAPNG_RING_SIZE - 1, MBUF_CACHE_SIZE, 0,
+			rte_pcapng_mbuf_size(opt_snaplen), rte_lcore_to_socket_id(args[q].lcore_id));
+		if (args[q].pcap_pool == NULL)
+			rte_exit(EXIT_FAILURE, "Error: cannot create mbuf pool %s: %s\n", name, rte_strerror(rte_errno));
+	}
+	rx_running = opt_queue_count;
+}
+
+// Функция проверки ёмкости таблицы потоков: во временную таблицу добавляются opt_flows
+// потоков TCP/IPv4, которые RSS с ключом порта и RETA по умолчанию направляет в очередь 0,
+// с сигнатурами, как у принятых пакетов. Проверка показывает, что таблица очереди вмещает
+// около opt_flows потоков и при симметричном ключе и нескольких очередях.
+// Подробнее: https://doc.dpdk.org/api/rte__thash_8h.html
+static void
+flow_capacity_check(void) {
+	const uint32_t entries = reta_size ? reta_size : RTE_ETH_RSS_RETA_SIZE_128;
+	struct flow_table* ft = flow_table_create(opt_queue_count, rte_socket_id());
+	uint32_t added = 0, failed = 0;
+
+	if (ft == NULL)
+		rte_exit(EXIT_FAILURE, "Error: cannot create flow table: %s\n", rte_strerror(rte_errno));
+
+	for (uint32_t i = 0; added + failed < opt_flows; i++) {
+		struct rte_ipv4_tuple tuple = {
+			.src_addr = RTE_IPV4(10, 0, 0, 0) + i / 64,
+			.dst_addr = RTE_IPV4(192, 168, 0, 10),
+		};
+		struct flow_key key = {
+			.src_addr = rte_cpu_to_be_32(tuple.src_addr),
+			.dst_addr = rte_cpu_to_be_32(tuple.dst_addr),
+			.proto = IPPROTO_TCP,
+		};
+		uint32_t rss;
+
+		tuple.sport = 1024 + i % 64;
+		tuple.dport = 80;
+		// Запись RETA по умолчанию указывает на очередь (номер записи % количество очередей).
+		rss = rte_softrss((uint32_t*)&tuple, RTE_THASH_V4_L4_LEN, rss_key);
+		if (rss % entries % opt_queue_count != 0)
+			continue;
+
+		key.src_port = rte_cpu_to_be_16(tuple.sport);
+		key.dst_port = rte_cpu_to_be_16(tuple.dport);
+		if (rte_hash_add_key_with_hash(ft->hash, &key, flow_rss_sig(rss)) >= 0)
+			added++;
+		else
+			failed++;
+	}
+
+	printf("Flow table: %u of %u flows of one queue fit (%.1f%%)\n", added, opt_flows,
+		100.0 * added / opt_flows);
+	if (added < FLOW_MIN_FILL * opt_flows)
+		printf("Warning: flow table holds less than %.0f%% of --flows\n", 100 * FLOW_MIN_FILL);
+
+	rte_hash_free(ft->hash);
+	rte_free(ft->records);
+	rte_free(ft);
+}
+
+// Функция создания таблиц потоков ядер приёма, кольца выгрузки и файла выгрузки.
+static void
+setup_flows(struct thread_args* args) {
+	if (opt_flow_export != NULL) {
+		flow_export_file = strcmp(opt_flow_export, "-") ? fopen(opt_flow_export, "w") : stdout;
+		if (flow_export_file == NULL)
+			rte_exit(EXIT_FAILURE, "Error: cannot open %s: %s\n", opt_flow_export, strerror(errno));
+		fprintf(flow_export_file, "src,dst,sport,dport,proto,packets,bytes,first,last,tcp_flags,reason\n");
+
+		// Подробнее: https://doc.dpdk.org/api/rte__ring__elem_8h.html
+		flow_export_ring = rte_ring_create_elem("FLOW_EXPORT", sizeof(struct flow_record),
+			FLOW_EXPORT_RING_SIZE, rte_socket_id(), RING_F_SC_DEQ);
+		if (flow_export_ring == NULL)
+			rte_exit(EXIT_FAILURE, "Error: cannot create flow export ring: %s\n", rte_strerror(rte_errno));
+	}
+
+	for (uint16_t q = 0; q < opt_queue_count; q++) {
+		args[q].flows = flow_table_create(q, rte_lcore_to_socket_id(args[q].lcore_id));
+		if (args[q].flows == NULL)
+			rte_exit(EXIT_FAILURE, "Error: cannot create flow table: %s\n", rte_strerror(rte_errno));
+	}
+	flow_capacity_check();
+}
+
+// Функция выгрузки потоков, активных при завершении, и вывода статистики таблиц.
+// Вызывается после остановки ядер приёма и до очистки EAL.
+static void
+finish_flows(struct thread_args* args) {
+	flow_export_drain();
+	for (uint16_t q = 0; q < opt_queue_count; q++) {
+		struct flow_table* ft = args[q].flows;
+		uint32_t active = 0;
+
+		for (uint32_t i = 0; i < ft->size; i++) {
+			if (!ft->records[i].in_use)
+				continue;
+			active++;
+			if (flow_export_file != NULL)
+				flow_export_write(&ft->records[i], "active");
+		}
+		printf("Flows %u: %u active\t %llu created\t %llu expired\t %llu table full\t"
+			" %llu not IPv4\t %llu export drops\t %.1f cycles/pkt\n", q, active, ft->created,
+			ft->expired, ft->table_full, ft->untracked, ft->export_drops,
+			*args[q].count ? (double)args[q].flow_tsc / *args[q].count : 0.0);
+	}
+	if (flow_export_file != NULL && flow_export_file != stdout)
+		fclose(flow_export_file);
+}
+
+// Функция инициализации портов пересылки из маски и выбора пар: соседние порты маски
+// пересылают пакеты друг другу, единственный порт возвращает пакеты в себя.
+// Возвращает количество портов.
+static uint16_t
+setup_forward_ports(uint16_t* ports) {
+	uint16_t nb = 0;
+	uint16_t port;
+
+	RTE_ETH_FOREACH_DEV(port) {
+		if (opt_portmask && !(opt_portmask & (1ULL << port)))
+			continue;
+		// Первый порт пересылки считается основным (статистика, RETA).
+		if (nb == 0)
+			opt_port_id = port;
+		if (port_init(port) != 0)
+			rte_exit(EXIT_FAILURE, "Error: сannot init port %"PRIu16 "\n", port);
+		port_pools[port] = mbuf_pools;
+		rte_eth_macaddr_get(port, &port_macs[port]);
+		ports[nb++] = port;
+	}
+
+	if (nb == 0 || (nb > 1 && nb % 2))
+		rte_exit(EXIT_FAILURE, "Error: forwarding needs one port or an even number of ports\n");
+	for (uint16_t i = 0; i < nb; i++)
+		fwd_dst_port[ports[i]] = nb == 1 ? ports[i] : ports[i ^ 1];
+	return nb;
+}
+
+// Функция создания буферов отправки ядер пересылки на их NUMA узлах.
+// Ядро `i` принимает из очереди i % opt_queue_count порта ports[i / opt_queue_count].
+static void
+setup_forward(struct thread_args* args, const uint16_t* ports, int nb_threads) {
+	for (int i = 0; i < nb_threads; i++) {
+		args[i].tx_port = fwd_dst_port[ports[i / opt_queue_count]];
+		args[i].tx_buffer = rte_zmalloc_socket("tx_buffer", RTE_ETH_TX_BUFFER_SIZE(BURST_SIZE),
+			RTE_CACHE_LINE_SIZE, rte_lcore_to_socket_id(args[i].lcore_id));
+		if (args[i].tx_buffer == NULL)
+			rte_exit(EXIT_FAILURE, "Error: cannot allocate tx buffer\n");
+		// Подробнее: https://doc.dpdk.org/api/rte__ethdev_8h.html
+		rte_eth_tx_buffer_init(args[i].tx_buffer, BURST_SIZE);
+		rte_eth_tx_buffer_set_err_callback(args[i].tx_buffer, rte_eth_tx_buffer_count_callback,
+			&args[i].tx_dropped);
+	}
+}
+
+// Функция вывода отброшенных при пересылке пакетов по портам отправки.
+static void
+print_forward_report(struct thread_args* args, const uint16_t* ports, uint16_t nb_ports, int nb_threads) {
+	for (uint16_t p = 0; p < nb_ports; p++) {
+		uint64_t forwarded = 0, dropped = 0;
+
+		for (int i = 0; i < nb_threads; i++) {
+			if (args[i].tx_port != ports[p])
+				continue;
+			forwarded += *args[i].count;
+			dropped += args[i].tx_dropped;
+		}
+		printf("Port %u: %llu forwarded to it\t %llu dropped (TX ring full)\n", ports[p],
+			forwarded - dropped, dropped);
+	}
+}
+
+// Функция включения управления энергопотреблением `rte_power` для очередей ядер приёма.
+// Очередь должна быть остановлена, поэтому порты перезапускаются.
+// Подробнее: https://doc.dpdk.org/guides/prog_guide/power_man.html
+static void
+setup_idle_pmd(struct thread_args* args, int nb_threads) {
+	static const enum rte_power_pmd_mgmt_type types[] = {
+		[IDLE_MONITOR] = RTE_POWER_MGMT_TYPE_MONITOR,
+		[IDLE_PAUSE] = RTE_POWER_MGMT_TYPE_PAUSE,
+		[IDLE_SCALE] = RTE_POWER_MGMT_TYPE_SCALE,
+	};
+	bool stopped[RTE_MAX_ETHPORTS] = { false };
+
+	for (int i = 0; i < nb_threads; i++) {
+		if (args[i].idle != opt_idle || stopped[args[i].port])
+			continue;
+		rte_eth_dev_stop(args[i].port);
+		stopped[args[i].port] = true;
+	}
+
+	for (int i = 0; i < nb_threads; i++) {
+		int ret;
+
+		if (args[i].idle != opt_idle)
+			continue;
+		// Изменение частоты требует инициализации `rte_power` для ядра.
+		// Подробнее: https://doc.dpdk.org/api/rte__power__pmd__mgmt_8h.html
+		if (opt_idle == IDLE_SCALE && rte_power_init(args[i].lcore_id) != 0)
+			printf("Warning: cannot init frequency scaling on lcore %u\n", args[i].lcore_id);
+		ret = rte_power_ethdev_pmgmt_queue_enable(args[i].lcore_id, args[i].port, args[i].queue,
+			types[opt_idle]);
+		if (ret != 0) {
+			printf("Warning: %s power management unavailable on port %u queue %u: %s\n",
+				idle_names[opt_idle], args[i].port, args[i].queue, strerror(-ret));
+			if (opt_idle == IDLE_SCALE)
+				rte_power_exit(args[i].lcore_id);
+			args[i].idle = IDLE_SPIN;
+		}
+	}
+
+	for (uint16_t port = 0; port < RTE_MAX_ETHPORTS; port++)
+		if (stopped[port] && rte_eth_dev_start(port) < 0)
+			rte_exit(EXIT_FAILURE, "Error: cannot restart port %u\n", port);
+}
+
+// Функция отключения управления энергопотреблением, включённого setup_idle_pmd():
+// очереди отключаются на остановленных портах, а ядрам возвращается исходная частота.
+// Подробнее: https://doc.dpdk.org/api/rte__power__pmd__mgmt_8h.html
+static void
+teardown_idle_pmd(struct thread_args* args, int nb_threads) {
+	bool stopped[RTE_MAX_ETHPORTS] = { false };
+
+	for (int i = 0; i < nb_threads; i++) {
+		if (args[i].idle != opt_idle || stopped[args[i].port])
+			continue;
+		rte_eth_dev_stop(args[i].port);
+		stopped[args[i].port] = true;
+	}
+
+	for (int i = 0; i < nb_threads; i++) {
+		if (args[i].idle != opt_idle)
+			continue;
+		if (rte_power_ethdev_pmgmt_queue_disable(args[i].lcore_id, args[i].port, args[i].queue) != 0)
+			printf("Warning: cannot disable power management on port %u queue %u\n",
+				args[i].port, args[i].queue);
+		if (opt_idle == IDLE_SCALE)
+			rte_power_exit(args[i].lcore_id);
+	}
+}
+
+// Функция остановки программного eventdev и его планировщика.
+static void
+stop_eventdev(void) {
+	rte_event_dev_stop(event_dev_id);
+	rte_service_lcore_stop(event_service_lcore);
+	rte_event_dev_close(event_dev_id);
+}
+
+// Потоки, счётчики которых отдаются через `rte_telemetry`.
+static struct thread_args* tel_args;
+static int tel_nb_threads;
+
+// Обработчик команды `rte_telemetry` /test_dpdk/stats: скорости порта и счётчики потоков.
+// Запрос из dpdk-telemetry.py выполняется в служебном потоке EAL, поэтому счётчики
+// читаются без синхронизации и могут отставать на один блок пакетов.
+// Счётчики порта доступны встроенными командами /ethdev/stats и /ethdev/xstats.
+// Подробнее: https://doc.dpdk.org/guides/howto/telemetry.html
+static int
+telemetry_stats(const char* cmd, const char* params, struct rte_tel_data* d) {
+	struct rte_tel_data* counts = rte_tel_data_alloc();
+	struct rte_tel_data* pools = rte_tel_data_alloc();
+	uint64_t drops = 0, alloc_fail = 0, tx_partial = 0, reorders = 0;
+
+	if (counts == NULL || pools == NULL) {
+		rte_tel_data_free(counts);
+		rte_tel_data_free(pools);
+		return -ENOMEM;
+	}
+
+	rte_tel_data_start_dict(d);
+	rte_tel_data_add_dict_uint(d, "rx_pps", port_rates.rx_pps);
+	rte_tel_data_add_dict_uint(d, "tx_pps", port_rates.tx_pps);
+	rte_tel_data_add_dict_uint(d, "rx_bps", port_rates.rx_bps);
+	rte_tel_data_add_dict_uint(d, "tx_bps", port_rates.tx_bps);
+	rte_tel_data_add_dict_uint(d, "missed_pps", port_rates.missed_pps);
+
+	rte_tel_data_start_array(counts, RTE_TEL_UINT_VAL);
+	for (int i = 0; i < tel_nb_threads; i++) {
+		rte_tel_data_add_array_uint(counts, *tel_args[i].count);
+		drops += tel_args[i].ring_drops;
+		alloc_fail += tel_args[i].alloc_fail;
+		tx_partial += tel_args[i].tx_partial;
+		reorders += tel_args[i].reorders;
+	}
+	rte_tel_data_add_dict_uint(d, "ring_drops", drops);
+	rte_tel_data_add_dict_uint(d, "alloc_fail", alloc_fail);
+	rte_tel_data_add_dict_uint(d, "tx_partial", tx_partial);
+	rte_tel_data_add_dict_uint(d, "reorders", reorders);
+	rte_tel_data_add_dict_container(d, "thread_count", counts, 0);
+
+	// Занятые mbuf пулов очередей, включая кэши ядер и кольца драйвера.
+	rte_tel_data_start_array(pools, RTE_TEL_UINT_VAL);
+	for (uint16_t q = 0; q < opt_queue_count; q++)
+		rte_tel_data_add_array_uint(pools, rte_mempool_in_use_count(mbuf_pools[q]));
+	rte_tel_data_add_dict_container(d, "pool_in_use", pools, 0);
+	return 0;
+}
+
+// Функция вывода счётчиков порта, его очередей и изменившихся расширенных счётчиков
+// за интервал `sec`. Предыдущие значения хранятся в `prev`, расширенных счётчиков - в функции.
+// Подробнее: https://doc.dpdk.org/guides/prog_guide/ethdev/ethdev.html
+static void
+print_port_stats(uint16_t port, struct rte_eth_stats* prev, double sec, bool print) {
+	static struct rte_eth_xstat_name* names;
+	static struct rte_eth_xstat* xstats;
+	static uint64_t* prev_xstats;
+	static int nb_names;
+	struct rte_eth_stats stats;
+	uint16_t nb_queues = RTE_MIN(opt_queue_count, RTE_ETHDEV_QUEUE_STAT_CNTRS);
+	int nb_xstats;
+
+	// Имена расширенных счётчиков не меняются, поэтому читаются один раз.
+	// Массивы выделяются по их полному количеству, которое возвращает запрос без массива.
+	if (names == NULL) {
+		nb_names = rte_eth_xstats_get_names(port, NULL, 0);
+		if (nb_names > 0) {
+			names = calloc(nb_names, sizeof(*names));
+			xstats = calloc(nb_names, sizeof(*xstats));
+			prev_xstats = calloc(nb_names, sizeof(*prev_xstats));
+		}
+		if (names == NULL || xstats == NULL || prev_xstats == NULL ||
+				rte_eth_xstats_get_names(port, names, nb_names) != nb_names)
+			nb_names = 0;
+	}
+
+	// Подробнее: https://doc.dpdk.org/api/rte__ethdev_8h.html
+	if (rte_eth_stats_get(port, &stats) != 0)
+		return;
+
+	port_rates.rx_pps = (stats.ipackets - prev->ipackets) / sec;
+	port_rates.tx_pps = (stats.opackets - prev->opackets) / sec;
+	port_rates.rx_bps = (stats.ibytes - prev->ibytes) * 8 / sec;
+	port_rates.tx_bps = (stats.obytes - prev->obytes) * 8 / sec;
+	port_rates.missed_pps = (stats.imissed - prev->imissed) / sec;
+
+	if (print) {
+		pthread_mutex_lock(&mutex);
+		printf("Port %u: rx %"PRIu64" pps %.2f Mbps\t tx %"PRIu64" pps %.2f Mbps\t"
+			" imissed %"PRIu64" (%"PRIu64"/s)\t ierrors %"PRIu64"\t oerrors %"PRIu64"\t rx_nombuf %"PRIu64"\n",
+			port, port_rates.rx_pps, port_rates.rx_bps / 1e6, port_rates.tx_pps, port_rates.tx_bps / 1e6,
+			stats.imissed, port_rates.missed_pps, stats.ierrors, stats.oerrors, stats.rx_nombuf);
+		// Счётчики очередей заполняются не всеми драйверами и только для первых очередей.
+		for (uint16_t q = 0; q < nb_queues; q++)
+			printf("  queue %u: rx %.0f pps\t tx %.0f pps\t errors %"PRIu64"\n", q,
+				(stats.q_ipackets[q] - prev->q_ipackets[q]) / sec,
+				(stats.q_opackets[q] - prev->q_opackets[q]) / sec, stats.q_errors[q]);
+	}
+	*prev = stats;
+
+	// Значение больше nb_names - требуемый размер массива, который в этом случае не заполняется.
+	nb_xstats = rte_eth_xstats_get(port, xstats, nb_names);
+	if (nb_xstats > nb_names)
+		nb_xstats = 0;
+	for (int i = 0; i < nb_xstats; i++) {
+		if (print && xstats[i].value != prev_xstats[i])
+			printf("  %s: %"PRIu64" (%.0f/s)\n", names[i].name, xstats[i].value,
+				(xstats[i].value - prev_xstats[i]) / sec);
+		prev_xstats[i] = xstats[i].value;
+	}
+	if (print)
+		pthread_mutex_unlock(&mutex);
+}
+
+// Функция перераспределения RSS по нагрузке очередей за последний интервал.
+// Нагрузка записи RETA - количество принятых по ней пакетов на всех ядрах приёма.
+// Если самая загруженная очередь превышает среднюю в opt_rebalance раз, её записи
+// переносятся в наименее загруженную очередь, пока перенос уменьшает разницу.
+// Перенос меняет очередь потоков записи, поэтому выполняется не более RETA_MAX_MOVES раз.
+// Подробнее: https://doc.dpdk.org/api/rte__ethdev_8h.html
+static void
+rebalance_reta(uint16_t port, struct thread_args* args, uint64_t* prev_hits) {
+	// Таблица и нагрузка её записей размещаются по размеру RETA устройства (может превышать 512):
+	// запрос и обновление с другим размером драйвер отклоняет.
+	static struct rte_eth_rss_reta_entry64* reta;
+	static uint64_t* load;
+	uint64_t qload[RTE_MAX_QUEUES_PER_PORT] = { 0 };
+	uint64_t total = 0;
+	unsigned moves = 0;
+	uint16_t hot = 0, cold = 0;
+
+	if (reta == NULL) {
+		reta = calloc(reta_size / RTE_ETH_RETA_GROUP_SIZE, sizeof(*reta));
+		load = calloc(reta_size, sizeof(*load));
+		if (reta == NULL || load == NULL) {
+			free(reta);
+			free(load);
+			reta = NULL;
+			return;
+		}
+	}
+
+	memset(reta, 0, reta_size / RTE_ETH_RETA_GROUP_SIZE * sizeof(*reta));
+	for (uint16_t g = 0; g < reta_size / RTE_ETH_RETA_GROUP_SIZE; g++)
+		reta[g].mask = UINT64_MAX;
+	if (rte_eth_dev_rss_reta_query(port, reta, reta_size) != 0)
+		return;
+
+	for (uint16_t e = 0; e < reta_size; e++) {
+		uint64_t hits = 0;
+		uint16_t q = reta[e / RTE_ETH_RETA_GROUP_SIZE].reta[e % RTE_ETH_RETA_GROUP_SIZE];
+
+		for (uint16_t rx = 0; rx < opt_queue_count; rx++)
+			hits += args[rx].reta_hits[e];
+		load[e] = hits - prev_hits[e];
+		prev_hits[e] = hits;
+		if (q < opt_queue_count)
+			qload[q] += load[e];
+		total += load[e];
+	}
+	if (total == 0)
+		return;
+
+	for (uint16_t q = 0; q < opt_queue_count; q++)
+		if (qload[q] > qload[hot])
+			hot = q;
+	if (qload[hot] < opt_rebalance * total / opt_queue_count)
+		return;
+
+	for (uint16_t g = 0; g < reta_size / RTE_ETH_RETA_GROUP_SIZE; g++)
+		reta[g].mask = 0;
+
+	while (moves < RETA_MAX_MOVES) {
+		int best = -1;
+
+		for (uint16_t q = 0; q < opt_queue_count; q++) {
+			if (qload[q] > qload[hot])
+				hot = q;
+			if (qload[q] < qload[cold])
+				cold = q;
+		}
+		// Перенос записи с нагрузкой меньше разницы уменьшает нагрузку самой загруженной очереди.
+		for (uint16_t e = 0; e < reta_size; e++)
+			if (reta[e / RTE_ETH_RETA_GROUP_SIZE].reta[e % RTE_ETH_RETA_GROUP_SIZE] == hot &&
+					load[e] > 0 && load[e] < qload[hot] - qload[cold] &&
+					(best < 0 || load[e] > load[best]))
+				best = e;
+		if (best < 0)
+			break;
+
+		reta[best / RTE_ETH_RETA_GROUP_SIZE].reta[best % RTE_ETH_RETA_GROUP_SIZE] = cold;
+		reta[best / RTE_ETH_RETA_GROUP_SIZE].mask |= 1ULL << (best % RTE_ETH_RETA_GROUP_SIZE);
+		qload[hot] -= load[best];
+		qload[cold] += load[best];
+		moves++;
+	}
+
+	if (moves && rte_eth_dev_rss_reta_update(port, reta, reta_size) == 0) {
+		pthread_mutex_lock(&mutex);
+		printf("Port %u: RETA rebalanced, %u entries moved, busiest queue %u now %.0f%% of average\n",
+			port, moves, hot, 100.0 * qload[hot] * opt_queue_count / total);
+		pthread_mutex_unlock(&mutex);
+	}
+}
+
+// Функция периодического чтения статистики порта на главном ядре до завершения потоков.
+// Скорости обновляются каждую секунду для `rte_telemetry`, вывод - раз в opt_stats_interval секунд.
+static void
+stats_loop(uint16_t port, struct thread_args* args) {
+	struct rte_eth_stats prev;
+	uint64_t* prev_hits = calloc(RTE_MAX(reta_size, 1), sizeof(uint64_t));
+	uint64_t last = get_current_tsc();
+	unsigned ticks = 0;
+
+	rte_eth_stats_get(port, &prev);
+	while (__atomic_load_n(&threads_running, __ATOMIC_ACQUIRE) > 0) {
+		uint64_t now;
+
+		rte_delay_ms(100);
+		now = get_current_tsc();
+		if (now - last < tsc_hz)
+			continue;
+
+		ticks++;
+		print_port_stats(port, &prev, (double)(now - last) / tsc_hz,
+			opt_stats_interval && ticks % opt_stats_interval == 0);
+		// Заполненность пулов и кэшей ядер читается без синхронизации с ядрами.
+		if (opt_stats_interval && ticks % opt_stats_interval == 0) {
+			pthread_mutex_lock(&mutex);
+			for (uint16_t q = 0; q < opt_queue_count; q++)
+				print_pool_stats(q, args[q].lcore_id);
+			pthread_mutex_unlock(&mutex);
+		}
+		if (args[0].reta_hits != NULL)
+			rebalance_reta(port, args, prev_hits);
+		flow_export_drain();
+		last = now;
+	}
+	free(prev_hits);
+}
+
+// Функция учёта потока, который не удалось запустить: счётчики работающих ядер
+// уменьшаются так же, как при завершении потока, чтобы его не ждали другие ядра
+// и цикл статистики главного ядра.
+static void
+thread_not_started(struct thread_args* args) {
+	if (args->role == ROLE_TX)
+		__atomic_fetch_sub(&tx_running, 1, __ATOMIC_RELEASE);
+	else if (args->role == ROLE_IO && (opt_mode == MODE_PIPELINE || opt_mode == MODE_EVENTDEV ||
+			(opt_mode == MODE_RXONLY && opt_pcapng_path != NULL)))
+		__atomic_fetch_sub(&rx_running, 1, __ATOMIC_RELEASE);
+	__atomic_fetch_sub(&threads_running, 1, __ATOMIC_RELEASE);
+}
+
+// Обработка сигналов SIGINT (завершение) и SIGUSR1 (переключение GRO).
+static void
+signal_handler(int signum) {
+	if (signum == SIGINT) {
+		printf("\n\nSignal %d received, preparing to exit...\n", signum);
+		work_done = true;
+	} else if (signum == SIGUSR1) {
+		gro_enabled = !gro_enabled;
+		printf("GRO %s\n", gro_enabled ? "enabled" : "disabled");
+	}
+}
+
+static struct option long_options[] = {
+	{"rxonly", no_argument, 0, 'r'},
+	{"txonly", no_argument, 0, 't'},
+	{"port", required_argument, 0, 'p'},
+	{"queue_count", required_argument, 0, 'q'},
+	{"tx-pkt-count", required_argument, 0, 'C'},
+	{"pipeline", no_argument, 0, 'P'},
+	{"workers", required_argument, 0, 'w'},
+	{"eventdev", no_argument, 0, 'E'},
+	{"classify", required_argument, 0, 'c'},
+	{"acl-rules", required_argument, 0, 'a'},
+	{"stats", required_argument, 0, 's'},
+	{"latency", no_argument, 0, 'L'},
+	{"tx-port", required_argument, 0, 'T'},
+	{"pcapng", required_argument, 0, 'o'},
+	{"rebalance", required_argument, 0, 'B'},
+	{"forward", no_argument, 0, 'F'},
+	{"portmask", required_argument, 0, 'm'},
+	{"mac-rewrite", no_argument, 0, 'M'},
+	{"idle", required_argument, 0, 'i'},
+	{"gro", no_argument, 0, 'G'},
+	{"mtu", required_argument, 0, 'u'},
+	{"buffers", required_argument, 0, 'b'},
+	{"tx-size", required_argument, 0, 'z'},
+	{"flows", required_argument, 0, 'f'},
+	{"flow-timeout", required_argument, 0, 'x'},
+	{"flow-export", required_argument, 0, 'X'},
+	{"snaplen", required_argument, 0, 'S'},
+	{"rotate-size", required_argument, 0, 'R'},
+	{"rotate-time", required_argument, 0, 'I'},
+	{"help", no_argument, 0, 'h'},
+	{0, 0, 0, 0}
+};
+
+static void
+usage(const char* prog) {
+	const char* str =
+		"  Usage: %s [OPTIONS]\n"
+		"  Options:\n"
+		"  -r, --rxonly		Print all incoming packets (default).\n"
+		"  -t, --txonly		Only send packets.\n"
+		"  -p, --port=<INDEX>	Run on port.\n"
+		"  -q, --queues=n	Use n queues (default 1).\n"
+		"  -C, --tx-pkt-count=n	Number of packets to send.\n"
+		"			Default: Continuous packets.\n"
+		"  -P, --pipeline		Receive on one lcore per queue and hand packets over\n"
+		"			rte_ring to worker lcores by flow hash.\n"
+		"  -E, --eventdev	Schedule flows to worker lcores through the software\n"
+		"			eventdev (atomic queue) and restore per-flow order on a\n"
+		"			final lcore. Uses one more lcore for the scheduler.\n"
+		"  -c, --classify=acl|scalar	Print only packets matching the src/bpf/filter.c rules,\n"
+		"			classified per burst with rte_acl or per packet\n"
+		"			with check_filter().\n"
+		"  -a, --acl-rules=<FILE>	Additional rules for -c acl, one per line:\n"
+		"			tcp|udp <src> <dst> [<flags>/<mask>]\n"
+		"			where <src> and <dst> are *, <port> or <lo>-<hi>.\n"
+		"  -w, --workers=n	Number of worker lcores for --pipeline and --eventdev\n"
+		"			(default 1).\n"
+		"  -L, --latency		Send UDP packets with a TSC timestamp and sequence number\n"
+		"			from one lcore per queue and measure one-way latency,\n"
+		"			jitter, loss and reordering on the receiving lcores.\n"
+		"			Sender and receiver must run on the same host, e.g.:\n"
+		"			--vdev=net_af_packet0,iface=veth0 --vdev=net_af_packet1,iface=veth1\n"
+		"			-- -L -p 1 -T 0\n"
+		"  -T, --tx-port=<INDEX>	Send latency packets on this port (default: --port).\n"
+		"  -o, --pcapng=<FILE>	Write received packets to a pcapng file from a dedicated\n"
+		"			writer lcore instead of printing them.\n"
+		"  -S, --snaplen=n	Save at most n bytes of each packet (default: MTU plus\n"
+		"			Ethernet header).\n"
+		"  -R, --rotate-size=MB	Start a new file <FILE>.<n> after MB megabytes.\n"
+		"  -I, --rotate-time=SEC	Start a new file <FILE>.<n> after SEC seconds.\n"
+		"  -B, --rebalance=RATIO	Move RSS redirection table entries away from a queue\n"
+		"			receiving more than RATIO times the average load\n"
+		"			(checked every second, e.g. 1.5).\n"
+		"  -F, --forward		Forward packets between pairs of ports on one lcore per\n"
+		"			port and queue. Works with vdevs, e.g.:\n"
+		"			--vdev=net_ring0 --vdev=net_ring1 -- -F\n"
+		"  -m, --portmask=MASK	Hex mask of ports to forward between (default: all).\n"
+		"  -M, --mac-rewrite	Set source MAC to the TX port address and destination\n"
+		"			MAC to 02:00:00:00:00:<TX port>.\n"
+		"  -i, --idle=POLICY	Idle behaviour of receiving lcores: spin (default),\n"
+		"			monitor, pause or scale (rte_power PMD management),\n"
+		"			interrupt (Rx interrupts and epoll) or sleep (backoff).\n"
+		"  -G, --gro		Merge TCP/IPv4 and VXLAN TCP/IPv4 segments of each burst\n"
+		"			before processing. SIGUSR1 toggles GRO at runtime.\n"
+		"  -u, --mtu=n		Port MTU (default 1500, up to the device maximum).\n"
+		"  -b, --buffers=chain|large	Frames larger than a default mbuf are received into\n"
+		"			chains of 2 KB segments (scattered RX, default) or\n"
+		"			into one mbuf sized for the whole frame.\n"
+		"  -z, --tx-size=n	Size of sent packets in bytes (default 74). With\n"
+		"			--buffers=chain larger packets are sent as segment chains.\n"
+		"  -f, --flows=n		Track up to n IPv4 flows per receiving lcore.\n"
+		"  -x, --flow-timeout=SEC	Expire flows idle for SEC seconds (default 30).\n"
+		"  -X, --flow-export=<FILE>	Write expired flows as CSV ('-' for stdout).\n"
+		"  -s, --stats=SEC	Print port, queue and changed extended counters\n"
+		"			every SEC seconds. Rates and thread counters are also\n"
+		"			available as /test_dpdk/stats in dpdk-telemetry.py.\n"
+		"  -h, --help	Print this help.\n"
+		"\n";
+	fprintf(stderr, str, prog);
+
+	exit(EXIT_FAILURE);
+}
+
+// Функция парсинга аргументов командной строки.
+static void
+parse_command_line(int argc, char** argv) {
+	int option_index, c;
+	opterr = 0;
+
+	for (;;) {
+		c = getopt_long(argc, argv, "rtp:q:C:PEw:c:a:s:LT:o:S:R:I:B:f:x:X:Fm:Mi:Gu:b:z:h", long_options, &option_index);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'r':
+			opt_mode = MODE_RXONLY;
+			break;
+		case 't':
+			opt_mode = MODE_TXONLY;
+			break;
+		case 'P':
+			opt_mode = MODE_PIPELINE;
+			break;
+		case 'E':
+			opt_mode = MODE_EVENTDEV;
+			break;
+		case 'L':
+			opt_mode = MODE_LATENCY;
+			break;
+		case 'T':
+			opt_tx_port_id = (uint16_t)atoi(optarg);
+			opt_tx_port_set = true;
+			break;
+		case 'c':
+			if (!strcmp(optarg, "acl"))
+				opt_classify = CLASSIFY_ACL;
+			else if (!strcmp(optarg, "scalar"))
+				opt_classify = CLASSIFY_SCALAR;
+			else
+				usage(argv[0]);
+			break;
+		case 'a':
+			opt_acl_rules = optarg;
+			break;
+		case 's':
+			opt_stats_interval = atoi(optarg);
+			break;
+		case 'o':
+			opt_pcapng_path = optarg;
+			break;
+		case 'F':
+			opt_mode = MODE_FORWARD;
+			break;
+		case 'm':
+			opt_portmask = strtoull(optarg, NULL, 16);
+			break;
+		case 'M':
+			opt_mac_rewrite = true;
+			break;
+		case 'i':
+			for (c = 0; c < (int)RTE_DIM(idle_names); c++)
+				if (!strcmp(optarg, idle_names[c]))
+					break;
+			if (c == (int)RTE_DIM(idle_names))
+				usage(argv[0]);
+			opt_idle = c;
+			break;
+		case 'G':
+			opt_gro = true;
+			break;
+		case 'u':
+			opt_mtu = (uint16_t)atoi(optarg);
+			break;
+		case 'b':
+			if (!strcmp(optarg, "chain"))
+				opt_buffers = BUFFERS_CHAIN;
+			else if (!strcmp(optarg, "large"))
+				opt_buffers = BUFFERS_LARGE;
+			else
+				usage(argv[0]);
+			break;
+		case 'z':
+			opt_tx_size = (uint16_t)atoi(optarg);
+			break;
+		case 'f':
+			opt_flows = (uint32_t)atoi(optarg);
+			break;
+		case 'x':
+			opt_flow_timeout = atoi(optarg);
+			break;
+		case 'X':
+			opt_flow_export = optarg;
+			break;
+		case 'B':
+			opt_rebalance = atof(optarg);
+			if (opt_rebalance < 1)
+				usage(argv[0]);
+			break;
+		case 'S':
+			opt_snaplen = strtoul(optarg, NULL, 10);
+			if (opt_snaplen == 0)
+				usage(argv[0]);
+			break;
+		case 'R':
+			opt_rotate_mb = (uint64_t)atoll(optarg);
+			break;
+		case 'I':
+			opt_rotate_sec = atoi(optarg);
+			break;
+		case 'w':
+			opt_workers = (uint16_t)atoi(optarg);
+			if (opt_workers == 0 || opt_workers > MAX_WORKERS)
+				usage(argv[0]);
+			break;
+		case 'p':
+			opt_port_id = (uint16_t)atoi(optarg);
+			break;
+		case 'q':
+			opt_queue_count = (uint16_t)atoi(optarg);
+			break;
+		case 'C':
+			opt_tx_count = (uint64_t)atoll(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+}
+
+int
+main(int argc, char *argv[]) {
+	unsigned nb_ports;
+
+	pthread_mutex_init(&mutex, NULL);
+
+	// Инициализация подсистемы EAL (Environment Abstraction Layer).
+	// Подробнее: https://doc.dpdk.org/api/rte__eal_8h.html#a5c3f4dddc25e38c5a186ecd8a69260e3
+	int ret = rte_eal_init(argc, argv);
+	if (ret < 0)
+		rte_exit(EXIT_FAILURE, "Error: EAL initialization failed\n");
+
+	// Обработка параметров.
+	argc -= ret;
+	argv += ret;
+
+	parse_command_line(argc, argv);
+	setup_buffers();
+
+	// Классификация выполняется только ядрами захвата.
+	if (opt_classify != CLASSIFY_NONE && opt_mode != MODE_RXONLY)
+		rte_exit(EXIT_FAILURE, "Error: --classify works only with --rxonly\n");
+	if (opt_acl_rules != NULL && opt_classify != CLASSIFY_ACL)
+		rte_exit(EXIT_FAILURE, "Error: --acl-rules requires --classify=acl\n");
+
+	signal(SIGINT, signal_handler);
+	signal(SIGUSR1, signal_handler);
+
+	tsc_hz = rte_get_tsc_hz();
+	tsc_start = get_current_tsc();
+
+	// Получение количества доступных сетевых интерфейсов.
+	// Подробнее: https://doc.dpdk.org/api/rte__ethdev_8h.html#a9ab708089665bebcd65cefe5383b24f2
+	nb_ports = rte_eth_dev_count_avail();
+	if (opt_port_id >= nb_ports)
+		rte_exit(EXIT_FAILURE, "Error: unknown network port\n");
+
+	// Инициализация сетевого интерфейса или всех портов пересылки.
+	uint16_t fwd_ports[RTE_MAX_ETHPORTS];
+	uint16_t nb_fwd_ports = 0;
+	if (opt_mode == MODE_FORWARD) {
+		nb_fwd_ports = setup_forward_ports(fwd_ports);
+		mbuf_pools = port_pools[opt_port_id];
+	} else if (port_init(opt_port_id) != 0)
+		rte_exit(EXIT_FAILURE, "Error: сannot init port %"PRIu16 "\n", opt_port_id);
+
+	// Порт отправки пакетов измерения задержки настраивается отдельно,
+	// пулы порта приёма остаются пулами очередей захвата.
+	if (opt_mode == MODE_LATENCY && !opt_tx_port_set)
+		opt_tx_port_id = opt_port_id;
+	if (opt_mode == MODE_LATENCY && opt_tx_port_id != opt_port_id) {
+		struct rte_mempool** rx_pools = mbuf_pools;
+
+		if (opt_tx_port_id >= nb_ports || port_init(opt_tx_port_id) != 0)
+			rte_exit(EXIT_FAILURE, "Error: сannot init port %"PRIu16 "\n", opt_tx_port_id);
+		mbuf_pools = rx_pools;
+	}
+
+	unsigned int lcore_id;
+	int queue_id = 0;
+	// Ядра приёма/отправки (по одному на очередь), затем ядра обработки.
+	// В режиме eventdev добавляется завершающее ядро.
+	// В режиме измерения задержки на каждую очередь приходится ядро приёма и ядро отправки.
+	// При записи в файл добавляется ядро записи, при пересылке ядра очередей остальных портов.
+	int nb_threads = opt_queue_count + (opt_mode == MODE_PIPELINE ? opt_workers :
+		opt_mode == MODE_EVENTDEV ? opt_workers + 1 :
+		opt_mode == MODE_LATENCY ? opt_queue_count :
+		opt_mode == MODE_FORWARD ? opt_queue_count * (nb_fwd_ports - 1) :
+		opt_pcapng_path != NULL ? 1 : 0);
+	struct thread_args* args = calloc(nb_threads, sizeof(struct thread_args));
+	uint64_t* counts = calloc(nb_threads, sizeof(uint64_t));
+
+	// Назначение ядер заранее, чтобы кольца конвейера создавались на NUMA узле ядра обработки.
+	queue_id = 0;
+	RTE_LCORE_FOREACH_WORKER(lcore_id) {
+		if (queue_id > nb_threads) break;
+		// Следующее свободное ядро занимает планировщик eventdev.
+		if (queue_id == nb_threads)
+			event_service_lcore = lcore_id;
+		else
+			args[queue_id].lcore_id = lcore_id;
+		queue_id++;
+	}
+	if (queue_id < nb_threads || (opt_mode == MODE_EVENTDEV && queue_id <= nb_threads))
+		rte_exit(EXIT_FAILURE, "Error: %d worker lcores required\n",
+			nb_threads + (opt_mode == MODE_EVENTDEV));
+
+	for (int i = 0; i < nb_threads; i++)
+		args[i].role = i < opt_queue_count || opt_mode == MODE_FORWARD ? ROLE_IO :
+			opt_mode == MODE_LATENCY ? ROLE_TX :
+			opt_mode == MODE_RXONLY ? ROLE_WRITER :
+			i < opt_queue_count + opt_workers ? ROLE_WORKER : ROLE_SINK;
+
+	if (opt_classify == CLASSIFY_ACL) {
+		setup_acl(rte_eth_dev_socket_id(opt_port_id));
+		acl_self_check();
+	}
+
+	if (opt_mode == MODE_PIPELINE)
+		setup_pipeline(args);
+	else if (opt_mode == MODE_EVENTDEV)
+		setup_eventdev(args, nb_threads);
+	else if (opt_mode == MODE_LATENCY)
+		setup_latency(args);
+	else if (opt_mode == MODE_RXONLY && opt_pcapng_path != NULL)
+		setup_pcapng(args, nb_threads);
+	else if (opt_mode == MODE_FORWARD)
+		setup_forward(args, fwd_ports, nb_threads);
+
+	if (opt_mode == MODE_RXONLY && opt_flows > 0)
+		setup_flows(args);
+
+	// Счётчики записей RETA на NUMA узлах ядер приёма.
+	// Записи RETA запрашиваются и обновляются группами по RTE_ETH_RETA_GROUP_SIZE.
+	if (opt_rebalance > 0 && reta_size >= RTE_ETH_RETA_GROUP_SIZE &&
+			reta_size % RTE_ETH_RETA_GROUP_SIZE == 0 && opt_queue_count > 1) {
+		for (uint16_t q = 0; q < opt_queue_count; q++) {
+			args[q].reta_hits = rte_zmalloc_socket("reta_hits", reta_size * sizeof(uint64_t),
+				RTE_CACHE_LINE_SIZE, rte_lcore_to_socket_id(args[q].lcore_id));
+			if (args[q].reta_hits == NULL)
+				rte_exit(EXIT_FAILURE, "Error: cannot allocate RETA counters\n");
+		}
+	} else if (opt_rebalance > 0) {
+		printf("Warning: RSS rebalancing needs RSS, a RETA of whole %u-entry groups and more than one queue\n",
+			RTE_ETH_RETA_GROUP_SIZE);
+	}
+
+	// Регистрация счётчиков приложения в `rte_telemetry` (сокет /var/run/dpdk/*/dpdk_telemetry.v2).
+	// Подробнее: https://doc.dpdk.org/api/rte__telemetry_8h.html
+	tel_args = args;
+	tel_nb_threads = nb_threads;
+	if (rte_telemetry_register_cmd("/test_dpdk/stats", telemetry_stats,
+			"Returns port rates and application counters. No parameters") != 0)
+		printf("Warning: cannot register telemetry command\n");
+	threads_running = nb_threads;
+	gro_enabled = opt_gro;
+
+	// Цикл по доступным «дополнительным» ядрам.
+	// Функция main исполняется на отдельном ядре.
+	for (queue_id = 0; queue_id < nb_threads; queue_id++) {
+		args[queue_id].mbuf_pool = mbuf_pools[queue_id % opt_queue_count];
+		args[queue_id].port = opt_port_id;
+		args[queue_id].queue = queue_id;
+		args[queue_id].mode = opt_mode;
+		args[queue_id].count = &counts[queue_id];
+		args[queue_id].rule_hits = calloc(ACL_MAX_RULES, sizeof(uint64_t));
+		counts[queue_id] = 0;
+		if (args[queue_id].role == ROLE_TX) {
+			args[queue_id].queue = queue_id - opt_queue_count;
+			args[queue_id].port = opt_tx_port_id;
+			args[queue_id].mbuf_pool = latency_pools[args[queue_id].queue];
+		}
+		if (opt_mode == MODE_FORWARD) {
+			args[queue_id].port = fwd_ports[queue_id / opt_queue_count];
+			args[queue_id].queue = queue_id % opt_queue_count;
+			args[queue_id].mbuf_pool = port_pools[args[queue_id].port][args[queue_id].queue];
+		}
+		// Параметры облегчённого режима GRO: таблицы потоков rte_gro_reassemble_burst()
+		// создаёт на стеке при каждом вызове, поэтому NUMA узел (socket_id) не используется.
+		// Подробнее: https://doc.dpdk.org/guides/prog_guide/generic_receive_offload_lib.html
+		args[queue_id].gro_param = (struct rte_gro_param) {
+			.gro_types = RTE_GRO_TCP_IPV4 | RTE_GRO_IPV4_VXLAN_TCP_IPV4,
+			.max_flow_num = 32,
+			.max_item_per_flow = RTE_GRO_MAX_BURST_ITEM_NUM / 32,
+		};
+		// Политика ожидания применяется к ядрам, опрашивающим очередь RX.
+		if (args[queue_id].role == ROLE_IO && opt_mode != MODE_TXONLY)
+			args[queue_id].idle = opt_idle;
+	}
+
+	if (opt_idle >= IDLE_MONITOR && opt_idle <= IDLE_SCALE)
+		setup_idle_pmd(args, nb_threads);
+
+	for (queue_id = 0; queue_id < nb_threads; queue_id++) {
+		// Запуск отдельного потока исполнения на ядре `lcore_id`.
+		// Подробнее: https://doc.dpdk.org/api/rte__launch_8h.html#a2bf98eda211728b3dc69aa7694758c6d
+		ret = rte_eal_remote_launch((lcore_function_t *)lcore_main, &args[queue_id], args[queue_id].lcore_id);
+		if (ret != 0) {
+			// Без одного из потоков работа не имеет смысла: запущенные потоки завершаются.
+			printf("Error: cannot launch thread %d on lcore %u: %s\n", queue_id,
+				args[queue_id].lcore_id, strerror(-ret));
+			thread_not_started(&args[queue_id]);
+			work_done = true;
+		}
+	}
+
+	printf("Started %d threads\n", queue_id);
+
+	// Главное ядро не обрабатывает пакеты и читает статистику порта.
+	stats_loop(opt_port_id, args);
+
+	// Ожидание завершения потоков на всех «дополнительных» ядрах.
+	// Подробнее: https://doc.dpdk.org/api/rte__launch_8h.html
+	rte_eal_mp_wait_lcore();
+
+	if (opt_mode == MODE_EVENTDEV)
+		stop_eventdev();
+
+	// Пулы освобождаются вместе с памятью EAL, поэтому выводятся до её очистки.
+	struct rte_eth_stats stats;
+	for (int i = 0; i < opt_queue_count; ++i)
+		print_pool_stats(i, args[i].lcore_id);
+	if (rte_eth_stats_get(opt_port_id, &stats) == 0)
+		printf("Port %u: %llu rx_nombuf\t %llu imissed\t %llu ierrors\t %llu oerrors\n", opt_port_id,
+			stats.rx_nombuf, stats.imissed, stats.ierrors, stats.oerrors);
+	if (opt_mode == MODE_LATENCY)
+		print_latency_report(args, counts);
+	if (args[0].flows != NULL)
+		finish_flows(args);
+	if (opt_idle >= IDLE_MONITOR && opt_idle <= IDLE_SCALE)
+		teardown_idle_pmd(args, nb_threads);
+
+	// Очистка подсистемы EAL.
+	// Подробнее: https://doc.dpdk.org/api/rte__eal_8h.html#a7a745887f62a82dc83f1524e2ff2a236
+	rte_eal_cleanup();
+
+	uint64_t all_count = 0;
+	for (int i = 0; i < queue_id; ++i) {
+		double sec = (double)(args[i].end_tsc - args[i].start_tsc) / tsc_hz;
+
+		// В режиме конвейера итог считается по ядрам приёма.
+		static const char* role_names[] = { "Thread", "Worker", "Sink", "Sender", "Writer" };
+
+		if (args[i].role == ROLE_IO)
+			all_count += counts[i];
+		printf("%s %d: %llu\t %.0f pps", role_names[args[i].role], i, counts[i],
+			sec > 0 ? counts[i] / sec : 0.0);
+		// Скорость без преамбулы и CRC и среднее количество сегментов пакета.
+		if (args[i].segs)
+			printf("\t %.2f Gbit/s\t %.2f segs/pkt", sec > 0 ? args[i].bytes * 8 / sec / 1e9 : 0.0,
+				(double)args[i].segs / counts[i]);
+		if (opt_mode == MODE_TXONLY)
+			printf("\t %llu alloc failures\t %llu partial bursts", args[i].alloc_fail, args[i].tx_partial);
+		if (opt_mode == MODE_PIPELINE && args[i].role == ROLE_IO)
+			printf("\t %llu ring drops\t ring fill avg %.0f max %llu", args[i].ring_drops,
+				args[i].fill_samples ? (double)args[i].fill_sum / args[i].fill_samples : 0.0,
+				args[i].fill_max);
+		// Задержка этапа отсчитывается от приёма пакета.
+		if (opt_mode == MODE_EVENTDEV && args[i].role == ROLE_IO)
+			printf("\t %llu scheduler drops", args[i].ring_drops);
+		if (opt_mode == MODE_EVENTDEV && args[i].role != ROLE_IO)
+			printf("\t latency avg %.2f us max %.2f us",
+				counts[i] ? args[i].lat_sum * 1e6 / tsc_hz / counts[i] : 0.0,
+				args[i].lat_max * 1e6 / tsc_hz);
+		if (opt_mode == MODE_EVENTDEV && args[i].role == ROLE_SINK)
+			printf("\t %llu reordered", args[i].reorders);
+		// Доля времени без пакетов, из неё - в ожидании, и процессорное время потока.
+		// В режимах monitor и pause ожидание внутри rx_burst учитывается как работа потока.
+		if (args[i].role == ROLE_IO && opt_mode != MODE_TXONLY)
+			printf("\t %s: idle %.1f%% waiting %.1f%% cpu %.1f%%\t %llu wakeups avg %.1f us max %.1f us",
+				idle_names[args[i].idle],
+				sec > 0 ? 100.0 * args[i].idle_tsc / tsc_hz / sec : 0.0,
+				sec > 0 ? 100.0 * args[i].wait_tsc / tsc_hz / sec : 0.0,
+				sec > 0 ? 100.0 * args[i].cpu_ns / NS_PER_S / sec : 0.0,
+				args[i].wakeups, args[i].wakeups ? args[i].wake_sum_tsc * 1e6 / tsc_hz / args[i].wakeups : 0.0,
+				args[i].wake_max_tsc * 1e6 / tsc_hz);
+		// Стоимость обработки принятого пакета без GRO и с GRO (включая объединение).
+		if (args[i].gro_in)
+			printf("\t GRO merge %.2f (%.1f cycles/pkt)\t cost %.1f -> %.1f cycles/pkt",
+				(double)args[i].gro_in / args[i].gro_out, (double)args[i].gro_tsc / args[i].gro_in,
+				args[i].proc_pkts[0] ? (double)args[i].proc_tsc[0] / args[i].proc_pkts[0] : 0.0,
+				(double)args[i].proc_tsc[1] / args[i].proc_pkts[1]);
+		if (opt_pcapng_path != NULL && args[i].role == ROLE_IO)
+			printf("\t %llu capture drops", args[i].pcap_drops);
+		if (args[i].role == ROLE_WRITER)
+			printf("\t %.1f MB in %u files\t %.0f MB/s\t backlog avg %.0f max %llu\t %llu write errors",
+				args[i].pcap_bytes / 1e6, args[i].pcap_files, sec > 0 ? args[i].pcap_bytes / 1e6 / sec : 0.0,
+				args[i].fill_samples ? (double)args[i].fill_sum / args[i].fill_samples : 0.0,
+				args[i].fill_max, args[i].pcap_errors);
+		if (opt_classify != CLASSIFY_NONE && opt_mode == MODE_RXONLY && args[i].role == ROLE_IO)
+			printf("\t classify %.1f cycles/pkt", counts[i] ? (double)args[i].classify_tsc / counts[i] : 0.0);
+		printf("\n");
+	}
+	printf("All: %llu\n", all_count);
+	if (opt_mode == MODE_FORWARD)
+		print_forward_report(args, fwd_ports, nb_fwd_ports, nb_threads);
+
+	// Счётчики совпадений правил, объединённые по всем ядрам.
+	if (opt_classify != CLASSIFY_NONE && opt_mode == MODE_RXONLY) {
+		for (uint32_t r = 1; r < (opt_classify == CLASSIFY_ACL ? acl_num_rules : 2); r++) {
+			uint64_t hits = 0;
+
+			for (int i = 0; i < nb_threads; ++i)
+				hits += args[i].rule_hits[r];
+			printf("Rule %u: %llu\t %s\n", r, hits,
+				opt_classify == CLASSIFY_ACL ? acl_rule_names[r] : "check_filter()");
+		}
 	}
-	printf("All: %llu\n", all_count);
 
+	for (int i = 0; i < nb_threads; ++i)
+		free(args[i].rule_hits);
 	free(args);
 	free(counts);
 